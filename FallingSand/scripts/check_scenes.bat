@@ -0,0 +1,49 @@
+@echo off
+rem scene regression gate: plays every generated scene at a few thread counts and fails when a world hash differs
+rem from scenes_golden.txt. the file holds no ticks/sec, so it can be checked in and only fails when the
+rem simulation's behaviour changed. the hashes are the same for every compiler.
+rem ticks/sec only means something on one machine, so the perf modes keep it in scenes_perf.txt next to this
+rem script, which stays out of git, and fail when a run lost more than --scene-tolerance of it.
+rem
+rem   check_scenes.bat [exe]             check the hashes, the exe defaults to the x64 release build
+rem   check_scenes.bat save [exe]        replace the hashes, after an intended behaviour change
+rem   check_scenes.bat perf [exe]        check hashes and ticks/sec against this machine's scenes_perf.txt
+rem   check_scenes.bat save-perf [exe]   write this machine's scenes_perf.txt, from a build known to be fast
+rem set TOLERANCE before calling to allow more or less than 10% slower in perf mode
+setlocal
+set MODE=check
+if /i "%~1"=="save" set MODE=save
+if /i "%~1"=="perf" set MODE=perf
+if /i "%~1"=="save-perf" set MODE=save-perf
+if not "%MODE%"=="check" shift
+set EXE=%~1
+if "%EXE%"=="" set EXE=%~dp0..\x64\Release\FallingSand.exe
+if "%TOLERANCE%"=="" set TOLERANCE=0.1
+set BASELINE=%~dp0scenes_golden.txt
+set PERF_BASELINE=%~dp0scenes_perf.txt
+set ARGS=--scenes all --scene-resolutions 320x180 --scene-threads 1 2 3 4 --scene-ticks 120
+rem bigger worlds and more ticks so ticks/sec isn't dominated by setup and timer noise
+set PERF_ARGS=--scenes all --scene-resolutions 1280x720 --scene-threads 1 2 4 8 --scene-ticks 600
+
+if "%MODE%"=="save" (
+	"%EXE%" %ARGS% --scene-hashes-only --scene-save "%BASELINE%" || exit /b 1
+	exit /b 0
+)
+if "%MODE%"=="save-perf" (
+	if exist "%PERF_BASELINE%" del "%PERF_BASELINE%"
+	"%EXE%" %PERF_ARGS% --scene-save "%PERF_BASELINE%" || exit /b 1
+	exit /b 0
+)
+if "%MODE%"=="perf" (
+	if not exist "%PERF_BASELINE%" (
+		echo no %PERF_BASELINE% on this machine, write one with check_scenes.bat save-perf first
+		exit /b 1
+	)
+	"%EXE%" %PERF_ARGS% --scene-baseline "%PERF_BASELINE%" --scene-tolerance %TOLERANCE% || exit /b 1
+	echo scene hashes and ticks/sec within %TOLERANCE% of %PERF_BASELINE%
+	exit /b 0
+)
+rem strips land on different threads in either mode, the worlds have to come out the same
+"%EXE%" %ARGS% --scene-hashes-only --scene-baseline "%BASELINE%" || exit /b 1
+"%EXE%" %ARGS% --scene-hashes-only --persistent-workers --scene-baseline "%BASELINE%" || exit /b 1
+echo scene hashes match %BASELINE%
@@ -0,0 +1,202 @@
+﻿#include "benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include "image_loader.h"
+#include "perf_counters.h"
+#include "sdl_util.h"
+#include "simulation.h"
+#include "telemetry.h"
+
+namespace
+{
+	// sand and water piles under a few stone ledges, fixed seed so runs are comparable
+	void fill_scene(Grid& grid)
+	{
+		std::mt19937 rng(5660);
+		const int w = static_cast<int>(grid.get_width());
+		const int h = static_cast<int>(grid.get_height());
+		std::uniform_int_distribution<int> coin(0, 3);
+		for (int y = h / 3; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				const int roll = coin(rng);
+				if (roll == 0) grid.set(x, y, Particle::SAND);
+				else if (roll == 1) grid.set(x, y, Particle::WATER);
+			}
+		}
+		for (int ledge = 1; ledge <= 3; ledge++)
+		{
+			const int y = ledge * h / 12;
+			for (int x = ledge * w / 8; x < w - ledge * w / 8; x++)
+				grid.set(x, y, Particle::STONE);
+		}
+	}
+
+	// per worker and phase, ipc and misses per thousand instructions where the events could be counted
+	void report_phases()
+	{
+		const auto phases = PerfCounters::read_phases();
+		for (size_t t = 0; t < phases.size(); t++)
+		{
+			for (size_t p = 0; p < PerfCounters::PHASES; p++)
+			{
+				const auto& values = phases[t][p];
+				auto value = [&](PerfEvent event) { return values[static_cast<size_t>(event)]; };
+				if (std::all_of(values.begin(), values.end(), [](int64_t v) { return v < 0; })) continue;
+				std::cout << "thread " << t << " " << PerfCounters::name(static_cast<PerfPhase>(p)) << ":";
+				for (size_t e = 0; e < PerfCounters::EVENTS; e++)
+				{
+					if (values[e] >= 0)
+						std::cout << " " << PerfCounters::name(static_cast<PerfEvent>(e)) << " " << values[e];
+				}
+				const int64_t instructions = value(PerfEvent::INSTRUCTIONS);
+				if (instructions > 0 && value(PerfEvent::CYCLES) > 0)
+					std::cout << ", ipc " << static_cast<double>(instructions) / value(PerfEvent::CYCLES);
+				if (instructions > 0 && value(PerfEvent::CACHE_MISSES) >= 0)
+					std::cout << ", cache mpki " << value(PerfEvent::CACHE_MISSES) * 1000.0 / instructions;
+				if (instructions > 0 && value(PerfEvent::BRANCH_MISSES) >= 0)
+					std::cout << ", branch mpki " << value(PerfEvent::BRANCH_MISSES) * 1000.0 / instructions;
+				std::cout << "\n";
+			}
+		}
+	}
+
+	double ms_since(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// decode, resize and quantize, then stamping the result, against searching the palette for every cell
+	void benchmark_import(const std::string& path, const BenchmarkOptions& options, BS::thread_pool& pool, BS::synced_stream& sync_err)
+	{
+		Grid grid(options.width, options.height, sync_err, options.huge_pages);
+		ImageLoader loader(&grid, &pool);
+		EditQueue edits;
+
+		auto start = std::chrono::steady_clock::now();
+		ImageLoader::lookup();
+		const double lookup_ms = ms_since(start);
+
+		start = std::chrono::steady_clock::now();
+		if (!loader.load(path, edits)) return;
+		const double load_ms = ms_since(start);
+
+		start = std::chrono::steady_clock::now();
+		edits.apply_all(grid, pool, 5660);
+		const double apply_ms = ms_since(start);
+
+		// the pixels the import quantized, what that cost per pixel before the lookup cube, on one thread
+		std::vector<Color> pixels;
+		if (!ImageLoader::resize(path, options.width, options.height, pixels)) return;
+		std::vector<Particle::Type> searched(pixels.size());
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < pixels.size(); i++)
+			searched[i] = ImageLoader::nearest_material(pixels[i]);
+		const double search_ms = ms_since(start);
+
+		// the cube only stands for the colors around each cell's center, so it can land on a different material
+		size_t mismatches = 0;
+		for (size_t i = 0; i < pixels.size(); i++)
+			mismatches += ImageLoader::lookup_material(pixels[i]) != searched[i];
+
+		std::cout << "import " << path << ": lookup cube " << lookup_ms << " ms, load " << load_ms << " ms, stamp " << apply_ms
+			<< " ms, palette search of every pixel " << search_ms << " ms, lookup differs from the search on "
+			<< (pixels.empty() ? 0.0 : mismatches * 100.0 / pixels.size()) << "% of pixels\n";
+	}
+}
+
+Benchmark::Benchmark(const BenchmarkOptions& options) : options(options)
+{
+}
+
+int Benchmark::run()
+{
+	BS::synced_stream sync_err(std::cerr);
+	// counters have to be opened on the workers themselves
+	const auto cores = std::max(std::thread::hardware_concurrency(), 1u);
+	BS::thread_pool pool(cores, [] { PerfCounters::attach_thread(); });
+	PerfCounters::attach_thread();
+
+	if (!options.image.empty())
+		benchmark_import(options.image, options, pool, sync_err);
+
+	Grid grid(options.width, options.height, sync_err, options.huge_pages);
+	grid.reserve_chunks(grid.get_chunk_count(), pool);
+	fill_scene(grid);
+	Simulation simulation(&grid, 5660);
+	std::unique_ptr<TickWorkers> workers;
+	if (options.persistent_workers)
+	{
+		workers = std::make_unique<TickWorkers>(pool.get_thread_count(), true, [] { PerfCounters::attach_thread(); });
+		simulation.set_workers(workers.get());
+	}
+	Telemetry telemetry;
+	if (!options.telemetry.empty() && !telemetry.open(options.telemetry))
+		return 1;
+
+	// the whole world on screen at one pixel per cell
+	const Camera camera(options.width, options.height, options.width, options.height, 1.f);
+	std::vector<uint32_t> pixels;
+	if (options.phase_counters)
+		pixels.resize(static_cast<size_t>(options.width) * options.height);
+	PerfCounters::set_phase_counting(options.phase_counters);
+
+	const int64_t faults_before = PerfCounters::read_total(PerfEvent::PAGE_FAULTS);
+	const int64_t tlb_before = PerfCounters::read_total(PerfEvent::DTLB_MISSES);
+
+	std::vector<double> tick_ms;
+	tick_ms.reserve(options.ticks);
+	double schedule_us = 0;
+	for (int i = 0; i < options.ticks; i++)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		simulation.update(1.f / 30.f, pool);
+		tick_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		schedule_us += simulation.get_stats().schedule_us;
+		if (!pixels.empty())
+		{
+			SDL_Util::update_texture_via_grid(pool, pixels.data(), grid, options.width * 4, camera, 0.f);
+			telemetry.add_upload(pixels.size() * sizeof(uint32_t));
+		}
+		telemetry.record(simulation.get_stats());
+	}
+
+	const int64_t faults = PerfCounters::read_total(PerfEvent::PAGE_FAULTS);
+	const int64_t tlb = PerfCounters::read_total(PerfEvent::DTLB_MISSES);
+	telemetry.close();
+
+	double total = 0;
+	for (double ms : tick_ms) total += ms;
+	std::sort(tick_ms.begin(), tick_ms.end());
+
+	const auto stats = grid.get_allocator_stats();
+	std::cout << "grid: " << options.width << "x" << options.height << ", threads: " << pool.get_thread_count() << ", ticks: " << options.ticks << "\n";
+	if (!tick_ms.empty())
+	{
+		std::cout << "tick ms: mean " << total / tick_ms.size() << ", median " << tick_ms[tick_ms.size() / 2]
+			<< ", max " << tick_ms.back() << ", ticks/sec " << tick_ms.size() * 1000.0 / total << "\n";
+		std::cout << "scheduling us per tick: " << schedule_us / tick_ms.size() << (options.persistent_workers ? " on persistent workers" : " on the pool") << "\n";
+	}
+	std::cout << "chunks: " << stats.in_use << " in use of " << stats.capacity << " mapped in " << stats.slabs << " slabs of "
+		<< stats.slab_bytes / (1024 * 1024) << " MiB, huge pages: " << (stats.huge_pages ? "yes" : "no") << "\n";
+	auto report = [](PerfEvent event, int64_t before, int64_t after)
+	{
+		std::cout << PerfCounters::name(event) << ": ";
+		if (before < 0 || after < 0) std::cout << "n/a\n";
+		else std::cout << after - before << "\n";
+	};
+	report(PerfEvent::PAGE_FAULTS, faults_before, faults);
+	report(PerfEvent::DTLB_MISSES, tlb_before, tlb);
+	if (options.phase_counters)
+		report_phases();
+	if (PerfCounters::was_multiplexed())
+		std::cout << "note: hardware counters were multiplexed, their counts are scaled estimates\n";
+	PerfCounters::set_phase_counting(false);
+	return 0;
+}
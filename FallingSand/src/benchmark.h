@@ -0,0 +1,24 @@
+﻿#pragma once
+
+#include <string>
+
+struct BenchmarkOptions
+{
+	int width;
+	int height;
+	int ticks;
+	bool huge_pages;
+	std::string image; // also times importing this image onto a grid of the same size
+	std::string telemetry; // per tick records, same columns the game writes
+	bool phase_counters = false; // count cache and branch misses per phase and worker, and render every tick to count that too
+	bool persistent_workers = false; // strips run on pinned TickWorkers instead of pool tasks
+};
+
+// runs the simulation without a window on a generated scene and prints timing and memory counters
+class Benchmark
+{
+	BenchmarkOptions options;
+public:
+	explicit Benchmark(const BenchmarkOptions& options);
+	int run();
+};
@@ -0,0 +1,115 @@
+﻿#include "blue_noise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+namespace
+{
+	// Ulichney's void and cluster. energy is a toroidal gaussian blur of the ones in the pattern, the tightest cluster
+	// is the one with the most energy and the largest void the zero with the least
+	struct VoidAndCluster
+	{
+		static constexpr int SIZE = BlueNoise::SIZE;
+		static constexpr int CELLS = BlueNoise::CELLS;
+		static constexpr float SIGMA = 1.5f;
+
+		std::vector<float> kernel = std::vector<float>(CELLS);
+		std::vector<float> energy = std::vector<float>(CELLS);
+		std::vector<uint8_t> ones = std::vector<uint8_t>(CELLS);
+
+		VoidAndCluster()
+		{
+			for (int y = 0; y < SIZE; y++)
+			{
+				const int dy = std::min(y, SIZE - y);
+				for (int x = 0; x < SIZE; x++)
+				{
+					const int dx = std::min(x, SIZE - x);
+					kernel[y * SIZE + x] = std::exp(-static_cast<float>(dx * dx + dy * dy) / (2.f * SIGMA * SIGMA));
+				}
+			}
+		}
+
+		void toggle(int i)
+		{
+			ones[i] ^= 1;
+			const float sign = ones[i] ? 1.f : -1.f;
+			const int x0 = i % SIZE, y0 = i / SIZE;
+			for (int y = 0; y < SIZE; y++)
+			{
+				const float* row = &kernel[((y - y0) & BlueNoise::MASK) * SIZE];
+				for (int x = 0; x < SIZE; x++)
+					energy[y * SIZE + x] += sign * row[(x - x0) & BlueNoise::MASK];
+			}
+		}
+
+		int tightest_cluster() const
+		{
+			int best = -1;
+			for (int i = 0; i < CELLS; i++)
+				if (ones[i] && (best < 0 || energy[i] > energy[best])) best = i;
+			return best;
+		}
+
+		int largest_void() const
+		{
+			int best = -1;
+			for (int i = 0; i < CELLS; i++)
+				if (!ones[i] && (best < 0 || energy[i] < energy[best])) best = i;
+			return best;
+		}
+	};
+
+	std::array<uint16_t, BlueNoise::CELLS> build()
+	{
+		VoidAndCluster pattern;
+
+		// fixed seed and a plain modulo so every run, machine and standard library sprays the same cells
+		std::mt19937 generator(0xB1CE);
+		int initial = 0;
+		while (initial < BlueNoise::CELLS / 10)
+		{
+			const int i = static_cast<int>(generator() % BlueNoise::CELLS);
+			if (pattern.ones[i]) continue;
+			pattern.toggle(i);
+			initial++;
+		}
+
+		// spread the random start out until moving the tightest cluster into the largest void changes nothing
+		for (int moves = 0; moves < BlueNoise::CELLS; moves++)
+		{
+			const int cluster = pattern.tightest_cluster();
+			pattern.toggle(cluster);
+			const int gap = pattern.largest_void();
+			pattern.toggle(gap);
+			if (gap == cluster) break;
+		}
+		const VoidAndCluster start = pattern;
+
+		std::array<uint16_t, BlueNoise::CELLS> ranks{};
+		// ranks below the start pattern come from taking its clusters away one by one
+		for (int rank = initial - 1; rank >= 0; rank--)
+		{
+			const int cluster = pattern.tightest_cluster();
+			pattern.toggle(cluster);
+			ranks[cluster] = static_cast<uint16_t>(rank);
+		}
+		// the rest from filling voids
+		pattern = start;
+		for (int rank = initial; rank < BlueNoise::CELLS; rank++)
+		{
+			const int gap = pattern.largest_void();
+			pattern.toggle(gap);
+			ranks[gap] = static_cast<uint16_t>(rank);
+		}
+		return ranks;
+	}
+}
+
+const std::array<uint16_t, BlueNoise::CELLS>& BlueNoise::ranks()
+{
+	static const std::array<uint16_t, CELLS> table = build();
+	return table;
+}
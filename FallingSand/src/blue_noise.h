@@ -0,0 +1,17 @@
+﻿#pragma once
+
+#include <array>
+#include <cstdint>
+
+// tileable blue noise threshold mask. every cell gets a distinct rank, and the cells ranked below n are spread as
+// evenly as possible, so keeping ranks below density * CELLS gives an even, clump free spray at any density
+struct BlueNoise
+{
+	static constexpr int SHIFT = 6;
+	static constexpr int SIZE = 1 << SHIFT;
+	static constexpr int MASK = SIZE - 1;
+	static constexpr int CELLS = SIZE * SIZE;
+
+	// row major, built with void and cluster on first use. tile it by masking coordinates with MASK
+	static const std::array<uint16_t, CELLS>& ranks();
+};
@@ -1,61 +1,25 @@
 ﻿#include "brush.h"
 
-#include <iostream>
-#include <SDL.h>
-
-#include "grid.h"
-#include "color.h"
-
 Brush::Brush(int brush_size) : brush_size(brush_size)
 {
 }
 
-void Brush::draw_particles(Grid& grid, Particle::Type particle_type, XMFLOAT2 velocity)
-{
-	int mouseX, mouseY;
-	// when clicked on grid, set particle
-	auto left_click = SDL_GetMouseState(&mouseX, &mouseY) & SDL_BUTTON(SDL_BUTTON_LEFT);
-	auto right_click = SDL_GetMouseState(&mouseX, &mouseY) & SDL_BUTTON(SDL_BUTTON_RIGHT);
-	if (left_click || right_click)
-	{
-		if (right_click) particle_type = Particle::EMPTY;
-		// set all pixels within brush size to particle
-		for (int y = mouseY - brush_size; y < mouseY + brush_size; ++y)
-		{
-			auto local_y = y - mouseY;
-			for (int x = mouseX - brush_size; x < mouseX + brush_size; ++x)
-			{
-				auto x2 = x - mouseX;
-				x2 = x2 * x2;
-				auto y2 = y - mouseY;
-				y2 = y2 * y2;
-
-				auto local_x = x - mouseX;
-
-				if (x2 + y2 < brush_size * brush_size && should_draw(local_x, local_y))
-				{
-					grid.set(x, y, particle_type);
-					//grid.get(x, y)->velocity = velocity;
-				}
-			}
-		}
-	}
-}
-
 CircleBrush::CircleBrush(int brush_size) : Brush(brush_size)
 {
 }
 
-bool CircleBrush::should_draw(int local_x, int local_y)
+Edit CircleBrush::stroke(int from_x, int from_y, int to_x, int to_y, Particle::Type particle_type) const
 {
-	return true;
+	return { .kind = Edit::CAPSULE, .material = particle_type, .x = from_x, .y = from_y, .end_x = to_x, .end_y = to_y, .radius = brush_size };
 }
 
-RandomBrush::RandomBrush(int brush_size, float prob) : Brush(brush_size), mt(rd()), dist(0, 1), prob(prob)
+RandomBrush::RandomBrush(int brush_size, float prob) : Brush(brush_size), prob(prob)
 {
 }
 
-bool RandomBrush::should_draw(int local_x, int local_y)
+Edit RandomBrush::stroke(int from_x, int from_y, int to_x, int to_y, Particle::Type particle_type) const
 {
-	return dist(mt) < prob;
+	// prob of the swept cells, picked by the blue noise mask so the spray is even
+	return { .kind = Edit::CAPSULE, .material = particle_type, .x = from_x, .y = from_y, .end_x = to_x, .end_y = to_y,
+		.radius = brush_size, .density = prob };
 }
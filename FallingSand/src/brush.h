@@ -1,6 +1,6 @@
 ﻿#pragma once
-#include <random>
 
+#include "edit_queue.h"
 #include "grid.h"
 
 // make child class for different brush patterns
@@ -12,9 +12,9 @@ protected:
 public:
 	explicit Brush(int brush_size);
 
-	// brush pattern function
-	virtual bool should_draw(int local_x, int local_y) = 0;
-	void draw_particles(Grid& grid, Particle::Type particle_type, XMFLOAT2 velocity = {0, 0});
+	// edit painting everything the brush sweeps over moving from world cell (from_x, from_y) to (to_x, to_y), so fast
+	// mouse moves leave no gaps. the simulation applies it at the start of the next tick
+	virtual Edit stroke(int from_x, int from_y, int to_x, int to_y, Particle::Type particle_type) const = 0;
 	int get_brush_size() const { return brush_size; }
 	void set_brush_size(int size) { brush_size = size; }
 
@@ -25,16 +25,13 @@ class CircleBrush : public Brush
 {
 	public:
 	explicit CircleBrush(int brush_size);
-	bool should_draw(int local_x, int local_y) override;
+	Edit stroke(int from_x, int from_y, int to_x, int to_y, Particle::Type particle_type) const override;
 };
 
 class RandomBrush : public Brush
 {
-	std::random_device rd;
-	std::mt19937 mt;
-	std::uniform_real_distribution<float> dist;
 	float prob;
 public:
 	explicit RandomBrush(int brush_size, float prob);
-	bool should_draw(int local_x, int local_y) override;
+	Edit stroke(int from_x, int from_y, int to_x, int to_y, Particle::Type particle_type) const override;
 };
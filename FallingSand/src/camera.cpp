@@ -0,0 +1,69 @@
+﻿#include "camera.h"
+
+#include <algorithm>
+#include <cmath>
+
+Camera::Camera(int screen_width, int screen_height, int world_width, int world_height, float zoom) :
+	zoom(zoom), screen_width(screen_width), screen_height(screen_height), world_width(world_width), world_height(world_height)
+{
+	// can zoom out until the whole world fits on screen
+	min_zoom = std::min({ 1.f, static_cast<float>(screen_width) / world_width, static_cast<float>(screen_height) / world_height });
+	max_zoom = 32.f;
+	this->zoom = std::clamp(zoom, min_zoom, max_zoom);
+	clamp();
+}
+
+void Camera::clamp()
+{
+	auto clamp_axis = [](float pos, int screen, int world, float zoom)
+	{
+		const float visible = screen / zoom;
+		// center the world when it is smaller than the window
+		if (visible >= world) return -(visible - world) * 0.5f;
+		return std::clamp(pos, 0.f, world - visible);
+	};
+	x = clamp_axis(x, screen_width, world_width, zoom);
+	y = clamp_axis(y, screen_height, world_height, zoom);
+}
+
+void Camera::pan(float screen_dx, float screen_dy)
+{
+	x += screen_dx / zoom;
+	y += screen_dy / zoom;
+	clamp();
+}
+
+void Camera::zoom_at(int screen_x, int screen_y, float factor)
+{
+	const float wx = x + screen_x / zoom;
+	const float wy = y + screen_y / zoom;
+	zoom = std::clamp(zoom * factor, min_zoom, max_zoom);
+	x = wx - screen_x / zoom;
+	y = wy - screen_y / zoom;
+	clamp();
+}
+
+XMINT2 Camera::screen_to_world(int screen_x, int screen_y) const
+{
+	return {
+		static_cast<int>(std::floor(x + screen_x / zoom)),
+		static_cast<int>(std::floor(y + screen_y / zoom))
+	};
+}
+
+XMFLOAT2 Camera::world_to_screen(float world_x, float world_y) const
+{
+	return { (world_x - x) * zoom, (world_y - y) * zoom };
+}
+
+CellRect Camera::visible_cells() const
+{
+	const auto top_left = screen_to_world(0, 0);
+	const auto bottom_right = screen_to_world(screen_width - 1, screen_height - 1);
+	return {
+		std::max(top_left.x, 0),
+		std::max(top_left.y, 0),
+		std::min(bottom_right.x + 1, world_width),
+		std::min(bottom_right.y + 1, world_height)
+	};
+}
@@ -0,0 +1,43 @@
+﻿#pragma once
+
+#include <DirectXMath.h>
+
+using namespace DirectX;
+
+// half open range of cells [x0, x1) x [y0, y1)
+struct CellRect
+{
+	int x0, y0, x1, y1;
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	bool operator==(const CellRect&) const = default;
+};
+
+// maps window pixels onto a world that can be larger (or smaller) than the window
+class Camera
+{
+	float x = 0.f, y = 0.f; // world position of the top left pixel
+	float zoom; // pixels per cell
+	float min_zoom, max_zoom;
+	int screen_width, screen_height;
+	int world_width, world_height;
+
+	void clamp();
+public:
+	Camera(int screen_width, int screen_height, int world_width, int world_height, float zoom);
+
+	void pan(float screen_dx, float screen_dy);
+	// keeps the cell under (screen_x, screen_y) fixed while zooming
+	void zoom_at(int screen_x, int screen_y, float factor);
+
+	XMINT2 screen_to_world(int screen_x, int screen_y) const;
+	XMFLOAT2 world_to_screen(float world_x, float world_y) const;
+	// cells with at least one pixel on screen, clipped to the world
+	CellRect visible_cells() const;
+
+	float get_x() const { return x; }
+	float get_y() const { return y; }
+	float get_zoom() const { return zoom; }
+	int get_screen_width() const { return screen_width; }
+	int get_screen_height() const { return screen_height; }
+};
@@ -0,0 +1,189 @@
+﻿#include "chunk_allocator.h"
+
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "profiling.h"
+
+namespace
+{
+	constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+	constexpr size_t PAGE_SIZE = 4096;
+	constexpr size_t SLAB_TARGET_BYTES = 8 * 1024 * 1024;
+
+	size_t round_up(size_t value, size_t multiple)
+	{
+		return (value + multiple - 1) / multiple * multiple;
+	}
+}
+
+ChunkAllocator::ChunkAllocator(size_t block_size, bool huge_pages) :
+	block_size(round_up(block_size, ALIGNMENT) + ALIGNMENT), use_huge_pages(huge_pages), slabs(std::make_unique<Slab[]>(MAX_SLABS))
+{
+	// slabs are whole huge pages so they can be backed by them, and hold at least one block
+	slab_bytes = round_up(std::max(SLAB_TARGET_BYTES, this->block_size), HUGE_PAGE_SIZE);
+	blocks_per_slab = slab_bytes / this->block_size;
+}
+
+ChunkAllocator::~ChunkAllocator()
+{
+	const size_t count = slab_count.load();
+	for (size_t i = 0; i < count; i++)
+	{
+		PROFILE_FREE(slabs[i].memory, "chunk slabs");
+		unmap_slab(slabs[i]);
+	}
+}
+
+ChunkAllocator::Slab ChunkAllocator::map_slab(size_t bytes, bool huge_pages)
+{
+#ifdef _WIN32
+	if (huge_pages)
+	{
+		// needs SeLockMemoryPrivilege, fall back to normal pages without it
+		const size_t large = GetLargePageMinimum();
+		if (large > 0)
+		{
+			void* memory = VirtualAlloc(nullptr, round_up(bytes, large), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (memory)
+				return { static_cast<std::byte*>(memory), round_up(bytes, large), true };
+		}
+	}
+	void* memory = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!memory) throw std::bad_alloc();
+	return { static_cast<std::byte*>(memory), bytes, false };
+#else
+#ifdef MAP_HUGETLB
+	if (huge_pages)
+	{
+		// only succeeds if the admin reserved hugetlbfs pages, transparent huge pages are the fallback
+		void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory != MAP_FAILED)
+			return { static_cast<std::byte*>(memory), bytes, true };
+	}
+#endif
+	void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+	if (huge_pages)
+		madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+	return { static_cast<std::byte*>(memory), bytes, false };
+#endif
+}
+
+void ChunkAllocator::unmap_slab(const Slab& slab)
+{
+#ifdef _WIN32
+	VirtualFree(slab.memory, 0, MEM_RELEASE);
+#else
+	munmap(slab.memory, slab.bytes);
+#endif
+}
+
+ChunkAllocator::Header* ChunkAllocator::header_at(uint32_t index) const
+{
+	const size_t i = index - 1;
+	return reinterpret_cast<Header*>(slabs[i / blocks_per_slab].memory + (i % blocks_per_slab) * block_size);
+}
+
+void ChunkAllocator::push_chain(uint32_t first, uint32_t last)
+{
+	uint64_t old_head = head.load(std::memory_order_relaxed);
+	uint64_t new_head;
+	do
+	{
+		header_at(last)->next = static_cast<uint32_t>(old_head);
+		new_head = ((old_head >> 32) + 1) << 32 | first;
+	} while (!head.compare_exchange_weak(old_head, new_head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+bool ChunkAllocator::grow(BS::thread_pool* pool)
+{
+	const size_t index = slab_count.load(std::memory_order_relaxed);
+	if (index >= MAX_SLABS) return false;
+
+	Slab slab = map_slab(slab_bytes, use_huge_pages);
+	if (pool)
+	{
+		const BS::multi_future<void> touch = pool->submit_loop<size_t>(0, slab.bytes / PAGE_SIZE,
+			[&slab](const size_t page)
+			{
+				*reinterpret_cast<volatile std::byte*>(slab.memory + page * PAGE_SIZE) = std::byte{ 0 };
+			});
+		touch.wait();
+	}
+	PROFILE_ALLOC(slab.memory, slab.bytes, "chunk slabs");
+	slabs[index] = slab;
+	slab_count.store(index + 1, std::memory_order_release);
+
+	// link the new blocks together before publishing them with a single push
+	const auto first = static_cast<uint32_t>(index * blocks_per_slab + 1);
+	const auto last = static_cast<uint32_t>(first + blocks_per_slab - 1);
+	for (uint32_t i = first; i <= last; i++)
+		*header_at(i) = { i, i + 1 };
+	push_chain(first, last);
+	return true;
+}
+
+void* ChunkAllocator::allocate()
+{
+	while (true)
+	{
+		uint64_t old_head = head.load(std::memory_order_acquire);
+		while (static_cast<uint32_t>(old_head) != NIL)
+		{
+			const auto index = static_cast<uint32_t>(old_head);
+			// the block may be handed out by someone else before the CAS, the tag makes that CAS fail
+			const uint32_t next = header_at(index)->next;
+			const uint64_t new_head = ((old_head >> 32) + 1) << 32 | next;
+			if (head.compare_exchange_weak(old_head, new_head, std::memory_order_acquire, std::memory_order_acquire))
+			{
+				in_use.fetch_add(1, std::memory_order_relaxed);
+				return reinterpret_cast<std::byte*>(header_at(index)) + ALIGNMENT;
+			}
+		}
+
+		std::lock_guard lock(grow_mutex);
+		if (static_cast<uint32_t>(head.load(std::memory_order_acquire)) == NIL && !grow(nullptr))
+			throw std::bad_alloc();
+	}
+}
+
+void ChunkAllocator::free(void* block)
+{
+	const uint32_t index = reinterpret_cast<Header*>(static_cast<std::byte*>(block) - ALIGNMENT)->index;
+	in_use.fetch_sub(1, std::memory_order_relaxed);
+	push_chain(index, index);
+}
+
+void ChunkAllocator::reserve(size_t count, BS::thread_pool* pool)
+{
+	std::lock_guard lock(grow_mutex);
+	while (slab_count.load(std::memory_order_relaxed) * blocks_per_slab < in_use.load(std::memory_order_relaxed) + count)
+	{
+		if (!grow(pool)) break;
+	}
+}
+
+ChunkAllocator::Stats ChunkAllocator::get_stats() const
+{
+	const size_t count = slab_count.load(std::memory_order_acquire);
+	bool huge = false;
+	for (size_t i = 0; i < count; i++)
+		huge |= slabs[i].huge;
+	return {
+		.slabs = count,
+		.slab_bytes = slab_bytes,
+		.capacity = count * blocks_per_slab,
+		.in_use = in_use.load(std::memory_order_relaxed),
+		.huge_pages = huge,
+	};
+}
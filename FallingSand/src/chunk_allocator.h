@@ -0,0 +1,78 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include <BS_thread_pool.hpp>
+
+// fixed size block allocator for grid chunks. blocks are carved out of large slabs (optionally huge pages)
+// and recycled through a lock free free list, so allocating or releasing a chunk mid tick never takes a lock
+class ChunkAllocator
+{
+public:
+	struct Stats
+	{
+		size_t slabs;
+		size_t slab_bytes;
+		size_t capacity; // blocks mapped
+		size_t in_use;
+		bool huge_pages; // at least one slab got explicit huge pages
+	};
+
+	static constexpr size_t ALIGNMENT = 64;
+
+	ChunkAllocator(size_t block_size, bool huge_pages);
+	~ChunkAllocator();
+	ChunkAllocator(const ChunkAllocator&) = delete;
+	ChunkAllocator& operator=(const ChunkAllocator&) = delete;
+
+	void* allocate();
+	void free(void* block);
+	// maps slabs until count blocks are free. if a pool is given every worker touches part of the new pages,
+	// so they are faulted in up front and first touch places them near the threads that simulate them.
+	// don't call while the pool is running a tick, workers allocating would wait on it
+	void reserve(size_t count, BS::thread_pool* pool = nullptr);
+	Stats get_stats() const;
+	size_t get_in_use() const { return in_use.load(std::memory_order_relaxed); }
+
+private:
+	static constexpr size_t MAX_SLABS = 4096;
+	static constexpr uint32_t NIL = 0;
+
+	struct Slab
+	{
+		std::byte* memory;
+		size_t bytes;
+		bool huge;
+	};
+
+	// every block starts with a cache line the caller never sees, holding its own index and the free list link
+	struct Header
+	{
+		uint32_t index;
+		uint32_t next;
+	};
+
+	size_t block_size; // including the header
+	size_t blocks_per_slab;
+	size_t slab_bytes;
+	bool use_huge_pages;
+
+	// slab table is append only, so a block index can be turned into an address without locking
+	std::unique_ptr<Slab[]> slabs;
+	std::atomic<size_t> slab_count = 0;
+	std::mutex grow_mutex;
+
+	// head of the free list, low 32 bits are block index + 1, high 32 bits a tag bumped on every change (ABA)
+	std::atomic<uint64_t> head = 0;
+	std::atomic<size_t> in_use = 0;
+
+	Header* header_at(uint32_t index) const;
+	void push_chain(uint32_t first, uint32_t last);
+	bool grow(BS::thread_pool* pool);
+	static Slab map_slab(size_t bytes, bool huge_pages);
+	static void unmap_slab(const Slab& slab);
+};
@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <random>
 
+#include "thread_random.h"
+
 XMFLOAT3 Color::to_hsl() const
 {
 	float r = static_cast<float>(this->r()) / 255.0f;
@@ -77,17 +79,16 @@ void Color::from_hsl(float h, float s, float l)
 template<typename T>
 T Color_Util::generate(T min, T max)
 {
-	static std::random_device rd;
-	static std::mt19937 gen(rd());
+	// per thread so painting from workers doesn't race and a seeded session repeats the same colors,
+	// no std distributions so the colors don't depend on the standard library either
 	if constexpr (std::is_integral_v<T>)
 	{
-		std::uniform_int_distribution<T> dist(min, max);
-		return dist(gen);
+		const uint64_t span = static_cast<uint64_t>(max) - static_cast<uint64_t>(min) + 1;
+		return static_cast<T>(min + static_cast<T>(thread_generator()() % span));
 	}
 	else if constexpr (std::is_floating_point_v<T>)
 	{
-		std::uniform_real_distribution<T> dist(min, max);
-		return dist(gen);
+		return min + (max - min) * static_cast<T>(thread_rand());
 	}
 	assert(false);
 	return {};
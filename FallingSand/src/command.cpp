@@ -0,0 +1,248 @@
+﻿#include "command.h"
+
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+
+#include "brush.h"
+#include "profiling.h"
+#include "simulation.h"
+#include "snapshot.h"
+
+namespace
+{
+	constexpr const char* LOG_MAGIC = "falling_sand_commands";
+	constexpr int LOG_VERSION = 4;
+	// same probability the game's spray brush always used
+	constexpr float RANDOM_BRUSH_PROBABILITY = 0.1f;
+}
+
+CommandRunner::CommandRunner(Grid& grid, Simulation& simulation, BS::thread_pool& pool) :
+	grid(grid), simulation(simulation), pool(pool), image_loader(&grid, &pool)
+{
+}
+
+void CommandRunner::execute(const Command& command)
+{
+	PROFILE_FUNCTION();
+	switch (command.kind)
+	{
+	case Command::BRUSH:
+		if (command.shape == Command::RANDOM)
+			simulation.get_edits().push(RandomBrush(command.size, RANDOM_BRUSH_PROBABILITY).stroke(command.from_x, command.from_y, command.x, command.y, command.material));
+		else
+			simulation.get_edits().push(CircleBrush(command.size).stroke(command.from_x, command.from_y, command.x, command.y, command.material));
+		break;
+	case Command::IMAGE:
+		image_loader.start(command.path);
+		break;
+	case Command::TILES:
+	{
+		// a replay waits for the import to catch up with the log
+		std::vector<Edit> tiles;
+		image_loader.take(command.size, tiles, true);
+		for (Edit& tile : tiles)
+			simulation.get_edits().push(std::move(tile));
+		break;
+	}
+	case Command::WORLD:
+		// edits made before the load must not land on top of it
+		simulation.apply_edits(pool);
+		Snapshot::load(grid, command.path, pool);
+		break;
+	case Command::FOCUS:
+		simulation.set_focus(command.focus);
+		break;
+	case Command::CAPTURE:
+		stamps.capture(command.name, grid, command.focus);
+		break;
+	case Command::PLACE:
+		stamps.place(command.name, command.x, command.y, simulation.get_edits());
+		break;
+	case Command::STAMPS:
+		stamps.load(command.path);
+		break;
+	case Command::STAMP_IMAGE:
+		stamps.import(stamp_name(command.path), command.path, image_loader);
+		break;
+	}
+
+	if (!log.is_open()) return;
+	log << command.tick << ' ';
+	switch (command.kind)
+	{
+	case Command::BRUSH:
+		log << "brush " << (command.shape == Command::RANDOM ? "random" : "circle") << ' ' << command.size << ' '
+			<< command.from_x << ' ' << command.from_y << ' ' << command.x << ' ' << command.y << ' ' << command.material << '\n';
+		break;
+	case Command::IMAGE:
+		log << "image " << command.path << '\n';
+		break;
+	case Command::TILES:
+		log << "tiles " << command.size << '\n';
+		break;
+	case Command::WORLD:
+		log << "world " << command.path << '\n';
+		break;
+	case Command::FOCUS:
+		log << "focus " << command.focus.x0 << ' ' << command.focus.y0 << ' ' << command.focus.x1 << ' ' << command.focus.y1 << '\n';
+		break;
+	case Command::CAPTURE:
+		log << "capture " << command.focus.x0 << ' ' << command.focus.y0 << ' ' << command.focus.x1 << ' ' << command.focus.y1
+			<< ' ' << command.name << '\n';
+		break;
+	case Command::PLACE:
+		log << "place " << command.x << ' ' << command.y << ' ' << command.name << '\n';
+		break;
+	case Command::STAMPS:
+		log << "stamps " << command.path << '\n';
+		break;
+	case Command::STAMP_IMAGE:
+		log << "stamp_image " << command.path << '\n';
+		break;
+	}
+}
+
+std::string CommandRunner::stamp_name(const std::string& path)
+{
+	return std::filesystem::path(path).stem().string();
+}
+
+void CommandRunner::poll(uint64_t tick)
+{
+	const size_t ready = image_loader.get_ready();
+	if (ready > 0)
+		execute({ .tick = tick, .kind = Command::TILES, .size = static_cast<int>(ready) });
+}
+
+bool CommandRunner::start_log(const std::string& path)
+{
+	finish_log();
+	log.open(path, std::ios::trunc);
+	if (!log)
+	{
+		std::cerr << "Failed to open command log for writing: " << path << std::endl;
+		return false;
+	}
+	log_path = path;
+	log << LOG_MAGIC << ' ' << LOG_VERSION << '\n'
+		<< "world " << grid.get_width() << ' ' << grid.get_height() << " threads " << pool.get_thread_count()
+		<< " seed " << simulation.get_seed() << " tick " << simulation.get_tick() << '\n';
+	return true;
+}
+
+void CommandRunner::finish_log()
+{
+	if (!log.is_open()) return;
+	log << "end " << simulation.get_tick() << '\n';
+	log.close();
+	if (!log)
+		std::cerr << "Failed to write command log: " << log_path << std::endl;
+	else
+		std::cout << "Recorded commands to " << log_path << std::endl;
+}
+
+bool CommandRunner::read_log(const std::string& path, CommandLogInfo& info, std::vector<Command>& commands)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		std::cerr << "Failed to open command log: " << path << std::endl;
+		return false;
+	}
+
+	std::string magic, word;
+	int version = 0;
+	uint64_t start_tick = 0;
+	file >> magic >> version;
+	file >> word >> info.width >> info.height >> word >> info.threads >> word >> info.seed >> word >> start_tick;
+	if (!file || magic != LOG_MAGIC || version != LOG_VERSION)
+	{
+		std::cerr << "Not a command log: " << path << std::endl;
+		return false;
+	}
+	// logs started mid session can't be replayed, the world they started from isn't in the file
+	if (start_tick != 0)
+	{
+		std::cerr << "Command log starts at tick " << start_tick << ", only logs started with the session can be replayed" << std::endl;
+		return false;
+	}
+
+	commands.clear();
+	info.ticks = 0;
+	std::string line;
+	std::getline(file, line);
+	int line_number = 2;
+	while (std::getline(file, line))
+	{
+		line_number++;
+		if (line.empty()) continue;
+		std::istringstream in(line);
+		if (line.rfind("end ", 0) == 0)
+		{
+			in >> word >> info.ticks;
+			break;
+		}
+
+		Command command;
+		std::string kind;
+		in >> command.tick >> kind;
+		bool ok = static_cast<bool>(in);
+		if (kind == "brush")
+		{
+			std::string shape;
+			int material = 0;
+			in >> shape >> command.size >> command.from_x >> command.from_y >> command.x >> command.y >> material;
+			command.kind = Command::BRUSH;
+			command.shape = shape == "random" ? Command::RANDOM : Command::CIRCLE;
+			command.material = static_cast<Particle::Type>(material);
+			ok = in && ParticleUtils::colors.contains(command.material);
+		}
+		else if (kind == "image" || kind == "world" || kind == "stamps" || kind == "stamp_image")
+		{
+			command.kind = kind == "image" ? Command::IMAGE : kind == "world" ? Command::WORLD : kind == "stamps" ? Command::STAMPS : Command::STAMP_IMAGE;
+			std::getline(in >> std::ws, command.path);
+			ok = ok && !command.path.empty();
+		}
+		else if (kind == "capture")
+		{
+			command.kind = Command::CAPTURE;
+			in >> command.focus.x0 >> command.focus.y0 >> command.focus.x1 >> command.focus.y1;
+			std::getline(in >> std::ws, command.name);
+			ok = in && !command.name.empty();
+		}
+		else if (kind == "place")
+		{
+			command.kind = Command::PLACE;
+			in >> command.x >> command.y;
+			std::getline(in >> std::ws, command.name);
+			ok = in && !command.name.empty();
+		}
+		else if (kind == "tiles")
+		{
+			command.kind = Command::TILES;
+			in >> command.size;
+			ok = in && command.size > 0;
+		}
+		else if (kind == "focus")
+		{
+			command.kind = Command::FOCUS;
+			in >> command.focus.x0 >> command.focus.y0 >> command.focus.x1 >> command.focus.y1;
+			ok = static_cast<bool>(in);
+		}
+		else
+		{
+			ok = false;
+		}
+
+		if (!ok || (!commands.empty() && command.tick < commands.back().tick))
+		{
+			std::cerr << "Bad command on line " << line_number << " of " << path << std::endl;
+			return false;
+		}
+		commands.push_back(std::move(command));
+	}
+	if (info.ticks == 0 && !commands.empty())
+		info.ticks = commands.back().tick;
+	return true;
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+#include "camera.h"
+#include "grid.h"
+#include "image_loader.h"
+#include "stamp_library.h"
+
+class Simulation;
+
+// one user edit, stamped with the tick it was made after so a log can put it back at the same point
+struct Command
+{
+	enum Kind : uint8_t
+	{
+		BRUSH,
+		IMAGE, // start importing an image in the background
+		TILES, // size more tiles of the images being imported are ready to land
+		WORLD, // load a snapshot
+		FOCUS, // region the simulation ticks every step, follows the camera
+		CAPTURE, // copy a region of the world into the stamp library
+		PLACE, // stamp a library stamp with its top left corner at x, y
+		STAMPS, // load a stamp library file
+		STAMP_IMAGE, // import an image into the stamp library, named after the file
+	};
+
+	enum Shape : uint8_t
+	{
+		CIRCLE,
+		RANDOM,
+	};
+
+	uint64_t tick = 0;
+	Kind kind = BRUSH;
+
+	// BRUSH
+	Shape shape = CIRCLE;
+	int size = 0; // tile count for TILES
+	int x = 0, y = 0; // world cell under the brush center, stamp corner for PLACE
+	int from_x = 0, from_y = 0; // where the center was last frame, the stroke covers everything in between
+	Particle::Type material = Particle::SAND; // EMPTY erases
+
+	// FOCUS and CAPTURE
+	CellRect focus{};
+
+	// IMAGE, WORLD, STAMPS and STAMP_IMAGE
+	std::string path;
+
+	// CAPTURE and PLACE
+	std::string name;
+};
+
+// everything a log has to be replayed with to come out the same
+struct CommandLogInfo
+{
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int threads = 0;
+	uint64_t seed = 0;
+	uint64_t ticks = 0; // ticks the session ran for
+};
+
+// applies commands the same way in the game and in headless runs. edits go through the simulation's queue, which
+// seeds its rng from the session seed and tick, so what a brush or import produces only depends on the log.
+// optionally writes each command to a text log, one per line
+class CommandRunner
+{
+	Grid& grid;
+	Simulation& simulation;
+	BS::thread_pool& pool;
+	ImageLoader image_loader;
+	StampLibrary stamps;
+	std::ofstream log;
+	std::string log_path;
+public:
+	CommandRunner(Grid& grid, Simulation& simulation, BS::thread_pool& pool);
+
+	void execute(const Command& command);
+	// main thread before each tick in the game. lands the import tiles that finished since the last call as a TILES
+	// command, so a replayed log lands them at the same ticks
+	void poll(uint64_t tick);
+
+	// logs every command from now on, the grid should still be in the state the log starts from
+	bool start_log(const std::string& path);
+	// records how long the session ran and closes the log
+	void finish_log();
+
+	const StampLibrary& get_stamps() const { return stamps; }
+	// name a STAMP_IMAGE command gives the stamp for path
+	static std::string stamp_name(const std::string& path);
+
+	static bool read_log(const std::string& path, CommandLogInfo& info, std::vector<Command>& commands);
+};
@@ -0,0 +1,220 @@
+﻿#include "edit_queue.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "blue_noise.h"
+#include "profiling.h"
+#include "stamp_library.h"
+
+EditQueue::~EditQueue()
+{
+	Node* node = head.exchange(nullptr);
+	while (node)
+	{
+		Node* next = node->next;
+		delete node;
+		node = next;
+	}
+}
+
+void EditQueue::push(Edit edit)
+{
+	Node* node = new Node{ std::move(edit), head.load(std::memory_order_relaxed) };
+	while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+namespace
+{
+	// inclusive x range of row y lying within a capsule, empty when first > second
+	struct Span
+	{
+		int x0 = 1, x1 = 0;
+		void add(int a, int b)
+		{
+			if (a > b) return;
+			if (x0 > x1) { x0 = a; x1 = b; }
+			else { x0 = std::min(x0, a); x1 = std::max(x1, b); }
+		}
+	};
+
+	// cells of row y with dx^2 + dy^2 < r^2 around (cx, cy), exact like the old per cell test
+	void circle_span(Span& span, int cx, int cy, int r, int y)
+	{
+		const int dy = y - cy;
+		const int rest = r * r - dy * dy;
+		if (rest <= 0) return;
+		int h = static_cast<int>(std::sqrt(static_cast<float>(rest - 1)));
+		while (h * h >= rest) h--;
+		while ((h + 1) * (h + 1) < rest) h++;
+		span.add(cx - h, cx + h);
+	}
+
+	// the capsule row is the hull of both end circles and the band swept between them, so the union of their spans
+	Span capsule_span(const Edit& edit, int y)
+	{
+		Span span;
+		circle_span(span, edit.x, edit.y, edit.radius, y);
+		const int dx = edit.end_x - edit.x;
+		const int dy = edit.end_y - edit.y;
+		if (dx == 0 && dy == 0) return span;
+		circle_span(span, edit.end_x, edit.end_y, edit.radius, y);
+
+		// band: 0 <= (p - a).d <= |d|^2 and |(p - a) x d| < r |d|, both linear in the cell's x
+		const double length2 = static_cast<double>(dx) * dx + static_cast<double>(dy) * dy;
+		const double ry = y - edit.y;
+		double lo = -1e30, hi = 1e30;
+		auto clamp_side = [&](double slope, double offset, double min, double max)
+		{
+			// min <= slope * px + offset <= max
+			if (slope == 0.0)
+			{
+				if (offset < min || offset > max) { lo = 1; hi = 0; }
+				return;
+			}
+			double a = (min - offset) / slope, b = (max - offset) / slope;
+			if (a > b) std::swap(a, b);
+			lo = std::max(lo, a);
+			hi = std::min(hi, b);
+		};
+		clamp_side(dx, ry * dy, 0.0, length2);
+		const double reach = edit.radius * std::sqrt(length2);
+		clamp_side(-dy, ry * dx, -reach, reach);
+		if (lo <= hi)
+			span.add(edit.x + static_cast<int>(std::ceil(lo)), edit.x + static_cast<int>(std::floor(hi)));
+		return span;
+	}
+}
+
+void EditQueue::apply(Grid& grid, const Edit& edit, const CellRect& clip, int noise_x, int noise_y)
+{
+	const auto threshold = static_cast<int>(edit.density * BlueNoise::CELLS);
+	auto paint = [&](int x0, int x1, int y, Particle::Type type)
+	{
+		if (edit.density >= 1.f)
+		{
+			grid.fill_span(x0, x1, y, type);
+			return;
+		}
+		const uint16_t* ranks = &BlueNoise::ranks()[((y + noise_y) & BlueNoise::MASK) * BlueNoise::SIZE];
+		for (int x = x0; x < x1; x++)
+			if (ranks[(x + noise_x) & BlueNoise::MASK] < threshold)
+				grid.set(x, y, type);
+	};
+
+	switch (edit.kind)
+	{
+	case Edit::CAPSULE:
+		for (int y = clip.y0; y < clip.y1; y++)
+		{
+			const Span span = capsule_span(edit, y);
+			const int x0 = std::max(span.x0, clip.x0);
+			const int x1 = std::min(span.x1 + 1, clip.x1);
+			if (x0 < x1)
+				paint(x0, x1, y, edit.material);
+		}
+		break;
+	case Edit::RECT:
+		for (int y = clip.y0; y < clip.y1; y++)
+			paint(clip.x0, clip.x1, y, edit.material);
+		break;
+	case Edit::STAMP:
+		for (int y = clip.y0; y < clip.y1; y++)
+		{
+			// images come in long runs of one material
+			const Particle::Type* row = edit.stamp->data() + static_cast<size_t>(y - edit.y) * edit.width - edit.x;
+			for (int x = clip.x0; x < clip.x1;)
+			{
+				int end = x + 1;
+				while (end < clip.x1 && row[end] == row[x]) end++;
+				paint(x, end, y, row[x]);
+				x = end;
+			}
+		}
+		break;
+	case Edit::PREFAB:
+		for (int y = clip.y0; y < clip.y1; y++)
+		{
+			const auto& prefab = *edit.prefab;
+			int x = edit.x;
+			for (uint32_t r = prefab.rows[y - edit.y]; r < prefab.rows[y - edit.y + 1] && x < clip.x1; r++)
+			{
+				const Stamp::Run& run = prefab.runs[r];
+				const int x0 = std::max(x, clip.x0);
+				const int x1 = std::min(x + run.length, clip.x1);
+				if (run.type != Particle::EMPTY && x0 < x1)
+					paint(x0, x1, y, run.type);
+				x += run.length;
+			}
+		}
+		break;
+	}
+}
+
+void EditQueue::apply_all(Grid& grid, BS::thread_pool& pool, uint64_t seed)
+{
+	Node* node = head.exchange(nullptr, std::memory_order_acquire);
+	if (!node) return;
+	PROFILE_FUNCTION();
+
+	// back into the order they were pushed in
+	std::vector<std::unique_ptr<Node>> batch;
+	for (; node; node = node->next)
+		batch.emplace_back(node);
+	std::reverse(batch.begin(), batch.end());
+
+	// cells each edit covers, clipped to the world
+	const int width = static_cast<int>(grid.get_width());
+	const int height = static_cast<int>(grid.get_height());
+	std::vector<CellRect> bounds(batch.size());
+	chunk_edits.resize(grid.get_chunk_count());
+	for (uint32_t i = 0; i < batch.size(); i++)
+	{
+		const Edit& edit = batch[i]->edit;
+		CellRect rect = edit.kind == Edit::CAPSULE
+			? CellRect{ std::min(edit.x, edit.end_x) - edit.radius, std::min(edit.y, edit.end_y) - edit.radius,
+				std::max(edit.x, edit.end_x) + edit.radius, std::max(edit.y, edit.end_y) + edit.radius }
+			: CellRect{ edit.x, edit.y, edit.x + edit.width, edit.y + edit.height };
+		if (edit.kind == Edit::STAMP && (!edit.stamp || edit.stamp->size() < static_cast<size_t>(edit.width) * edit.height))
+			rect = {};
+		if (edit.kind == Edit::PREFAB && (!edit.prefab || edit.prefab->width != edit.width || edit.prefab->height != edit.height))
+			rect = {};
+		rect = { std::max(rect.x0, 0), std::max(rect.y0, 0), std::min(rect.x1, width), std::min(rect.y1, height) };
+		bounds[i] = rect;
+		if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1) continue;
+
+		for (int cy = rect.y0 >> CHUNK_SHIFT; cy <= (rect.y1 - 1) >> CHUNK_SHIFT; cy++)
+		{
+			for (int cx = rect.x0 >> CHUNK_SHIFT; cx <= (rect.x1 - 1) >> CHUNK_SHIFT; cx++)
+			{
+				const auto chunk = static_cast<uint32_t>(cy * grid.get_chunks_x() + cx);
+				if (chunk_edits[chunk].empty())
+					touched.push_back(chunk);
+				chunk_edits[chunk].push_back(i);
+			}
+		}
+	}
+
+	// chunks are disjoint, so every chunk can take its edits in order on its own worker
+	const int chunks_x = static_cast<int>(grid.get_chunks_x());
+	const BS::multi_future<void> paint = pool.submit_loop<size_t>(0, touched.size(),
+		[&](const size_t t)
+		{
+			const uint32_t chunk = touched[t];
+			seed_thread_rand(mix_seed(seed, chunk));
+			const int x0 = static_cast<int>(chunk % chunks_x) << CHUNK_SHIFT;
+			const int y0 = static_cast<int>(chunk / chunks_x) << CHUNK_SHIFT;
+			for (const uint32_t i : chunk_edits[chunk])
+			{
+				const CellRect& rect = bounds[i];
+				const CellRect clip = { std::max(rect.x0, x0), std::max(rect.y0, y0), std::min(rect.x1, x0 + CHUNK_SIZE), std::min(rect.y1, y0 + CHUNK_SIZE) };
+				const uint64_t noise = mix_seed(seed, i, 1);
+				apply(grid, batch[i]->edit, clip, static_cast<int>(noise & BlueNoise::MASK), static_cast<int>((noise >> BlueNoise::SHIFT) & BlueNoise::MASK));
+			}
+			chunk_edits[chunk].clear();
+		});
+	paint.wait();
+	touched.clear();
+}
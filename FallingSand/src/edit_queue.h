@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+#include "camera.h"
+#include "grid.h"
+
+struct Stamp;
+
+// a grid edit made outside the simulation, erasing is painting EMPTY
+struct Edit
+{
+	enum Kind : uint8_t
+	{
+		CAPSULE, // cells closer than radius to the segment from (x, y) to (end_x, end_y), a circle if the ends match
+		RECT, // width * height cells from (x, y)
+		STAMP, // width * height types from (x, y), row major
+		PREFAB, // a library stamp from (x, y), its empty cells are left alone
+	};
+
+	Kind kind = CAPSULE;
+	Particle::Type material = Particle::SAND;
+	int x = 0, y = 0;
+	int end_x = 0, end_y = 0;
+	int radius = 0;
+	int width = 0, height = 0;
+	float density = 1.f; // share of covered cells painted, below 1 sprays through a blue noise mask
+	std::shared_ptr<const std::vector<Particle::Type>> stamp;
+	std::shared_ptr<const Stamp> prefab;
+};
+
+// multi producer, single consumer. any thread can push without locking, the simulation drains everything between
+// ticks and applies it in parallel by chunk. edits touching the same chunk keep their order, so the result is the same
+// as applying them one after another
+class EditQueue
+{
+	struct Node
+	{
+		Edit edit;
+		Node* next;
+	};
+
+	// pushed newest first, the consumer takes the whole list at once so there is no ABA to worry about
+	std::atomic<Node*> head = nullptr;
+
+	// reused between drains, edits per chunk by index into the batch
+	std::vector<std::vector<uint32_t>> chunk_edits;
+	std::vector<uint32_t> touched;
+
+	// edits are written a row span at a time, noise_x and noise_y shift the spray mask so strokes don't line up
+	static void apply(Grid& grid, const Edit& edit, const CellRect& clip, int noise_x, int noise_y);
+public:
+	EditQueue() = default;
+	~EditQueue();
+	EditQueue(const EditQueue&) = delete;
+	EditQueue& operator=(const EditQueue&) = delete;
+
+	void push(Edit edit);
+	// consumer only. seed makes sprays and color variation repeatable
+	void apply_all(Grid& grid, BS::thread_pool& pool, uint64_t seed);
+};
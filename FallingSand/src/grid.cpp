@@ -1,14 +1,127 @@
 ﻿#include "grid.h"
 
-Grid::Grid(unsigned int width, unsigned int height, BS::synced_stream& sync_err) :
-	width(width), height(height), sync_err(sync_err)
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <new>
+#include <BS_thread_pool.hpp>
+
+#include "profiling.h"
+
+Grid::Grid(unsigned int width, unsigned int height, BS::synced_stream& sync_err, bool huge_pages) :
+	width(width), height(height), sync_err(sync_err), allocator(sizeof(Chunk), huge_pages)
 {
-	this->grid = new Particle[static_cast<size_t>(width * height)];
+	chunks_x = (width + CHUNK_MASK) >> CHUNK_SHIFT;
+	chunks_y = (height + CHUNK_MASK) >> CHUNK_SHIFT;
+	chunks = std::make_unique<std::atomic<Chunk*>[]>(get_chunk_count());
+	for (size_t i = 0; i < get_chunk_count(); i++)
+		chunks[i].store(&null_chunk, std::memory_order_relaxed);
 }
 
 Grid::~Grid()
 {
-	delete[] grid;
+	// chunk memory itself goes away with the allocator's slabs
+	for (size_t i = 0; i < get_chunk_count(); i++)
+	{
+		auto chunk = chunks[i].load(std::memory_order_relaxed);
+		if (chunk != &null_chunk)
+		{
+			PROFILE_FREE(chunk, "grid chunks");
+			chunk->~Chunk();
+		}
+	}
+}
+
+Chunk* Grid::allocate_chunk()
+{
+	Chunk* chunk = new (allocator.allocate()) Chunk;
+	PROFILE_ALLOC(chunk, sizeof(Chunk), "grid chunks");
+	return chunk;
+}
+
+void Grid::free_chunk(Chunk* chunk)
+{
+	PROFILE_FREE(chunk, "grid chunks");
+	chunk->~Chunk();
+	allocator.free(chunk);
+}
+
+Chunk* Grid::writable_chunk(int x, int y)
+{
+	auto& slot = chunk_at(x, y);
+	Chunk* chunk = slot.load(std::memory_order_acquire);
+	if (chunk != &null_chunk) return chunk;
+
+	// two threads can hit the same empty chunk at once, loser hands its chunk back
+	Chunk* fresh = allocate_chunk();
+	if (slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+		return fresh;
+	free_chunk(fresh);
+	return chunk;
+}
+
+size_t Grid::count_particles() const
+{
+	size_t count = 0;
+	for (size_t i = 0; i < get_chunk_count(); i++)
+		count += chunks[i].load(std::memory_order_acquire)->occupied.load(std::memory_order_relaxed);
+	return count;
+}
+
+uint64_t Grid::hash() const
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (unsigned int y = 0; y < height; y++)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			const Particle* particle = get(x, y);
+			hash = (hash ^ particle->type) * 0x100000001B3ull;
+			hash = (hash ^ particle->color.hex()) * 0x100000001B3ull;
+		}
+	}
+	return hash;
+}
+
+void Grid::release_empty_chunks()
+{
+	for (size_t i = 0; i < get_chunk_count(); i++)
+	{
+		auto chunk = chunks[i].load(std::memory_order_relaxed);
+		if (chunk != &null_chunk && chunk->occupied.load(std::memory_order_relaxed) == 0)
+		{
+			chunks[i].store(&null_chunk, std::memory_order_relaxed);
+			free_chunk(chunk);
+		}
+	}
+}
+
+void Grid::clear_chunk(int cx, int cy)
+{
+	auto& slot = chunks[cy * chunks_x + cx];
+	Chunk* chunk = slot.load(std::memory_order_relaxed);
+	if (chunk == &null_chunk) return;
+	slot.store(&null_chunk, std::memory_order_release);
+	free_chunk(chunk);
+	if (track_changes)
+		record_chunk_changes(cx, cy);
+}
+
+void Grid::write_chunk(int cx, int cy, const Particle* cells)
+{
+	int occupied = 0;
+	for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; i++)
+		occupied += cells[i].type != Particle::EMPTY;
+	clear_chunk(cx, cy);
+	if (occupied == 0) return;
+
+	Chunk* chunk = allocate_chunk();
+	std::copy(cells, cells + CHUNK_SIZE * CHUNK_SIZE, chunk->cells);
+	chunk->occupied.store(occupied, std::memory_order_relaxed);
+	chunks[cy * chunks_x + cx].store(chunk, std::memory_order_release);
+	if (track_changes)
+		record_chunk_changes(cx, cy);
 }
 
 Particle* Grid::get(int x, int y) const
@@ -21,104 +134,291 @@ Particle* Grid::get(int x, int y) const
 		return nullptr;
 
 	}
-	return &grid[y * width + x];
+	// cells of the null chunk are only ever read, every write goes through writable_chunk
+	return cell(chunk_at(x, y).load(std::memory_order_acquire), x, y);
 }
 
-void Grid::set(int x, int y, Particle::Type particle_type)
+const Particle& Grid::default_particle(Particle::Type particle_type)
 {
-	if (x < 0 || x >= width || y < 0 || y >= height)
+	static const auto defaults = []
 	{
-#ifdef DEBUG
-		sync_err.println("SET Out of range: ", x, ", ", y);
-#endif
-		return;
-	}
+		std::array<Particle, PARTICLE_TYPES> table{};
+		for (int i = 0; i < PARTICLE_TYPES; i++)
+		{
+			Particle& p = table[i];
+			p.type = static_cast<Particle::Type>(1 << i);
+			p.color = ParticleUtils::colors.at(p.type);
 
-	Particle p;
-	p.type = particle_type;
-	p.color = ParticleUtils::colors.at(particle_type);
-#ifdef INTERPOLATE
-	p.prev_pos = { x, y };
-#endif
+			switch (p.type)
+			{
+			case Particle::SAND:
+				p.density = 100.f;
+				p.corrodibility = 0.01f;
+				break;
+			case Particle::WATER:
+				p.density = 50.f;
+				break;
+			case Particle::STONE:
+				p.density = 500.f;
+				break;
+			case Particle::WOOD:
+				p.density = 200.f;
+				p.flammability = 0.2f;
+				p.corrodibility = 0.05f;
+				break;
+			case Particle::SMOKE:
+				p.density = 1.f;
+				p.dying = true;
+				break;
+			case Particle::FIRE:
+				p.density = 2.f;
+				p.burning = true;
+				p.dying = true;
+				break;
+			case Particle::SALT:
+				p.density = 100.f;
+				p.dissolvability = 0.05f;
+				p.corrodibility = 0.15f;
+				break;
+			case Particle::ACID:
+				p.density = 60.f;
+				p.dissolvability = 0.005f;
+				break;
+			case Particle::GASOLINE:
+				p.density = 25.f;
+				p.flammability = 0.15f;
+				break;
+			case Particle::VIRUS:
+				p.density = 150;
+				p.flammability = 0.5f;
+				p.dissolvability = 0.02f;
+				p.corrodibility = 0.1f;
+				p.diffusibility = 0.03f;
+				p.dying = true;
+				break;
+			case Particle::POISON:
+				p.density = 55.f;
+				break;
+			default:
+				break;
+			}
+		}
+		return table;
+	}();
+	return defaults[std::countr_zero(static_cast<uint32_t>(particle_type))];
+}
+
+Color Grid::varied_color(Particle::Type particle_type)
+{
+	// vary_color converts to and from hsl, so sample it up front and pick from the samples
+	static const auto shades = []
+	{
+		std::array<std::array<Color, COLOR_SHADES>, PARTICLE_TYPES> table{};
+		// same shades every run, and whichever thread builds the table gets its generator back untouched
+		const std::mt19937 previous = thread_generator();
+		thread_generator().seed(0x5A4D);
+		for (int i = 0; i < PARTICLE_TYPES; i++)
+			for (Color& shade : table[i])
+				shade = Color_Util::vary_color(ParticleUtils::colors.at(static_cast<Particle::Type>(1 << i)));
+		thread_generator() = previous;
+		return table;
+	}();
+	return shades[std::countr_zero(static_cast<uint32_t>(particle_type))][thread_generator()() % COLOR_SHADES];
+}
 
-	switch (particle_type)
+void Grid::randomize_particle(Particle& p, bool vary)
+{
+	switch (p.type)
 	{
 	case Particle::SAND:
-		p.density = 100.f;
-		p.corrodibility = 0.01f;
-		p.color = Color_Util::vary_color(p.color);
-		break;
-	case Particle::WATER:
-		p.density = 50.f;
-		break;
-	case Particle::STONE:
-		p.density = 500.f;
-		break;
 	case Particle::WOOD:
-		p.density = 200.f;
-		p.flammability = 0.2f;
-		p.corrodibility = 0.05f;
-		p.color = Color_Util::vary_color(p.color);
+		if (vary) p.color = varied_color(p.type);
 		break;
 	case Particle::SMOKE:
 		p.life_time = 0.05f + 2.0f * thread_rand();
-		p.density = 1.f;
-		p.dying = true;
-		p.color = Color_Util::vary_color(p.color);
+		if (vary) p.color = varied_color(p.type);
 		break;
 	case Particle::FIRE:
 		p.life_time = 0.2f + 0.1f * thread_rand();
-		p.density = 2.f;
-		p.burning = true;
-		p.dying = true;
-		p.color = Color_Util::vary_color(p.color);
+		if (vary) p.color = varied_color(p.type);
 		break;
 	case Particle::SALT:
 		p.life_time = 0.5f + 1.5f * thread_rand();
-		p.density = 100.f;
-		p.dissolvability = 0.05f;
-		p.corrodibility = 0.15f;
-		p.color = Color_Util::vary_color(p.color);
+		if (vary) p.color = varied_color(p.type);
 		break;
 	case Particle::ACID:
 		p.life_time = 5.0f + 5.0f * thread_rand();
-		p.density = 60.f;
-		p.dissolvability = 0.005f;
-		break;
-	case Particle::GASOLINE:
-		p.density = 25.f;
-		p.flammability = 0.15f;
 		break;
 	case Particle::VIRUS:
 		p.life_time = 1.0f + 1.0f * thread_rand();
-		p.density = 150;
-		p.flammability = 0.5f;
-		p.dissolvability = 0.02f;
-		p.corrodibility = 0.1f;
-		p.diffusibility = 0.03f;
-		p.dying = true;
-		p.color = Color_Util::vary_color(p.color);
+		if (vary) p.color = varied_color(p.type);
 		break;
 	case Particle::POISON:
-		p.density = 55.f;
 		p.diffusibility = 0.01f + 0.02f * thread_rand();
 		break;
 	default:
 		break;
 	}
+}
+
+Particle Grid::create_particle(Particle::Type particle_type, bool vary)
+{
+	Particle p = default_particle(particle_type);
+	randomize_particle(p, vary);
+	return p;
+}
+
+void Grid::set(int x, int y, Particle::Type particle_type)
+{
+	if (x < 0 || x >= width || y < 0 || y >= height)
+	{
+#ifdef DEBUG
+		sync_err.println("SET Out of range: ", x, ", ", y);
+#endif
+		return;
+	}
+
+	PROFILE_COUNT(sets);
+	if (StripCounts* counts = local_strip_counts())
+		counts->sets++;
+	put(x, y, create_particle(particle_type));
+}
+
+void Grid::put(int x, int y, const Particle& particle)
+{
+	if (!is_valid(x, y)) return;
+	// clearing a cell that was never written to
+	if (particle.type == Particle::EMPTY && in_empty_chunk(x, y)) return;
+
+	Chunk* chunk = writable_chunk(x, y);
+	Particle* target = cell(chunk, x, y);
+	const int change = (particle.type != Particle::EMPTY) - (target->type != Particle::EMPTY);
+	if (change)
+		chunk->occupied.fetch_add(change, std::memory_order_relaxed);
+	*target = particle;
+	if (track_changes)
+		record_change(x, y);
+}
+
+void Grid::fill_span(int x0, int x1, int y, Particle::Type type)
+{
+	if (y < 0 || y >= static_cast<int>(height)) return;
+	x0 = std::max(x0, 0);
+	x1 = std::min(x1, static_cast<int>(width));
+	const Particle& base = default_particle(type);
+
+	// one piece per chunk the span crosses
+	while (x0 < x1)
+	{
+		const int end = std::min(x1, (x0 | CHUNK_MASK) + 1);
+		if (type == Particle::EMPTY && in_empty_chunk(x0, y))
+		{
+			x0 = end;
+			continue;
+		}
 
-	grid[y * width + x] = p;
+		Chunk* chunk = writable_chunk(x0, y);
+		Particle* target = cell(chunk, x0, y);
+		int change = 0;
+		for (int x = x0; x < end; x++, target++)
+		{
+			change += (type != Particle::EMPTY) - (target->type != Particle::EMPTY);
+			*target = base;
+			randomize_particle(*target, true);
+			if (track_changes)
+				record_change(x, y);
+		}
+		if (change)
+			chunk->occupied.fetch_add(change, std::memory_order_relaxed);
+		x0 = end;
+	}
 }
 
 void Grid::swap(int x1, int y1, int x2, int y2)
 {
 	if (!is_valid(x1, y1) || !is_valid(x2, y2)) return;
-	auto xy1 = get(x1, y1);
-	auto xy2 = get(x2, y2);
-	if (!xy1 || !xy2) return;
-	Particle temp = *xy1;
-	grid[y1 * width + x1] = *xy2;
-	grid[y2 * width + x2] = temp;
+	const bool empty1 = get(x1, y1)->type == Particle::EMPTY;
+	const bool empty2 = get(x2, y2)->type == Particle::EMPTY;
+	if (empty1 && empty2) return;
+	PROFILE_COUNT(swaps);
+	if (StripCounts* counts = local_strip_counts())
+		counts->swaps++;
+
+	Chunk* chunk1 = writable_chunk(x1, y1);
+	Chunk* chunk2 = writable_chunk(x2, y2);
+	auto xy1 = cell(chunk1, x1, y1);
+	auto xy2 = cell(chunk2, x2, y2);
+	std::swap(*xy1, *xy2);
+	// occupancy only changes when a particle crosses into another chunk
+	if (chunk1 != chunk2 && empty1 != empty2)
+	{
+		chunk1->occupied.fetch_add(empty1 ? 1 : -1, std::memory_order_relaxed);
+		chunk2->occupied.fetch_add(empty2 ? 1 : -1, std::memory_order_relaxed);
+	}
+	if (track_motion)
+		record_motion(x1, y1, x2, y2);
+	if (track_changes)
+	{
+		record_change(x1, y1);
+		record_change(x2, y2);
+	}
+}
+
+void Grid::record_motion(int x1, int y1, int x2, int y2)
+{
+	if (motions.empty()) return;
+	// only the workers move particles during a tick, each into a list of its own
+	const std::optional<size_t> index = worker_index();
+	assert(index && *index < motions.size());
+	auto& list = motions[*index];
+	// a particle usually moves more than once per tick (raycast then slide), extend its last step instead of adding one
+	if (!list.empty() && list.back().to.x == x1 && list.back().to.y == y1)
+	{
+		auto& last = list.back();
+		if (last.from.x == x2 && last.from.y == y2)
+			list.pop_back();
+		else
+			last.to = { x2, y2 };
+		return;
+	}
+	list.push_back({ { x1, y1 }, { x2, y2 } });
+}
+
+void Grid::clear_motions(size_t num_threads)
+{
+	if (!track_motion) return;
+	motions.resize(num_threads);
+	for (auto& list : motions)
+		list.clear();
+}
+
+void Grid::set_change_tracking(bool enabled)
+{
+	track_changes = enabled;
+	changed_rows.reset();
+	if (!enabled) return;
+	// value initialised, all clear
+	changed_rows = std::make_unique<std::atomic<uint64_t>[]>(get_changed_row_count());
+}
+
+void Grid::record_change(int x, int y)
+{
+	static_assert(CHUNK_SIZE == 64, "a chunk row is one 64 bit word");
+	std::atomic<uint64_t>& row = changed_rows[changed_row(x, y)];
+	const uint64_t bit = uint64_t(1) << (x & CHUNK_MASK);
+	if (!(row.load(std::memory_order_relaxed) & bit))
+		row.fetch_or(bit, std::memory_order_relaxed);
+}
+
+void Grid::record_chunk_changes(int cx, int cy)
+{
+	const int x0 = cx << CHUNK_SHIFT;
+	const int y0 = cy << CHUNK_SHIFT;
+	const int x1 = std::min(x0 + CHUNK_SIZE, static_cast<int>(width));
+	const int y1 = std::min(y0 + CHUNK_SIZE, static_cast<int>(height));
+	const uint64_t bits = x1 - x0 == CHUNK_SIZE ? ~uint64_t(0) : (uint64_t(1) << (x1 - x0)) - 1;
+	for (int y = y0; y < y1; y++)
+		changed_rows[changed_row(x0, y)].fetch_or(bits, std::memory_order_relaxed);
 }
 
 Particle::Type Grid::get_type(int x, int y)
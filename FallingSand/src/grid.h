@@ -1,21 +1,17 @@
 ﻿#pragma once
 
+#include <atomic>
 #include <cstdint>
-#include <random>
+#include <memory>
+#include <vector>
 #include <DirectXMath.h>
 
+#include "chunk_allocator.h"
 #include "color.h"
+#include "thread_random.h"
 #include <tsl/robin_map.h>
 #include <BS_thread_pool_utils.hpp>
 
-// Threadsafe random generator
-inline float thread_rand()
-{
-	static thread_local std::mt19937 generator(std::random_device{}());
-	std::uniform_real_distribution distribution(0.0f, 1.0f);
-	return distribution(generator);
-}
-
 struct Particle
 {
 	enum Type : uint16_t
@@ -35,9 +31,6 @@ struct Particle
 	};
 	// TOTAL = 40 bytes
 	XMFLOAT2 velocity = { 0, 0 }; // 8
-#ifdef INTERPOLATE
-	XMINT2 prev_pos = { 0, 0 }; // 8
-#endif
 	Color color = 0x000000; // 4
 	float life_time = 0.f; // 4
 	float density = 0.f; // 4
@@ -112,22 +105,135 @@ struct ParticleUtils
 	}
 };
 
+// particle at "to" was at "from" when the tick started, the particle it swapped with went the other way
+struct Motion
+{
+	XMINT2 from;
+	XMINT2 to;
+};
+
+// cell writes of the strip the calling thread is running, counted in every build for the tick stats. each strip
+// counts into a slot of its own, outside strips nothing is counted
+struct StripCounts
+{
+	uint64_t swaps = 0;
+	uint64_t sets = 0;
+	uint64_t reactions = 0; // particles a material turned into something else
+};
+
+inline StripCounts*& local_strip_counts()
+{
+	static thread_local StripCounts* counts = nullptr;
+	return counts;
+}
+
+constexpr int PARTICLE_TYPES = 12;
+constexpr int COLOR_SHADES = 256;
+
+// grid is stored as square chunks, all empty chunks share one read only null chunk until something is written to them
+constexpr int CHUNK_SHIFT = 6;
+constexpr int CHUNK_SIZE = 1 << CHUNK_SHIFT;
+constexpr int CHUNK_MASK = CHUNK_SIZE - 1;
+
+struct alignas(ChunkAllocator::ALIGNMENT) Chunk
+{
+	Particle cells[CHUNK_SIZE * CHUNK_SIZE];
+	std::atomic<int> occupied = 0; // non empty cells, chunk goes back to the pool when this reaches 0
+};
+
 class Grid
 {
-	Particle* grid; // save overhead of size, capacity from vector
+	std::unique_ptr<std::atomic<Chunk*>[]> chunks;
 	unsigned int width;
 	unsigned int height;
+	unsigned int chunks_x;
+	unsigned int chunks_y;
 	BS::synced_stream& sync_err;
+
+	inline static Chunk null_chunk;
+	ChunkAllocator allocator;
+
+	std::atomic<Chunk*>& chunk_at(int x, int y) const { return chunks[(y >> CHUNK_SHIFT) * chunks_x + (x >> CHUNK_SHIFT)]; }
+	static Particle* cell(Chunk* chunk, int x, int y) { return &chunk->cells[(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)]; }
+	// returns the chunk for writing, swapping in a pooled one if it is still the null chunk. safe to race from worker threads
+	Chunk* writable_chunk(int x, int y);
+	Chunk* allocate_chunk();
+	void free_chunk(Chunk* chunk);
+
+	// one list per pool thread plus one for outside threads, so swap never locks
+	bool track_motion = false;
+	std::vector<std::vector<Motion>> motions;
+	void record_motion(int x1, int y1, int x2, int y2);
+
+	// a bit per cell written since the owner last reset it, a word per row of a chunk and the words of a chunk next to
+	// each other, so threads on different chunks never share a cache line. bits are only set when not set yet, after
+	// the first write threads just read the line
+	bool track_changes = false;
+	std::unique_ptr<std::atomic<uint64_t>[]> changed_rows;
+	void record_change(int x, int y);
+	void record_chunk_changes(int cx, int cy);
 public:
-	Grid(unsigned int width, unsigned int height, BS::synced_stream& sync_err);
+	Grid(unsigned int width, unsigned int height, BS::synced_stream& sync_err, bool huge_pages = false);
 	~Grid();
+	Grid(const Grid&) = delete;
+	Grid& operator=(const Grid&) = delete;
 	Particle* get(int x, int y) const;
 	void set(int x, int y, Particle::Type particle);
+	// writes a ready made particle, e.g. one restored from a file
+	void put(int x, int y, const Particle& particle);
+	// sets cells [x0, x1) of row y like set does, clipped to the grid, looking each chunk up once
+	void fill_span(int x0, int x1, int y, Particle::Type type);
+	// particle with the default properties of its type, vary randomizes the color like painting does
+	static Particle create_particle(Particle::Type type, bool vary = true);
+	// properties every particle of a type starts with, before create_particle rolls life time and color
+	static const Particle& default_particle(Particle::Type type);
+	// rolls the per particle properties of p's type, what create_particle does on top of the defaults
+	static void randomize_particle(Particle& p, bool vary);
+	// one of COLOR_SHADES pre varied colors of the type, picked with thread_rand's generator
+	static Color varied_color(Particle::Type type);
 	void swap(int x1, int y1, int x2, int y2);
 	unsigned int get_width() const { return width; }
 	unsigned int get_height() const { return height; }
 	Particle::Type get_type(int x, int y);
 
+	// true if (x, y) lies in a chunk that has never been written to or was released, nothing there needs simulating
+	bool in_empty_chunk(int x, int y) const { return chunk_at(x, y).load(std::memory_order_acquire) == &null_chunk; }
+	// call between ticks, gives chunks with no particles left back to the pool
+	void release_empty_chunks();
+	// maps and pre faults memory for count more chunks on the pool threads
+	void reserve_chunks(size_t count, BS::thread_pool& pool) { allocator.reserve(count, &pool); }
+	size_t get_allocated_chunks() const { return allocator.get_in_use(); }
+	// non empty cells, summed from the chunks' counts
+	size_t count_particles() const;
+	// fnv-1a over what a player can see, equal hashes mean two runs came out the same
+	uint64_t hash() const;
+	ChunkAllocator::Stats get_allocator_stats() const { return allocator.get_stats(); }
+	size_t get_chunk_count() const { return static_cast<size_t>(chunks_x) * chunks_y; }
+	unsigned int get_chunks_x() const { return chunks_x; }
+	unsigned int get_chunks_y() const { return chunks_y; }
+	// nullptr for chunks that are all empty
+	const Chunk* get_chunk(int cx, int cy) const
+	{
+		const Chunk* chunk = chunks[cy * chunks_x + cx].load(std::memory_order_acquire);
+		return chunk == &null_chunk ? nullptr : chunk;
+	}
+	// empties a whole chunk at once, only between ticks
+	void clear_chunk(int cx, int cy);
+	// replaces a whole chunk with CHUNK_SIZE * CHUNK_SIZE cells, only between ticks
+	void write_chunk(int cx, int cy, const Particle* cells);
+
+	void set_motion_tracking(bool enabled) { track_motion = enabled; }
+	// called at the start of every tick
+	void clear_motions(size_t num_threads);
+	const std::vector<std::vector<Motion>>& get_motions() const { return motions; }
+
+	// flags every cell put, set or swapped. cell (x, y) is bit x % CHUNK_SIZE of word changed_row(x, y). never reset
+	// by the grid, whoever reads a word clears it
+	void set_change_tracking(bool enabled);
+	std::atomic<uint64_t>* get_changed_rows() { return changed_rows.get(); }
+	size_t get_changed_row_count() const { return get_chunk_count() * CHUNK_SIZE; }
+	size_t changed_row(int x, int y) const { return ((y >> CHUNK_SHIFT) * chunks_x + (x >> CHUNK_SHIFT)) * size_t(CHUNK_SIZE) + (y & CHUNK_MASK); }
+
 	bool is_valid(int x, int y) const;
 	bool is_air(int x, int y) const;
 	bool is_liquid(int x, int y) const;
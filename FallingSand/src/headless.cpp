@@ -0,0 +1,335 @@
+﻿#include "headless.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "command.h"
+#include "simulation.h"
+
+namespace
+{
+	struct TickTimes
+	{
+		std::vector<double> tick_ms;
+		// summed over the ticks
+		double even_wait_ms = 0.;
+		double odd_wait_ms = 0.;
+		double even_imbalance = 0.;
+		double odd_imbalance = 0.;
+		double schedule_us = 0.;
+	};
+
+	// ms per tick over ticks updates, and what the barriers cost
+	TickTimes time_ticks(Simulation& simulation, BS::thread_pool& pool, int ticks)
+	{
+		TickTimes times;
+		times.tick_ms.reserve(ticks);
+		for (int i = 0; i < ticks; i++)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			simulation.update(Simulation::FIXED_DELTA, pool);
+			times.tick_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+			const TickStats& stats = simulation.get_stats();
+			times.even_wait_ms += stats.even_wait_ms;
+			times.odd_wait_ms += stats.odd_wait_ms;
+			times.even_imbalance += stats.even_imbalance;
+			times.odd_imbalance += stats.odd_imbalance;
+			times.schedule_us += stats.schedule_us;
+		}
+		return times;
+	}
+}
+
+HeadlessRun::HeadlessRun(const HeadlessOptions& options) : options(options)
+{
+}
+
+int HeadlessRun::run()
+{
+	CommandLogInfo info;
+	std::vector<Command> commands;
+	if (!CommandRunner::read_log(options.command_log, info, commands))
+		return 1;
+	if (info.threads == 0)
+	{
+		std::cerr << "Command log was recorded without a thread count" << std::endl;
+		return 1;
+	}
+
+	BS::synced_stream sync_err(std::cerr);
+	BS::thread_pool pool(info.threads);
+	Grid grid(info.width, info.height, sync_err, options.huge_pages);
+	Simulation simulation(&grid, info.seed);
+	CommandRunner runner(grid, simulation, pool);
+
+	std::vector<double> tick_ms;
+	tick_ms.reserve(info.ticks);
+	double command_ms = 0;
+	size_t next = 0;
+	for (uint64_t tick = 0; ; tick++)
+	{
+		// same order as the game: edits made after a tick go in before the next one
+		const auto commands_start = std::chrono::steady_clock::now();
+		for (; next < commands.size() && commands[next].tick == tick; next++)
+			runner.execute(commands[next]);
+		command_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - commands_start).count();
+		if (tick == info.ticks) break;
+
+		const auto start = std::chrono::steady_clock::now();
+		simulation.update(Simulation::FIXED_DELTA, pool);
+		tick_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	double total = 0;
+	for (double ms : tick_ms) total += ms;
+	std::sort(tick_ms.begin(), tick_ms.end());
+
+	std::cout << "log: " << options.command_log << ", grid: " << info.width << "x" << info.height << ", threads: " << info.threads
+		<< ", seed: " << info.seed << ", ticks: " << info.ticks << ", commands: " << commands.size() << "\n";
+	if (!tick_ms.empty())
+	{
+		std::cout << "tick ms: mean " << total / tick_ms.size() << ", median " << tick_ms[tick_ms.size() / 2]
+			<< ", max " << tick_ms.back() << ", ticks/sec " << tick_ms.size() * 1000.0 / total << "\n";
+	}
+	std::cout << "command ms: " << command_ms << "\n";
+	std::cout << "world hash: " << std::hex << grid.hash() << std::dec << "\n";
+	return 0;
+}
+
+ScenarioSuite::ScenarioSuite(const ScenarioOptions& options) : options(options)
+{
+	if (this->options.threads.empty())
+	{
+		const unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned int threads = 1; threads <= cores; threads++)
+			this->options.threads.push_back(threads);
+	}
+}
+
+namespace
+{
+	constexpr const char* RESULTS_MAGIC = "falling_sand_scenes";
+	constexpr int RESULTS_VERSION = 3;
+
+	bool same_run(const ScenarioResult& a, const ScenarioResult& b)
+	{
+		return a.scene == b.scene && a.width == b.width && a.height == b.height && a.threads == b.threads
+			&& a.ticks == b.ticks && a.seed == b.seed;
+	}
+}
+
+bool ScenarioSuite::read_results(const std::string& path, std::vector<ScenarioResult>& results)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		std::cerr << "Failed to open scene baseline: " << path << std::endl;
+		return false;
+	}
+	std::string magic;
+	int version = 0;
+	file >> magic >> version;
+	if (!file || magic != RESULTS_MAGIC || version != RESULTS_VERSION)
+	{
+		std::cerr << "Not a scene baseline: " << path << std::endl;
+		return false;
+	}
+	ScenarioResult result;
+	while (file >> result.scene >> result.width >> result.height >> result.threads >> result.ticks >> result.seed
+		>> std::hex >> result.hash >> std::dec >> result.ticks_per_sec)
+		results.push_back(result);
+	if (!file.eof())
+	{
+		std::cerr << "Bad entry in scene baseline: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool ScenarioSuite::write_results(const std::string& path, const std::vector<ScenarioResult>& results, bool hashes_only)
+{
+	// a baseline holds every run it was saved from, only the ones played again are replaced
+	std::vector<ScenarioResult> kept;
+	if (std::ifstream(path) && !read_results(path, kept))
+		return false;
+	std::erase_if(kept, [&](const ScenarioResult& old)
+		{
+			return std::any_of(results.begin(), results.end(), [&](const ScenarioResult& result) { return same_run(old, result); });
+		});
+	kept.insert(kept.end(), results.begin(), results.end());
+
+	std::ofstream file(path, std::ios::trunc);
+	file << RESULTS_MAGIC << ' ' << RESULTS_VERSION << '\n';
+	for (const ScenarioResult& result : kept)
+	{
+		// ticks/sec depends on the machine, a baseline kept in the repo only pins the hashes
+		const double ticks_per_sec = hashes_only ? 0. : result.ticks_per_sec;
+		file << result.scene << ' ' << result.width << ' ' << result.height << ' ' << result.threads << ' ' << result.ticks << ' '
+			<< result.seed << ' ' << std::hex << result.hash << std::dec << ' ' << ticks_per_sec << '\n';
+	}
+	if (!file)
+	{
+		std::cerr << "Failed to write scene results: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool ScenarioSuite::write_csv(const std::string& path, const std::vector<ScenarioResult>& results)
+{
+	std::ofstream file(path, std::ios::trunc);
+	file << "scene,width,height,threads,ticks,seed,ticks_per_sec,speedup,efficiency,even_wait_ms,odd_wait_ms,even_imbalance,odd_imbalance,schedule_us,hash\n";
+	for (const ScenarioResult& result : results)
+	{
+		file << result.scene << ',' << result.width << ',' << result.height << ',' << result.threads << ',' << result.ticks << ','
+			<< result.seed << ',' << result.ticks_per_sec << ',' << result.speedup << ',' << result.efficiency << ','
+			<< result.even_wait_ms << ',' << result.odd_wait_ms << ',' << result.even_imbalance << ',' << result.odd_imbalance << ','
+			<< result.schedule_us << ',' << std::hex << result.hash << std::dec << '\n';
+	}
+	if (!file)
+	{
+		std::cerr << "Failed to write scene csv: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int ScenarioSuite::run()
+{
+	for (const std::string& scene : options.scenes)
+	{
+		if (std::find(Scenes::names().begin(), Scenes::names().end(), scene) == Scenes::names().end())
+		{
+			std::cerr << "Unknown scene: " << scene << std::endl;
+			return 1;
+		}
+	}
+	for (unsigned int threads : options.threads)
+	{
+		if (threads == 0)
+		{
+			std::cerr << "Can't run scenes without threads" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<ScenarioResult> baseline;
+	if (!options.baseline.empty() && !read_results(options.baseline, baseline))
+		return 1;
+
+	BS::synced_stream sync_err(std::cerr);
+	std::vector<ScenarioResult> results;
+	int failures = 0;
+	int checked = 0;
+	std::cout << "seed: " << options.seed << ", ticks: " << options.ticks
+		<< (options.persistent_workers ? ", persistent workers" : "") << "\n";
+	for (const SceneResolution& resolution : options.resolutions)
+	{
+		for (const std::string& scene : options.scenes)
+		{
+			double base_rate = 0;
+			unsigned int base_threads = 0;
+			for (unsigned int threads : options.threads)
+			{
+				BS::thread_pool pool(threads);
+				Grid grid(resolution.width, resolution.height, sync_err, options.huge_pages);
+				EditQueue edits;
+				Scenes::build(scene, resolution.width, resolution.height, options.seed, edits);
+				edits.apply_all(grid, pool, options.seed);
+				Simulation simulation(&grid, options.seed);
+				std::unique_ptr<TickWorkers> workers;
+				if (options.persistent_workers)
+				{
+					workers = std::make_unique<TickWorkers>(threads, true);
+					simulation.set_workers(workers.get());
+				}
+
+				TickTimes times = time_ticks(simulation, pool, options.ticks);
+				std::vector<double>& tick_ms = times.tick_ms;
+				double total = 0;
+				for (double ms : tick_ms) total += ms;
+				std::sort(tick_ms.begin(), tick_ms.end());
+
+				ScenarioResult result{ scene, resolution.width, resolution.height, threads, options.ticks, options.seed, grid.hash() };
+				result.ticks_per_sec = total > 0 ? tick_ms.size() * 1000.0 / total : 0;
+				result.even_wait_ms = times.even_wait_ms / options.ticks;
+				result.odd_wait_ms = times.odd_wait_ms / options.ticks;
+				result.even_imbalance = times.even_imbalance / options.ticks;
+				result.odd_imbalance = times.odd_imbalance / options.ticks;
+				result.schedule_us = times.schedule_us / options.ticks;
+				if (base_threads == 0)
+				{
+					base_rate = result.ticks_per_sec;
+					base_threads = threads;
+				}
+				if (base_rate > 0)
+				{
+					result.speedup = result.ticks_per_sec / base_rate;
+					result.efficiency = result.speedup * base_threads / threads;
+				}
+
+				std::cout << scene << " " << resolution.name << " threads " << threads << ": ticks/sec " << result.ticks_per_sec;
+				if (!tick_ms.empty())
+					std::cout << ", tick ms median " << tick_ms[tick_ms.size() / 2] << ", max " << tick_ms.back();
+				if (threads != base_threads)
+					std::cout << ", speedup " << result.speedup << "x over " << base_threads << ", efficiency " << result.efficiency;
+				std::cout << ", barrier wait ms " << result.even_wait_ms << " / " << result.odd_wait_ms << ", imbalance "
+					<< result.even_imbalance << " / " << result.odd_imbalance << ", scheduling us " << result.schedule_us;
+				std::cout << ", hash " << std::hex << result.hash << std::dec;
+				if (!options.baseline.empty())
+				{
+					const auto expected = std::find_if(baseline.begin(), baseline.end(), [&](const ScenarioResult& b) { return same_run(b, result); });
+					if (expected != baseline.end())
+						checked++;
+					if (expected == baseline.end())
+						std::cout << ", not in baseline";
+					else if (expected->hash != result.hash)
+					{
+						std::cout << ", FAILED: world differs from the baseline's " << std::hex << expected->hash << std::dec;
+						failures++;
+					}
+					// hash only entries have no speed to hold the run to
+					else if (options.hashes_only || expected->ticks_per_sec == 0.)
+						std::cout << ", hash ok";
+					else if (result.ticks_per_sec < expected->ticks_per_sec * (1. - options.tolerance))
+					{
+						std::cout << ", FAILED: slower than the baseline's " << expected->ticks_per_sec << " ticks/sec";
+						failures++;
+					}
+					else
+						std::cout << ", ok against " << expected->ticks_per_sec << " ticks/sec";
+				}
+				std::cout << std::endl;
+				results.push_back(result);
+			}
+		}
+	}
+
+	if (!options.save.empty())
+	{
+		if (!write_results(options.save, results, options.hashes_only))
+			return 1;
+		std::cout << "saved results to " << options.save << "\n";
+	}
+	if (!options.csv.empty())
+	{
+		if (!write_csv(options.csv, results))
+			return 1;
+		std::cout << "wrote scaling curves to " << options.csv << "\n";
+	}
+	if (failures > 0)
+	{
+		std::cout << failures << " of " << results.size() << " runs failed against " << options.baseline << "\n";
+		return 1;
+	}
+	// a gate that compared nothing would pass on any change
+	if (!options.baseline.empty() && checked == 0)
+	{
+		std::cout << options.baseline << " has none of these runs, save them with --scene-save first\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "scenes.h"
+
+struct HeadlessOptions
+{
+	std::string command_log;
+	bool huge_pages;
+};
+
+// re-simulates a recorded session without a window. commands go back in at the ticks they were made at, with the
+// session's seed and thread count, so the run is repeatable and works as a benchmark workload
+class HeadlessRun
+{
+	HeadlessOptions options;
+public:
+	explicit HeadlessRun(const HeadlessOptions& options);
+	int run();
+};
+
+
+struct ScenarioOptions
+{
+	std::vector<std::string> scenes;
+	std::vector<SceneResolution> resolutions;
+	std::vector<unsigned int> threads; // empty sweeps from 1 up to the core count
+	int ticks;
+	uint64_t seed;
+	bool huge_pages;
+	std::string baseline; // results to check the runs against
+	std::string save; // writes the results here to use as a baseline later, entries of other runs in the file are kept
+	double tolerance; // share of the baseline's ticks/sec a run may lose before it fails
+	std::string csv; // one row per run with speedup, efficiency and barrier costs
+	bool hashes_only = false; // saves leave ticks/sec out and checks only compare hashes, for baselines kept in the repo
+	bool persistent_workers = false; // strips run on pinned TickWorkers instead of pool tasks
+};
+
+// one scene played at one size and thread count
+struct ScenarioResult
+{
+	std::string scene;
+	int width = 0;
+	int height = 0;
+	unsigned int threads = 0;
+	int ticks = 0;
+	uint64_t seed = 0;
+	uint64_t hash = 0; // of the world after the last tick
+	double ticks_per_sec = 0.; // 0 in hash only baselines
+	// against the scene's first thread count, not kept in baselines
+	double speedup = 1.;
+	double efficiency = 1.;
+	// per tick means of the barrier stats in TickStats
+	double even_wait_ms = 0.;
+	double odd_wait_ms = 0.;
+	double even_imbalance = 1.;
+	double odd_imbalance = 1.;
+	double schedule_us = 0.;
+};
+
+// plays every generated scene at every resolution and thread count without a window, and prints ticks/sec and how it
+// scaled against the smallest thread count. against a baseline it works as a regression gate: a run fails when its
+// world hash differs, i.e. the simulation's behaviour changed, or it got slower than the tolerance allows. no std
+// random distributions are used on the way to a hash, so the same hashes hold for every compiler
+class ScenarioSuite
+{
+	ScenarioOptions options;
+
+	static bool read_results(const std::string& path, std::vector<ScenarioResult>& results);
+	static bool write_results(const std::string& path, const std::vector<ScenarioResult>& results, bool hashes_only);
+	static bool write_csv(const std::string& path, const std::vector<ScenarioResult>& results);
+public:
+	explicit ScenarioSuite(const ScenarioOptions& options);
+	// 1 when a run failed against the baseline, or the baseline has none of these runs
+	int run();
+};
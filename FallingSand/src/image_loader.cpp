@@ -1,5 +1,11 @@
 #include "image_loader.h"
 
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+#include "profiling.h"
+
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #define STB_IMAGE_RESIZE_STATIC
 #include "stb_image_resize2.h"
@@ -7,18 +13,29 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#ifdef _WIN32
 #define NOMINMAX
 #include <windows.h>
 #include <commdlg.h>
+#endif
 
-ImageLoader::ImageLoader(Grid* grid) : grid(grid)
+ImageLoader::ImageLoader(Grid* grid, BS::thread_pool* pool) : grid(grid), pool(pool)
 {
-	for (const auto& [type, color] : ParticleUtils::colors)
-		color_palette.emplace_back(type, color);
+}
+
+ImageLoader::~ImageLoader()
+{
+	if (!import_thread.joinable()) return;
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	cv.notify_all();
+	import_thread.join();
 }
 
 // Source: https://www.compuphase.com/cmetric.htm
-float red_mean_dist(Color c1, Color c2)
+long ImageLoader::red_mean_dist(Color c1, Color c2)
 {
 	long rmean = (c1.r() + c2.r()) / 2;
 	long dr = (long)c1.r() - (long)c2.r();
@@ -29,39 +46,72 @@ float red_mean_dist(Color c1, Color c2)
 	long gcomp = 4 * dg * dg;
 	long bcomp = ((767 - rmean) * db * db) >> 8;
 
-	return std::sqrtf(rcomp + gcomp + bcomp);
+	return rcomp + gcomp + bcomp;
 }
 
-void ImageLoader::quantize_to_grid(unsigned char* image, int w, int h, int channels)
+Particle::Type ImageLoader::nearest_material(Color color)
 {
-	for (int x = 0; x < w; ++x)
+	auto min_delta = std::numeric_limits<long>::max();
+	Particle::Type particle_type = Particle::EMPTY;
+
+	for (Particle::Type pt : ParticleUtils::quantize_palette)
 	{
-		for (int y = 0; y < h; ++y)
+		auto d = red_mean_dist(color, ParticleUtils::colors.at(pt));
+		if (d < min_delta)
 		{
-			int offset = y * w * channels + x * channels;
-			auto color = Color(image[offset], image[offset + 1], image[offset + 2]);
+			min_delta = d;
+			particle_type = pt;
+		}
+	}
+	return particle_type;
+}
 
-			auto min_delta = std::numeric_limits<float>::max();
-			Particle::Type particle_type = Particle::EMPTY;
+const std::array<uint8_t, ImageLoader::LOOKUP_SIZE>& ImageLoader::lookup()
+{
+	static const auto cube = []
+	{
+		std::array<uint8_t, LOOKUP_SIZE> table{};
+		constexpr int shift = 8 - LOOKUP_BITS;
+		constexpr int half = 1 << shift >> 1;
+		for (int i = 0; i < LOOKUP_SIZE; i++)
+		{
+			// each cell stands for the colors around its center
+			const int r = (i >> (2 * LOOKUP_BITS)) << shift | half;
+			const int g = ((i >> LOOKUP_BITS) & ((1 << LOOKUP_BITS) - 1)) << shift | half;
+			const int b = (i & ((1 << LOOKUP_BITS) - 1)) << shift | half;
+			const Particle::Type type = nearest_material(Color(r, g, b));
+			table[i] = static_cast<uint8_t>(std::find(std::begin(ParticleUtils::quantize_palette), std::end(ParticleUtils::quantize_palette), type)
+				- std::begin(ParticleUtils::quantize_palette));
+		}
+		return table;
+	}();
+	return cube;
+}
 
-			for (Particle::Type pt : ParticleUtils::quantize_palette)
-			{
-				Color pc = ParticleUtils::colors.at(pt);
-				auto d = red_mean_dist(color, pc);
-				if (d < min_delta)
-				{
-					min_delta = d;
-					particle_type = pt;
-				}
-			}
+Particle::Type ImageLoader::lookup_material(Color color)
+{
+	constexpr int shift = 8 - LOOKUP_BITS;
+	const int i = (color.r() >> shift) << (2 * LOOKUP_BITS) | (color.g() >> shift) << LOOKUP_BITS | color.b() >> shift;
+	return ParticleUtils::quantize_palette[lookup()[i]];
+}
 
-			grid->set(x, y, particle_type);
-		}
+void ImageLoader::quantize_row(const unsigned char* pixels, int count, int channels, Particle::Type* out)
+{
+	constexpr int shift = 8 - LOOKUP_BITS;
+	const auto& cube = lookup();
+	for (int x = 0; x < count; x++, pixels += channels)
+	{
+		const int i = (pixels[0] >> shift) << (2 * LOOKUP_BITS) | (pixels[1] >> shift) << LOOKUP_BITS | pixels[2] >> shift;
+		out[x] = ParticleUtils::quantize_palette[cube[i]];
 	}
 }
 
-void ImageLoader::open()
+std::string ImageLoader::choose_file()
 {
+#ifndef _WIN32
+	std::cerr << "No file dialog on this platform, drop an image onto the window or pass --import" << std::endl;
+	return {};
+#else
 	OPENFILENAME ofn;       // Common dialog box structure
 	char szFile[260];		// Buffer for file name
 
@@ -79,80 +129,220 @@ void ImageLoader::open()
 	ofn.lpstrInitialDir = NULL;
 	ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
 
-	int w;
-	int h;
-	int channels;
-	unsigned char* raw_image;
+	if (GetOpenFileName(&ofn) != TRUE)
+	{
+		std::cerr << "Failed to open file: " << ofn.lpstrFile << std::endl;
+		return {};
+	}
+	return ofn.lpstrFile;
+#endif
+}
 
-	// Load the image
-	if (GetOpenFileName(&ofn) == TRUE)
+bool ImageLoader::decode(const std::string& path, Source& source)
+{
+	PROFILE_FUNCTION();
+	if (!stbi_info(path.c_str(), &source.width, &source.height, &source.channels))
 	{
-		stbi_info(ofn.lpstrFile, &w, &h, &channels);
-		auto req_comp = STBI_rgb;
-		switch (channels)
-		{
-		case 1:
-			req_comp = STBI_grey;
-			break;
-		case 3:
-			req_comp = STBI_rgb;
-			break;
-		case 4:
-			req_comp = STBI_rgb_alpha;
-			break;
-		default:
-			std::cerr << "Unsupported number of channels: " << channels << std::endl;
-		}
+		std::cerr << "Failed to read image: " << path << std::endl;
+		return false;
+	}
+	// grey is widened to rgb so every row quantizes the same way, alpha is kept for the resize but ignored after
+	const int req_comp = source.channels == 2 || source.channels == 4 ? STBI_rgb_alpha : STBI_rgb;
+	source.pixels = { stbi_load(path.c_str(), &source.width, &source.height, &source.channels, req_comp), stbi_image_free };
+	source.channels = req_comp;
+	if (!source.pixels)
+	{
+		std::cerr << "Failed to load image: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
 
-		raw_image = stbi_load(ofn.lpstrFile, &w, &h, &channels, req_comp);
+bool ImageLoader::quantize_tile(const Source& source, int width, int height, int tile, Edit& edit)
+{
+	const int y0 = tile * TILE_ROWS;
+	const int rows = std::min(TILE_ROWS, height - y0);
+	auto stamp = std::make_shared<std::vector<Particle::Type>>(static_cast<size_t>(width) * rows, Particle::EMPTY);
 
-		if (raw_image == nullptr)
+	// rows are quantized straight out of the resizer, so the resized image never exists in full
+	struct RowTarget
+	{
+		Particle::Type* stamp;
+		int width;
+		int channels;
+	} target{ stamp->data(), width, source.channels };
+	// y counts from the top of the tile
+	auto quantize_output = [](const void* output, int num_pixels, int y, void* context)
+	{
+		const auto* row_target = static_cast<const RowTarget*>(context);
+		quantize_row(static_cast<const unsigned char*>(output), num_pixels, row_target->channels,
+			row_target->stamp + static_cast<size_t>(y) * row_target->width);
+	};
+
+	STBIR_RESIZE resize;
+	stbir_resize_init(&resize, source.pixels.get(), source.width, source.height, 0, nullptr, width, height, 0,
+		source.channels == STBI_rgb_alpha ? STBIR_RGBA : STBIR_RGB, STBIR_TYPE_UINT8_SRGB);
+	stbir_set_pixel_subrect(&resize, 0, y0, width, rows);
+	stbir_set_pixel_callbacks(&resize, nullptr, quantize_output);
+	stbir_set_user_data(&resize, &target);
+	if (!stbir_resize_extended(&resize))
+		return false;
+
+	edit = { .kind = Edit::STAMP, .x = 0, .y = y0, .width = width, .height = rows, .stamp = std::move(stamp) };
+	return true;
+}
+
+bool ImageLoader::load(const std::string& path, EditQueue& edits)
+{
+	PROFILE_FUNCTION();
+	Source source;
+	if (!decode(path, source))
+		return false;
+
+	lookup();
+	const int grid_w = static_cast<int>(grid->get_width());
+	const int grid_h = static_cast<int>(grid->get_height());
+	std::atomic<bool> resized = true;
+	const BS::multi_future<void> tiles = pool->submit_loop<int>(0, get_tile_count(grid_h),
+		[&](const int tile)
 		{
-			std::cerr << "Failed to load image: " << ofn.lpstrFile << std::endl;
-			return;
-		}
-	}
-	else
+			Edit edit;
+			if (quantize_tile(source, grid_w, grid_h, tile, edit))
+				edits.push(std::move(edit));
+			else
+				resized = false;
+		});
+	tiles.wait();
+
+	if (!resized)
+		std::cerr << "Failed to resize image" << std::endl;
+	return resized;
+}
+
+bool ImageLoader::quantize(const std::string& path, int& width, int& height, std::vector<Particle::Type>& types)
+{
+	PROFILE_FUNCTION();
+	Source source;
+	if (!decode(path, source))
+		return false;
+	if (width <= 0 || height <= 0)
 	{
-		std::cerr << "Failed to open file: " << ofn.lpstrFile << std::endl;
-		return;
+		width = source.width;
+		height = source.height;
 	}
 
-	// Resize image to grid
-	auto grid_w = static_cast<int>(grid->get_width());
-	auto grid_h = static_cast<int>(grid->get_height());
+	lookup();
+	types.assign(static_cast<size_t>(width) * height, Particle::EMPTY);
+	std::atomic<bool> resized = true;
+	const BS::multi_future<void> tiles = pool->submit_loop<int>(0, get_tile_count(height),
+		[&](const int tile)
+		{
+			Edit edit;
+			if (quantize_tile(source, width, height, tile, edit))
+				std::copy(edit.stamp->begin(), edit.stamp->end(), types.begin() + static_cast<size_t>(edit.y) * width);
+			else
+				resized = false;
+		});
+	tiles.wait();
+
+	if (!resized)
+		std::cerr << "Failed to resize image" << std::endl;
+	return resized;
+}
+
+bool ImageLoader::resize(const std::string& path, int width, int height, std::vector<Color>& pixels)
+{
+	PROFILE_FUNCTION();
+	Source source;
+	if (!decode(path, source))
+		return false;
 
-	auto layout = STBIR_1CHANNEL;
-	bool can_resize = true;
-	switch (channels)
+	std::vector<unsigned char> resized(static_cast<size_t>(width) * height * source.channels);
+	STBIR_RESIZE resize;
+	stbir_resize_init(&resize, source.pixels.get(), source.width, source.height, 0, resized.data(), width, height, 0,
+		source.channels == STBI_rgb_alpha ? STBIR_RGBA : STBIR_RGB, STBIR_TYPE_UINT8_SRGB);
+	if (!stbir_resize_extended(&resize))
 	{
-	case 1:
-		layout = STBIR_1CHANNEL;
-		break;
-	case 3:
-		layout = STBIR_RGB;
-		break;
-	case 4:
-		layout = STBIR_RGBA;
-		break;
-	default:
-		can_resize = false;
-		std::cerr << "Unsupported number of channels: " << channels << std::endl;
+		std::cerr << "Failed to resize image" << std::endl;
+		return false;
 	}
+	pixels.resize(static_cast<size_t>(width) * height);
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		const unsigned char* pixel = resized.data() + i * source.channels;
+		pixels[i] = Color(pixel[0], pixel[1], pixel[2]);
+	}
+	return true;
+}
 
-	unsigned char* resized_image = nullptr;
-	if (can_resize)
-		resized_image = stbir_resize_uint8_srgb(raw_image, w, h, 0, nullptr, grid_w, grid_h, 0, layout);
-
-	if (resized_image)
+void ImageLoader::start(const std::string& path)
+{
 	{
-		quantize_to_grid(resized_image, grid_w, grid_h, channels);
+		std::lock_guard lock(mutex);
+		jobs.push_back(path);
+		importing = true;
 	}
-	else
+	if (!import_thread.joinable())
+		import_thread = std::thread(&ImageLoader::import_loop, this);
+	cv.notify_all();
+}
+
+void ImageLoader::import_loop()
+{
+	while (true)
 	{
-		std::cerr << "Failed to resize image" << std::endl;
+		std::string path;
+		{
+			std::unique_lock lock(mutex);
+			cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (stopping) return;
+			path = jobs.front();
+		}
+
+		// one tile at a time, the pool is left to the simulation
+		Source source;
+		if (decode(path, source))
+		{
+			const int grid_w = static_cast<int>(grid->get_width());
+			const int grid_h = static_cast<int>(grid->get_height());
+			for (int tile = 0; tile < get_tile_count(grid_h); tile++)
+			{
+				Edit edit;
+				if (!quantize_tile(source, grid_w, grid_h, tile, edit))
+				{
+					std::cerr << "Failed to resize image: " << path << std::endl;
+					break;
+				}
+				std::lock_guard lock(mutex);
+				if (stopping) return;
+				finished.push_back(std::move(edit));
+				cv.notify_all();
+			}
+		}
+
+		std::lock_guard lock(mutex);
+		jobs.pop_front();
+		importing = !jobs.empty();
+		cv.notify_all();
 	}
+}
+
+size_t ImageLoader::get_ready()
+{
+	std::lock_guard lock(mutex);
+	return finished.size();
+}
 
-	stbi_image_free(raw_image);
-	free(resized_image);
-}
\ No newline at end of file
+size_t ImageLoader::take(size_t count, std::vector<Edit>& out, bool wait)
+{
+	std::unique_lock lock(mutex);
+	if (wait)
+		cv.wait(lock, [&] { return finished.size() >= count || !importing; });
+	const size_t taken = std::min(count, finished.size());
+	for (size_t i = 0; i < taken; i++)
+	{
+		out.push_back(std::move(finished.front()));
+		finished.pop_front();
+	}
+	return taken;
+}
@@ -1,14 +1,85 @@
 #pragma once
 
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+#include "edit_queue.h"
 #include "grid.h"
 
+// imports images as stamps over the whole grid, in tiles of TILE_ROWS rows. tiles are resized and quantized
+// separately, so a background import can hand them out as they finish
 class ImageLoader
 {
-	inline static std::vector<std::pair<Particle::Type, Color>> color_palette;
+	// decoded pixels of an image being imported
+	struct Source
+	{
+		std::unique_ptr<unsigned char, void(*)(void*)> pixels{ nullptr, nullptr };
+		int width = 0;
+		int height = 0;
+		int channels = 0;
+	};
+
 	Grid* grid;
-	void quantize_to_grid(unsigned char* image, int w, int h, int channels);
+	BS::thread_pool* pool;
+
+	// background imports, tiles come out in the order the imports were started
+	std::thread import_thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::string> jobs;
+	std::deque<Edit> finished;
+	bool importing = false;
+	bool stopping = false;
+
+	void import_loop();
+	static bool decode(const std::string& path, Source& source);
+	// resizes the image to width * height and quantizes rows [tile * TILE_ROWS, + TILE_ROWS) of it into a stamp
+	static bool quantize_tile(const Source& source, int width, int height, int tile, Edit& edit);
+	static int get_tile_count(int height) { return (height + TILE_ROWS - 1) / TILE_ROWS; }
+	// writes the material of each of count rgb(a) pixels to out
+	static void quantize_row(const unsigned char* pixels, int count, int channels, Particle::Type* out);
 public:
-	ImageLoader(Grid* grid);
-	void open();
-};
+	// bits per channel of the rgb to material lookup cube
+	static constexpr int LOOKUP_BITS = 6;
+	static constexpr int LOOKUP_SIZE = 1 << (3 * LOOKUP_BITS);
+	// a chunk row per tile, so every tile lands on whole chunks
+	static constexpr int TILE_ROWS = CHUNK_SIZE;
+
+	ImageLoader(Grid* grid, BS::thread_pool* pool);
+	~ImageLoader();
+	ImageLoader(const ImageLoader&) = delete;
+	ImageLoader& operator=(const ImageLoader&) = delete;
+
+	// file dialog, empty if cancelled or there is no dialog on this platform
+	std::string choose_file();
+	// quantizes the image at path in parallel on the pool and pushes every tile, applied at the next tick
+	bool load(const std::string& path, EditQueue& edits);
+	// quantizes the image at path at width * height, or its own size when those are 0, into row major types
+	bool quantize(const std::string& path, int& width, int& height, std::vector<Particle::Type>& types);
+	// the image at path resized to width * height the way an import resizes it before quantizing, row major
+	static bool resize(const std::string& path, int width, int height, std::vector<Color>& pixels);
 
+	// queues an import on the background thread, returns straight away
+	void start(const std::string& path);
+	// tiles finished and not taken yet
+	size_t get_ready();
+	// moves up to count finished tiles to out in order. with wait, blocks until count are ready or every import is done
+	size_t take(size_t count, std::vector<Edit>& out, bool wait);
+
+	// squared red mean distance between two colors, only ever compared
+	static long red_mean_dist(Color c1, Color c2);
+	// palette material closest to color, searching the whole palette
+	static Particle::Type nearest_material(Color color);
+	// index into ParticleUtils::quantize_palette per cell of a LOOKUP_BITS deep rgb cube, built on first use
+	static const std::array<uint8_t, LOOKUP_SIZE>& lookup();
+	// palette material for color out of the lookup cube, what an import quantizes a pixel to
+	static Particle::Type lookup_material(Color color);
+};
@@ -8,7 +8,7 @@ ImageUploadUI::ImageUploadUI(SDL_Renderer* renderer, const char* img_path, float
 	SDL_QueryTexture(img, NULL, NULL, &w, &h);
 }
 
-bool ImageUploadUI::render(SDL_Renderer* renderer, ImageLoader loader, XMINT2 window_size, int mouse_x, int mouse_y)
+bool ImageUploadUI::render(SDL_Renderer* renderer, const std::function<void()>& on_click, XMINT2 window_size, int mouse_x, int mouse_y)
 {
 	SDL_FRect tex
 	{
@@ -19,6 +19,7 @@ bool ImageUploadUI::render(SDL_Renderer* renderer, ImageLoader loader, XMINT2 wi
 	};
 
 	bool ret = false;
+	const bool down = SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT);
 	// if mouse is hovering grow the icon
 	SDL_FPoint mouse = { static_cast<float>(mouse_x), static_cast<float>(mouse_y) };
 	if (SDL_PointInFRect(&mouse, &tex))
@@ -28,11 +29,12 @@ bool ImageUploadUI::render(SDL_Renderer* renderer, ImageLoader loader, XMINT2 wi
 		tex.w *= 1.2f;
 		tex.h *= 1.2f;
 		ret = true;
-		if (SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT))
+		if (down && !pressed)
 		{
-			loader.open();
+			on_click();
 		}
 	}
+	pressed = down;
 
 	SDL_RenderCopyF(renderer, img, NULL, &tex);
 
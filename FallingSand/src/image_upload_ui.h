@@ -1,9 +1,8 @@
 ﻿#pragma once
+#include <functional>
 #include <DirectXMath.h>
 #include <SDL_render.h>
 
-#include "image_loader.h"
-
 using namespace DirectX;
 
 class ImageUploadUI
@@ -11,7 +10,9 @@ class ImageUploadUI
 	float padding;
 	int w, h;
 	SDL_Texture* img;
+	bool pressed = false; // clicks fire once per press, not every frame the button is held
 public:
 	ImageUploadUI(SDL_Renderer* renderer, const char* img_path, float padding);
-	bool render(SDL_Renderer* renderer, ImageLoader loader, XMINT2 window_size, int mouse_x, int mouse_y);
+	// on_click picks and imports an image, returns true while hovered
+	bool render(SDL_Renderer* renderer, const std::function<void()>& on_click, XMINT2 window_size, int mouse_x, int mouse_y);
 };
@@ -1,18 +1,31 @@
-#include <stdexcept>
+﻿#include <stdexcept>
 
 #define SDL_MAIN_HANDLED
+#include <filesystem>
 #include <iostream>
+#include <optional>
 #include <SDL.h>
 
-#include "brush.h"
+#include "benchmark.h"
+#include "camera.h"
+#include "command.h"
+#include "headless.h"
 #include "sdl_util.h"
 #include "simulation.h"
+#include "replay.h"
+#include "ring_profiler.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "world_stream.h"
 
 #include <Tracy.hpp>
 
 #include "image_loader.h"
+#include "microbench.h"
 #include "image_upload_ui.h"
 #include "particle_selector_ui.h"
+#include "perf_counters.h"
+#include "perf_overlay.h"
 
 #include <argparse/argparse.hpp>
 
@@ -25,6 +38,7 @@
 int main(int argc, char* argv[])
 {
 	//*** REMOVE TRACY_ENABLE FROM PREPROCESSOR DEFINITION ON REAL RELEASE OR ELSE MEMORY WILL KEEP GROWING ***//
+	// it also turns on PROFILING, the per material timers and counters in profiling.h
 
 	argparse::ArgumentParser program("falling_sand");
 
@@ -40,6 +54,160 @@ int main(int argc, char* argv[])
 		.help("height of the window.")
 		.scan<'i', int>();
 
+	program.add_argument("-c", "--cell-size")
+		.default_value(1)
+		.help("size of a simulation cell in pixels. the grid is simulated at width / cell-size x height / cell-size.")
+		.scan<'i', int>();
+
+	program.add_argument("--world-width")
+		.default_value(0)
+		.help("width of the world in cells, defaults to what fits in the window. pan with the middle mouse button, zoom with the wheel.")
+		.scan<'i', int>();
+
+	program.add_argument("--world-height")
+		.default_value(0)
+		.help("height of the world in cells, defaults to what fits in the window.")
+		.scan<'i', int>();
+
+	program.add_argument("--huge-pages")
+		.flag()
+		.help("back grid chunks with huge pages where the os allows it.");
+
+	program.add_argument("--world-file")
+		.default_value(std::string("world.fsw"))
+		.help("file the world is saved to with F5 and loaded from with F9.");
+
+	program.add_argument("--stream-world")
+		.default_value(std::string(""))
+		.help("page chunks of a large world in and out of this file around the camera instead of keeping it all in memory. F5 and F9 are off while streaming.");
+
+	program.add_argument("--resident-chunks")
+		.default_value(2048)
+		.help("how many chunks to keep in memory when streaming the world.")
+		.scan<'i', int>();
+
+	program.add_argument("--record")
+		.default_value(std::string(""))
+		.help("record every tick to this replay file from startup, F6 toggles recording.");
+
+	program.add_argument("--replay")
+		.default_value(std::string(""))
+		.help("play back a replay file instead of simulating.");
+
+	program.add_argument("--seed")
+		.default_value(uint64_t(0))
+		.help("seed for the simulation and brushes, 0 picks one at random.")
+		.scan<'u', uint64_t>();
+
+	program.add_argument("--import")
+		.default_value(std::string(""))
+		.help("import this image onto the world at startup, images can also be dropped onto the window.");
+
+	program.add_argument("--stamps")
+		.default_value(std::string("stamps.fsl"))
+		.help("stamp library loaded at startup and saved on exit. C captures around the cursor, V places, tab cycles, shift+drop imports an image as a stamp.");
+
+	program.add_argument("--record-input")
+		.default_value(std::string(""))
+		.help("log every brush stroke, import and camera move with its tick to this file.");
+
+	program.add_argument("--headless")
+		.default_value(std::string(""))
+		.help("re-simulate a command log from --record-input without a window and print timings.");
+
+	program.add_argument("--benchmark")
+		.default_value(0)
+		.help("run this many ticks without a window on a generated scene and print timings.")
+		.scan<'i', int>();
+
+	program.add_argument("--scenes")
+		.nargs(argparse::nargs_pattern::at_least_one)
+		.help("play these generated scenes without a window and print ticks/sec per thread count, all runs every scene.");
+
+	program.add_argument("--scene-resolutions")
+		.nargs(argparse::nargs_pattern::at_least_one)
+		.default_value(std::vector<std::string>{ "1080p" })
+		.help("world sizes for --scenes, 720p, 1080p, 1440p, 4k, 8k or WIDTHxHEIGHT, all runs every preset.");
+
+	program.add_argument("--scene-threads")
+		.nargs(argparse::nargs_pattern::at_least_one)
+		.default_value(std::vector<unsigned int>{})
+		.help("thread counts for --scenes, by default every count from 1 up to the core count.")
+		.scan<'u', unsigned int>();
+
+	program.add_argument("--scene-ticks")
+		.default_value(300)
+		.help("ticks each --scenes run is timed over.")
+		.scan<'i', int>();
+
+	program.add_argument("--scene-csv")
+		.default_value(std::string(""))
+		.help("with --scenes, write ticks/sec, speedup, efficiency and barrier wait per scene and thread count to this csv.");
+
+	program.add_argument("--scene-baseline")
+		.default_value(std::string(""))
+		.help("with --scenes, fail when a run's world hash differs from this file's or its ticks/sec dropped more than --scene-tolerance.");
+
+	program.add_argument("--scene-save")
+		.default_value(std::string(""))
+		.help("with --scenes, save world hashes and ticks/sec to this file to use as a baseline. runs of other settings already in it are kept.");
+
+	program.add_argument("--scene-tolerance")
+		.default_value(0.1)
+		.help("with --scene-baseline, share of the baseline's ticks/sec a run may lose, 0.1 is 10%.")
+		.scan<'g', double>();
+
+	program.add_argument("--scene-hashes-only")
+		.flag()
+		.help("with --scene-save, leave ticks/sec out of the file, with --scene-baseline only compare world hashes. for the baselines kept in the repo.");
+
+	program.add_argument("--microbench")
+		.flag()
+		.help("time grid primitives and simulation kernels in ns per call without a window.");
+
+	program.add_argument("--microbench-filter")
+		.default_value(std::string(""))
+		.help("with --microbench, only run cases whose name contains this.");
+
+	program.add_argument("--microbench-baseline")
+		.default_value(std::string(""))
+		.help("with --microbench, compare against results saved earlier and fail on regressions.");
+
+	program.add_argument("--microbench-save")
+		.default_value(std::string(""))
+		.help("with --microbench, save the results to this file to use as a baseline.");
+
+	program.add_argument("--microbench-tolerance")
+		.default_value(0.15)
+		.help("with --microbench-baseline, how much slower a case may get before it counts as a regression, 0.15 is 15%.")
+		.scan<'g', double>();
+
+	program.add_argument("--telemetry")
+		.default_value(std::string(""))
+		.help("write one record per tick to this file, csv if it ends in .csv, json lines otherwise. works with --benchmark too.");
+
+	program.add_argument("--perf-counters")
+		.flag()
+		.help("count cycles, instructions, cache and branch misses per simulation and render phase on every worker (linux only). goes into --telemetry, --benchmark prints it per worker.");
+
+	program.add_argument("--persistent-workers")
+		.flag()
+		.help("run the simulation's strips on threads pinned to cores that spin between phases, instead of as pool tasks. works with --benchmark and --scenes too.");
+
+	program.add_argument("--trace-threshold")
+		.default_value(0.f)
+		.help("dump the profiler's last seconds to trace_N.json whenever a frame takes longer than this many ms, 0 only dumps on F12.")
+		.scan<'g', float>();
+
+	program.add_argument("--trace-window")
+		.default_value(10.f)
+		.help("seconds of profiler events kept in a trace dump and in the exit summary.")
+		.scan<'g', float>();
+
+	program.add_argument("--benchmark-image")
+		.default_value(std::string(""))
+		.help("with --benchmark, also time importing this image.");
+
 	try 
 	{
 		program.parse_args(argc, argv);
@@ -53,6 +221,7 @@ int main(int argc, char* argv[])
 
 	const int WIDTH = program.get<int>("--width");
 	const int HEIGHT = program.get<int>("--height");
+	const int CELL_SIZE = program.get<int>("--cell-size");
 
 	if (WIDTH <= 0)
 	{
@@ -64,6 +233,114 @@ int main(int argc, char* argv[])
 		std::cerr << "Height must be greater than 0" << std::endl;
 		return 1;
 	}
+	if (CELL_SIZE <= 0 || CELL_SIZE > std::min(WIDTH, HEIGHT))
+	{
+		std::cerr << "Cell size must be between 1 and the smaller window dimension" << std::endl;
+		return 1;
+	}
+	if (program.get<int>("--world-width") < 0 || program.get<int>("--world-height") < 0)
+	{
+		std::cerr << "World size must not be negative" << std::endl;
+		return 1;
+	}
+
+	// a replay brings its own world size
+	const auto REPLAY_FILE = program.get<std::string>("--replay");
+	unsigned int replay_width = 0, replay_height = 0;
+	if (!REPLAY_FILE.empty() && !Replay::read_size(REPLAY_FILE, replay_width, replay_height))
+		return 1;
+
+	// by default the world is whatever fits in the window at the chosen cell size
+	const int GRID_WIDTH = replay_width > 0 ? static_cast<int>(replay_width)
+		: program.get<int>("--world-width") > 0 ? program.get<int>("--world-width") : WIDTH / CELL_SIZE;
+	const int GRID_HEIGHT = replay_height > 0 ? static_cast<int>(replay_height)
+		: program.get<int>("--world-height") > 0 ? program.get<int>("--world-height") : HEIGHT / CELL_SIZE;
+
+	const bool HUGE_PAGES = program.get<bool>("--huge-pages");
+	const auto WORLD_FILE = program.get<std::string>("--world-file");
+	const auto STREAM_FILE = program.get<std::string>("--stream-world");
+	const auto RECORD_FILE = program.get<std::string>("--record");
+	if (program.get<int>("--resident-chunks") <= 0)
+	{
+		std::cerr << "Resident chunks must be greater than 0" << std::endl;
+		return 1;
+	}
+	if (!program.get<std::string>("--headless").empty())
+	{
+		HeadlessRun headless({
+			.command_log = program.get<std::string>("--headless"),
+			.huge_pages = HUGE_PAGES,
+		});
+		return headless.run();
+	}
+	if (program.get<bool>("--microbench"))
+	{
+		Microbench microbench({
+			.filter = program.get<std::string>("--microbench-filter"),
+			.baseline = program.get<std::string>("--microbench-baseline"),
+			.save = program.get<std::string>("--microbench-save"),
+			.tolerance = program.get<double>("--microbench-tolerance"),
+		});
+		return microbench.run();
+	}
+	if (program.is_used("--scenes"))
+	{
+		auto scenes = program.get<std::vector<std::string>>("--scenes");
+		if (scenes.size() == 1 && scenes[0] == "all")
+			scenes = Scenes::names();
+		std::vector<SceneResolution> resolutions;
+		const auto resolution_names = program.get<std::vector<std::string>>("--scene-resolutions");
+		if (resolution_names.size() == 1 && resolution_names[0] == "all")
+			resolutions = Scenes::resolutions();
+		else
+		{
+			for (const std::string& name : resolution_names)
+			{
+				SceneResolution resolution;
+				if (!Scenes::parse_resolution(name, resolution))
+				{
+					std::cerr << "Unknown scene resolution: " << name << std::endl;
+					return 1;
+				}
+				resolutions.push_back(resolution);
+			}
+		}
+		if (program.get<int>("--scene-ticks") <= 0)
+		{
+			std::cerr << "Scene ticks must be greater than 0" << std::endl;
+			return 1;
+		}
+		// runs are only comparable with the same seed, so the suite doesn't pick a random one
+		ScenarioSuite suite({
+			.scenes = scenes,
+			.resolutions = resolutions,
+			.threads = program.get<std::vector<unsigned int>>("--scene-threads"),
+			.ticks = program.get<int>("--scene-ticks"),
+			.seed = program.get<uint64_t>("--seed") != 0 ? program.get<uint64_t>("--seed") : 5660,
+			.huge_pages = HUGE_PAGES,
+			.baseline = program.get<std::string>("--scene-baseline"),
+			.save = program.get<std::string>("--scene-save"),
+			.tolerance = program.get<double>("--scene-tolerance"),
+			.csv = program.get<std::string>("--scene-csv"),
+			.hashes_only = program.get<bool>("--scene-hashes-only"),
+			.persistent_workers = program.get<bool>("--persistent-workers"),
+		});
+		return suite.run();
+	}
+	if (program.get<int>("--benchmark") > 0)
+	{
+		Benchmark benchmark({
+			.width = GRID_WIDTH,
+			.height = GRID_HEIGHT,
+			.ticks = program.get<int>("--benchmark"),
+			.huge_pages = HUGE_PAGES,
+			.image = program.get<std::string>("--benchmark-image"),
+			.telemetry = program.get<std::string>("--telemetry"),
+			.phase_counters = program.get<bool>("--perf-counters"),
+			.persistent_workers = program.get<bool>("--persistent-workers"),
+		});
+		return benchmark.run();
+	}
 
 	if (SDL_Init(SDL_INIT_VIDEO) != 0)
 	{
@@ -100,32 +377,114 @@ int main(int argc, char* argv[])
 	}
 
 	BS::synced_stream sync_err(std::cerr);
-	BS::thread_pool pool;
+	// counters have to be opened on the workers themselves
+	const bool PERF_COUNTERS = program.get<bool>("--perf-counters");
+	BS::thread_pool pool([PERF_COUNTERS] { if (PERF_COUNTERS) PerfCounters::attach_thread(); });
+	if (PERF_COUNTERS)
+	{
+		PerfCounters::attach_thread();
+		PerfCounters::set_phase_counting(true);
+	}
 
-	Grid grid(WIDTH, HEIGHT, sync_err);
+	Grid grid(GRID_WIDTH, GRID_HEIGHT, sync_err, HUGE_PAGES);
+	Camera camera(WIDTH, HEIGHT, GRID_WIDTH, GRID_HEIGHT, static_cast<float>(CELL_SIZE));
 	int brush_size = 10;
-	CircleBrush circle_brush(brush_size);
-	RandomBrush rand_brush(brush_size, 0.1f);
-	Simulation simulation(&grid);
+	// world cell the brush was over last frame while a button was held, strokes sweep from there
+	std::optional<XMINT2> last_brush_cell;
+	const uint64_t SEED = program.get<uint64_t>("--seed") != 0 ? program.get<uint64_t>("--seed") : std::random_device{}();
+	Simulation simulation(&grid, SEED);
+	std::unique_ptr<TickWorkers> workers;
+	if (program.get<bool>("--persistent-workers"))
+	{
+		workers = std::make_unique<TickWorkers>(pool.get_thread_count(), true, [PERF_COUNTERS] { if (PERF_COUNTERS) PerfCounters::attach_thread(); });
+		simulation.set_workers(workers.get());
+	}
+	// all edits go through the runner so a logged session can be re-simulated
+	CommandRunner commands(grid, simulation, pool);
+#ifdef INTERPOLATE
+	grid.set_motion_tracking(true);
+#endif
+
+	WorldStreamer streamer(grid, static_cast<size_t>(program.get<int>("--resident-chunks")));
+	const bool streaming = !STREAM_FILE.empty() && REPLAY_FILE.empty();
+	if (streaming)
+	{
+		if (!streamer.open(STREAM_FILE))
+		{
+			SDL_DestroyTexture(texture);
+			SDL_DestroyRenderer(renderer);
+			SDL_DestroyWindow(window);
+			SDL_Quit();
+			return 1;
+		}
+		// chunks outside the focus are not resident, so never tick the whole world
+		simulation.set_background_interval(0);
+	}
+
+	ReplayRecorder recorder(grid, pool);
+	ReplayPlayer player(grid);
+	const bool replaying = !REPLAY_FILE.empty();
+	bool replay_paused = false;
+	float replay_speed = 1.f;
+	const auto INPUT_LOG = program.get<std::string>("--record-input");
+	if (replaying ? !player.open(REPLAY_FILE) || !player.seek(player.get_first_tick(), pool)
+		: (!RECORD_FILE.empty() && !recorder.start(RECORD_FILE, simulation.get_tick())) || (!INPUT_LOG.empty() && !commands.start_log(INPUT_LOG)))
+	{
+		SDL_DestroyTexture(texture);
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+		return 1;
+	}
 
 	Particle::Type selected_particle = Particle::SAND;
 
-	ImageLoader image_loader(&grid);
+	ImageLoader image_loader(&grid, &pool);
 	ImageUploadUI image_upload_ui(renderer, "./assets/upload.png", 20.f);
 	ParticleSelectorUI particle_selector_ui(10, 40);
+	PerfOverlay perf_overlay;
 
-	auto update_brush_radii = [&brush_size, &circle_brush, &rand_brush](int size)
+	auto update_brush_radii = [&brush_size](int size)
 	{
 		brush_size = std::clamp(size, 1, 100);
-		circle_brush.set_brush_size(brush_size);
-		rand_brush.set_brush_size(brush_size);
 	};
+	auto import_image = [&]
+	{
+		const auto path = image_loader.choose_file();
+		if (!path.empty())
+			commands.execute({ .tick = simulation.get_tick(), .kind = Command::IMAGE, .path = path });
+	};
+	if (!replaying && !program.get<std::string>("--import").empty())
+		commands.execute({ .tick = simulation.get_tick(), .kind = Command::IMAGE, .path = program.get<std::string>("--import") });
+
+	const auto STAMP_FILE = program.get<std::string>("--stamps");
+	if (!replaying && std::filesystem::exists(STAMP_FILE))
+		commands.execute({ .tick = simulation.get_tick(), .kind = Command::STAMPS, .path = STAMP_FILE });
+	std::string selected_stamp;
+	auto select_stamp = [&](const std::string& name)
+	{
+		selected_stamp = name;
+		std::cout << "Selected stamp " << name << std::endl;
+	};
+	auto cursor_cell = [&]
+	{
+		int cursor_x, cursor_y;
+		SDL_GetMouseState(&cursor_x, &cursor_y);
+		return camera.screen_to_world(cursor_x, cursor_y);
+	};
+	CellRect focus{};
+
+	RingProfiler::set_window(program.get<float>("--trace-window"));
+	FrameWatch frame_watch("trace_", program.get<float>("--trace-threshold"));
+	Telemetry telemetry;
+	if (!program.get<std::string>("--telemetry").empty())
+		telemetry.open(program.get<std::string>("--telemetry"));
 
 	bool quit = false;
 	bool over_UI = false;
 	float delta = 0.f;
 	float accum = 0.f;
-	constexpr float dt = 1.f / 30.f;
+	constexpr float dt = Simulation::FIXED_DELTA;
 	while (!quit)
 	{
 		SDL_Event event;
@@ -135,7 +494,66 @@ int main(int argc, char* argv[])
 			case SDL_QUIT:
 				quit = true;
 				break;
+			case SDL_DROPFILE:
+				// imports in the background, tiles land over the next frames. with shift held it becomes a stamp instead
+				if (!replaying && (SDL_GetModState() & KMOD_SHIFT))
+				{
+					commands.execute({ .tick = simulation.get_tick(), .kind = Command::STAMP_IMAGE, .path = event.drop.file });
+					if (commands.get_stamps().get(CommandRunner::stamp_name(event.drop.file)))
+						select_stamp(CommandRunner::stamp_name(event.drop.file));
+				}
+				else if (!replaying)
+				{
+					commands.execute({ .tick = simulation.get_tick(), .kind = Command::IMAGE, .path = event.drop.file });
+				}
+				SDL_free(event.drop.file);
+				break;
 			case SDL_KEYDOWN:
+				if (replaying)
+				{
+					// space pauses, left and right step a tick, page up and down jump ten seconds, up and down change speed
+					switch (event.key.keysym.sym)
+					{
+					case SDLK_ESCAPE:
+						quit = true;
+						break;
+					case SDLK_SPACE:
+						replay_paused = !replay_paused;
+						break;
+					case SDLK_LEFT:
+						replay_paused = true;
+						player.seek(player.get_tick() - std::min<uint64_t>(player.get_tick(), 1), pool);
+						break;
+					case SDLK_RIGHT:
+						replay_paused = true;
+						player.step(pool);
+						break;
+					case SDLK_PAGEUP:
+						player.seek(player.get_tick() - std::min<uint64_t>(player.get_tick(), 300), pool);
+						break;
+					case SDLK_PAGEDOWN:
+						player.seek(player.get_tick() + 300, pool);
+						break;
+					case SDLK_HOME:
+						player.seek(player.get_first_tick(), pool);
+						break;
+					case SDLK_UP:
+						replay_speed = std::min(replay_speed * 2.f, 64.f);
+						break;
+					case SDLK_DOWN:
+						replay_speed = std::max(replay_speed * 0.5f, 0.125f);
+						break;
+					case SDLK_F5:
+						Snapshot::save(grid, WORLD_FILE, pool);
+						break;
+					case SDLK_F12:
+						frame_watch.dump();
+						break;
+					default:
+						break;
+					}
+					break;
+				}
 				switch (event.key.keysym.sym)
 				{
 				case SDLK_ESCAPE:
@@ -149,7 +567,7 @@ int main(int argc, char* argv[])
 					break;
 				// TODO: create UI for triggering open()
 				case SDLK_SPACE:
-					image_loader.open();
+					import_image();
 					break;
 				case SDLK_a:
 					update_brush_radii(brush_size - 1);
@@ -157,35 +575,163 @@ int main(int argc, char* argv[])
 				case SDLK_d:
 					update_brush_radii(brush_size + 1);
 					break;
+				case SDLK_F5:
+					// the grid only holds the resident chunks and the world file may be the one the streamer has mapped
+					if (streaming)
+						std::cerr << "F5 is off while streaming " << STREAM_FILE << ", the world is saved on exit" << std::endl;
+					else
+						Snapshot::save(grid, WORLD_FILE, pool);
+					break;
+				case SDLK_F12:
+					frame_watch.dump();
+					break;
+				case SDLK_F3:
+					perf_overlay.toggle(simulation);
+					break;
+				case SDLK_F9:
+					if (streaming)
+						std::cerr << "F9 is off while streaming " << STREAM_FILE << std::endl;
+					else
+						commands.execute({ .tick = simulation.get_tick(), .kind = Command::WORLD, .path = WORLD_FILE });
+					break;
+				case SDLK_F6:
+					if (recorder.is_recording())
+						recorder.stop();
+					else
+						recorder.start(RECORD_FILE.empty() ? "replay.fsr" : RECORD_FILE, simulation.get_tick());
+					break;
+				case SDLK_c:
+				{
+					// the square the brush covers becomes a new stamp
+					const auto cell = cursor_cell();
+					std::string name;
+					for (size_t i = commands.get_stamps().get_names().size() + 1; name.empty() || commands.get_stamps().get(name); i++)
+						name = "stamp" + std::to_string(i);
+					commands.execute({ .tick = simulation.get_tick(), .kind = Command::CAPTURE,
+						.focus = { cell.x - brush_size, cell.y - brush_size, cell.x + brush_size, cell.y + brush_size }, .name = name });
+					if (commands.get_stamps().get(name))
+						select_stamp(name);
+					break;
+				}
+				case SDLK_v:
+					if (const auto stamp = commands.get_stamps().get(selected_stamp))
+					{
+						const auto cell = cursor_cell();
+						commands.execute({ .tick = simulation.get_tick(), .kind = Command::PLACE,
+							.x = cell.x - stamp->width / 2, .y = cell.y - stamp->height / 2, .name = selected_stamp });
+					}
+					break;
+				case SDLK_TAB:
+				{
+					const auto names = commands.get_stamps().get_names();
+					if (names.empty()) break;
+					const auto next = std::upper_bound(names.begin(), names.end(), selected_stamp);
+					select_stamp(next == names.end() ? names.front() : *next);
+					break;
+				}
 				default:
 					break;
 				}
 				break;
+			case SDL_MOUSEMOTION:
+				if (event.motion.state & SDL_BUTTON_MMASK)
+					camera.pan(static_cast<float>(-event.motion.xrel), static_cast<float>(-event.motion.yrel));
+				break;
+			case SDL_MOUSEWHEEL:
+			{
+				int wheel_x, wheel_y;
+				SDL_GetMouseState(&wheel_x, &wheel_y);
+				camera.zoom_at(wheel_x, wheel_y, event.wheel.y > 0 ? 1.25f : 0.8f);
+				break;
+			}
 			default:
 				break;
 			}
 		}
 
+		// everything on screen plus a margin is ticked every step, the rest of the world less often
+		if (camera.visible_cells() != focus)
+		{
+			focus = camera.visible_cells();
+			commands.execute({ .tick = simulation.get_tick(), .kind = Command::FOCUS, .focus = focus });
+		}
+		if (streaming)
+			streamer.update(camera.visible_cells());
+
 		// start timer
 		static auto start_timer = std::chrono::high_resolution_clock::now();
 
-		accum += delta;
-		while (accum > dt)
+		if (replaying)
+		{
+			// the player only applies recorded cells, so it can run many ticks per frame
+			if (!replay_paused)
+				accum += delta * replay_speed;
+			while (accum > dt)
+			{
+				if (!player.step(pool))
+					replay_paused = true;
+				accum -= dt;
+			}
+			if (replay_paused)
+				accum = 0.f;
+			// speed is always a power of two
+			const std::string speed = replay_speed < 1.f ? "x1/" + std::to_string(static_cast<int>(1.f / replay_speed)) : "x" + std::to_string(static_cast<int>(replay_speed));
+			const std::string title = "CIS 5660 | Falling Sand | tick " + std::to_string(player.get_tick()) + " / "
+				+ std::to_string(player.get_last_tick()) + " " + (replay_paused ? std::string("paused") : speed);
+			SDL_SetWindowTitle(window, title.c_str());
+		}
+		else
 		{
-			simulation.update(dt, pool);
-			accum -= dt;
+			commands.poll(simulation.get_tick());
+			accum += delta;
+			const int64_t ticks_start = RingProfiler::now();
+			bool ticked = false;
+			while (accum > dt)
+			{
+				simulation.update(dt, pool);
+				telemetry.record(simulation.get_stats());
+				recorder.capture(simulation.get_tick());
+				accum -= dt;
+				ticked = true;
+			}
+			if (ticked)
+				perf_overlay.record_ticks((RingProfiler::now() - ticks_start) / 1e6);
 		}
 		float alpha = accum / dt;
 		
 		// click to draw
 		// TODO: customize brush
-		if (!over_UI)
+		if (!over_UI && !replaying)
 		{
-			auto right_click = SDL_GetMouseState(nullptr, nullptr) & SDL_BUTTON(SDL_BUTTON_RIGHT);
-			if (ParticleUtils::use_solid_brush(selected_particle) || right_click)
-				circle_brush.draw_particles(grid, selected_particle);
+			int brush_x, brush_y;
+			const auto buttons = SDL_GetMouseState(&brush_x, &brush_y);
+			const bool left_click = buttons & SDL_BUTTON(SDL_BUTTON_LEFT);
+			const bool right_click = buttons & SDL_BUTTON(SDL_BUTTON_RIGHT);
+			if (left_click || right_click)
+			{
+				const auto cell = camera.screen_to_world(brush_x, brush_y);
+				const auto from = last_brush_cell.value_or(cell);
+				commands.execute({
+					.tick = simulation.get_tick(),
+					.kind = Command::BRUSH,
+					.shape = ParticleUtils::use_solid_brush(selected_particle) || right_click ? Command::CIRCLE : Command::RANDOM,
+					.size = brush_size,
+					.x = cell.x,
+					.y = cell.y,
+					.from_x = from.x,
+					.from_y = from.y,
+					.material = right_click ? Particle::EMPTY : selected_particle,
+				});
+				last_brush_cell = cell;
+			}
 			else
-				rand_brush.draw_particles(grid, selected_particle); // can set default velocity
+			{
+				last_brush_cell.reset();
+			}
+		}
+		else
+		{
+			last_brush_cell.reset();
 		}
 
 		// RENDER
@@ -199,7 +745,8 @@ int main(int argc, char* argv[])
 
 		auto pixel_data = static_cast<uint32_t*>(pixels);
 
-		SDL_Util::update_texture_via_grid(pool, pixel_data, grid, WIDTH, HEIGHT, pitch, alpha);
+		SDL_Util::update_texture_via_grid(pool, pixel_data, grid, pitch, camera, alpha);
+		perf_overlay.draw(pool, { .pixelData = pixel_data, .width = WIDTH, .height = HEIGHT }, simulation, grid, camera);
 
 		int mouse_x, mouse_y;
 		SDL_GetMouseState(&mouse_x, &mouse_y);
@@ -212,17 +759,18 @@ int main(int argc, char* argv[])
 					.width = WIDTH,
 					.height = HEIGHT
 				},
-				mouse_x, mouse_y, rand_brush.get_brush_size(), mouseColor.hex());
+				mouse_x, mouse_y, static_cast<int>(brush_size * camera.get_zoom()), mouseColor.hex());
 		}
 
 		SDL_UnlockTexture(texture);
+		telemetry.add_upload(static_cast<uint64_t>(pitch) * HEIGHT);
 
 		// present
 		SDL_RenderClear(renderer);
 		SDL_RenderCopy(renderer, texture, nullptr, nullptr);
 
 		auto over_particle = particle_selector_ui.render(renderer, { WIDTH, HEIGHT }, &selected_particle, mouse_x, mouse_y);
-		auto over_image = image_upload_ui.render(renderer, image_loader, { WIDTH, HEIGHT }, mouse_x, mouse_y);
+		auto over_image = image_upload_ui.render(renderer, import_image, { WIDTH, HEIGHT }, mouse_x, mouse_y);
 		over_UI = over_particle || over_image;
 
 		SDL_RenderPresent(renderer);
@@ -231,8 +779,25 @@ int main(int argc, char* argv[])
 		delta = std::chrono::duration<float, std::milli>(end_timer - start_timer).count() / 1000.f;
 
 		FrameMark;
+		frame_watch.end_frame();
+		perf_overlay.end_frame();
 	}
 
+	for (const char* zone : { "simulation update", "render" })
+	{
+		const auto summary = RingProfiler::summarize(zone);
+		if (summary.count > 0)
+			std::cout << zone << " ms over the last " << summary.count << ": p50 " << summary.p50 << ", p99 " << summary.p99
+				<< ", max " << summary.max << std::endl;
+	}
+
+	recorder.stop();
+	commands.finish_log();
+	telemetry.close();
+	if (!replaying && !commands.get_stamps().get_names().empty())
+		commands.get_stamps().save(STAMP_FILE);
+	streamer.close();
+
 	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
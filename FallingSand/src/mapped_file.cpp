@@ -0,0 +1,86 @@
+﻿#include "mapped_file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	unmap();
+}
+
+bool MappedFile::map(const std::string& path)
+{
+	unmap();
+#ifdef _WIN32
+	// others may keep writing to the file, the view only covers what existed when it was mapped
+	HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(handle);
+		return false;
+	}
+	HANDLE map_handle = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!map_handle)
+	{
+		CloseHandle(handle);
+		return false;
+	}
+	void* address = MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0);
+	if (!address)
+	{
+		CloseHandle(map_handle);
+		CloseHandle(handle);
+		return false;
+	}
+	file = handle;
+	mapping = map_handle;
+	view = static_cast<const uint8_t*>(address);
+	bytes = static_cast<size_t>(size.QuadPart);
+#else
+	int handle = open(path.c_str(), O_RDONLY);
+	if (handle < 0) return false;
+	struct stat info;
+	if (fstat(handle, &info) != 0 || info.st_size == 0)
+	{
+		close(handle);
+		return false;
+	}
+	void* address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, handle, 0);
+	if (address == MAP_FAILED)
+	{
+		close(handle);
+		return false;
+	}
+	fd = handle;
+	view = static_cast<const uint8_t*>(address);
+	bytes = static_cast<size_t>(info.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (!view) return;
+#ifdef _WIN32
+	UnmapViewOfFile(view);
+	CloseHandle(mapping);
+	CloseHandle(file);
+	mapping = nullptr;
+	file = nullptr;
+#else
+	munmap(const_cast<uint8_t*>(view), bytes);
+	close(fd);
+	fd = -1;
+#endif
+	view = nullptr;
+	bytes = 0;
+}
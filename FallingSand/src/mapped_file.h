@@ -0,0 +1,30 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// read only view of a whole file
+class MappedFile
+{
+	const uint8_t* view = nullptr;
+	size_t bytes = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// maps the file at its current size, remapping drops the old view
+	bool map(const std::string& path);
+	void unmap();
+
+	const uint8_t* data() const { return view; }
+	size_t size() const { return bytes; }
+};
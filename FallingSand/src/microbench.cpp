@@ -0,0 +1,218 @@
+﻿#include "microbench.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "brush.h"
+#include "image_loader.h"
+#include "simulation.h"
+
+namespace
+{
+	constexpr int GRID_SIZE = 512;
+	constexpr size_t POINTS = 4096;
+	// a batch has to run at least this long to be timed, the fastest of REPEATS batches is the result
+	constexpr double MIN_BATCH_MS = 20.;
+	constexpr int REPEATS = 5;
+
+	// results go through here so the compiler can't drop the calls
+	volatile uint64_t sink = 0;
+
+	template <typename Op>
+	double batch_ns(Op& op, uint64_t count)
+	{
+		uint64_t result = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < count; i++)
+			result += op(static_cast<uint32_t>(i));
+		const auto end = std::chrono::steady_clock::now();
+		sink = sink + result;
+		return std::chrono::duration<double, std::nano>(end - start).count();
+	}
+
+	// ns per call of op(i)
+	template <typename Op>
+	double measure(Op op)
+	{
+		uint64_t count = 64;
+		while (batch_ns(op, count) < MIN_BATCH_MS * 1e6)
+			count *= 2;
+		double best = batch_ns(op, count);
+		for (int i = 1; i < REPEATS; i++)
+			best = std::min(best, batch_ns(op, count));
+		return best / count;
+	}
+
+	bool read_baseline(const std::string& path, std::map<std::string, double>& baseline)
+	{
+		std::ifstream file(path);
+		if (!file) return false;
+		std::string line;
+		while (std::getline(file, line))
+		{
+			// name, tab, ns per call
+			const size_t tab = line.rfind('\t');
+			if (tab == std::string::npos) continue;
+			std::istringstream in(line.substr(tab + 1));
+			double ns = 0;
+			if (in >> ns)
+				baseline[line.substr(0, tab)] = ns;
+		}
+		return true;
+	}
+}
+
+Microbench::Microbench(const MicrobenchOptions& options) : options(options)
+{
+}
+
+int Microbench::run()
+{
+	BS::synced_stream sync_err(std::cerr);
+	BS::thread_pool pool(2);
+	Grid grid(GRID_SIZE, GRID_SIZE, sync_err, false);
+	Simulation simulation(&grid, 5660);
+
+	// every material mixed through the world, so predicates and kernels see all their branches
+	std::mt19937 rng(5660);
+	for (int y = 0; y < GRID_SIZE; y++)
+	{
+		for (int x = 0; x < GRID_SIZE; x++)
+		{
+			const Particle::Type type = static_cast<Particle::Type>(1 << (rng() % 12));
+			if (type != Particle::EMPTY)
+				grid.set(x, y, type);
+		}
+	}
+
+	// cells to work on are looked up from a table so every call sees different, unpredictable ones
+	struct Point { int x, y; };
+	std::vector<Point> points(POINTS);
+	for (Point& point : points)
+		point = { static_cast<int>(rng() % GRID_SIZE), static_cast<int>(rng() % GRID_SIZE) };
+	auto at = [&](uint32_t i) -> const Point& { return points[i % POINTS]; };
+	std::vector<Color> colors(POINTS);
+	for (Color& color : colors)
+		color = Color(rng() & 0xFFFFFF);
+
+	std::map<std::string, double> baseline;
+	const bool compare = !options.baseline.empty() && read_baseline(options.baseline, baseline);
+	if (!options.baseline.empty() && !compare)
+		std::cout << "no baseline at " << options.baseline << ", nothing to compare against\n";
+
+	std::vector<std::pair<std::string, double>> results;
+	int regressions = 0;
+	auto bench = [&](const std::string& name, auto op)
+	{
+		if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+		const double ns = measure(op);
+		results.emplace_back(name, ns);
+		std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(2) << std::setw(12) << ns << " ns/op";
+		const auto base = baseline.find(name);
+		if (compare && base != baseline.end() && base->second > 0)
+		{
+			const double change = ns / base->second - 1.;
+			std::cout << std::showpos << std::setw(10) << change * 100. << "%" << std::noshowpos;
+			if (change > options.tolerance)
+			{
+				std::cout << "  REGRESSION";
+				regressions++;
+			}
+		}
+		std::cout << std::defaultfloat << "\n";
+	};
+
+	bench("grid get", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(grid.get(p.x, p.y)->type); });
+	bench("grid set", [&](uint32_t i)
+	{
+		const Point& p = at(i);
+		grid.set(p.x, p.y, ParticleUtils::quantize_palette[i % std::size(ParticleUtils::quantize_palette)]);
+		return uint64_t(0);
+	});
+	bench("grid swap", [&](uint32_t i) { const Point& p = at(i); const Point& q = at(i + 1); grid.swap(p.x, p.y, q.x, q.y); return uint64_t(0); });
+	bench("grid is_air", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(grid.is_air(p.x, p.y)); });
+	bench("grid is_liquid", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(grid.is_liquid(p.x, p.y)); });
+	bench("grid is_solid", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(grid.is_solid(p.x, p.y)); });
+	bench("grid is_burning", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(grid.is_burning(p.x, p.y)); });
+	bench("grid is_extinguisher", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(grid.is_extinguisher(p.x, p.y)); });
+	bench("grid is_denser", [&](uint32_t i)
+	{
+		const Point& p = at(i);
+		const Point& q = at(i + 1);
+		return static_cast<uint64_t>(grid.is_denser(grid.get(p.x, p.y), q.x, q.y));
+	});
+
+	// rays through the mixed world stop after a cell or two, these get to travel
+	Grid sparse(GRID_SIZE, GRID_SIZE, sync_err, false);
+	Simulation sparse_simulation(&sparse, 5660);
+	for (int i = 0; i < GRID_SIZE * GRID_SIZE / 256; i++)
+		sparse.set(static_cast<int>(rng() % GRID_SIZE), static_cast<int>(rng() % GRID_SIZE), Particle::STONE);
+	for (int distance : { 4, 16, 64 })
+	{
+		bench("raycast " + std::to_string(distance), [&](uint32_t i)
+		{
+			const Point& p = at(i);
+			// the eight directions in turn, cell 4 of the 3x3 block is the ray standing still
+			const int direction = static_cast<int>(i % 8);
+			const int cell = direction < 4 ? direction : direction + 1;
+			const int vx = (cell % 3 - 1) * distance;
+			const int vy = (cell / 3 - 1) * distance;
+			const XMINT2 hit = sparse_simulation.raycast(p.x, p.y, vx, vy);
+			return static_cast<uint64_t>(hit.x + hit.y);
+		});
+	}
+
+	// the reactions read the cell's own particle and its neighbours, nothing is written
+	bench("burns", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(simulation.burns(grid.get(p.x, p.y), p.x, p.y)); });
+	bench("dissolves", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(simulation.dissolves(grid.get(p.x, p.y), p.x, p.y)); });
+	bench("extinguishes", [&](uint32_t i) { const Point& p = at(i); return static_cast<uint64_t>(simulation.extinguishes(grid.get(p.x, p.y), p.x, p.y)); });
+
+	bench("vary_color", [&](uint32_t i) { return static_cast<uint64_t>(Color_Util::vary_color(colors[i % POINTS]).hex()); });
+	bench("to_hsl", [&](uint32_t i) { const XMFLOAT3 hsl = colors[i % POINTS].to_hsl(); return static_cast<uint64_t>((hsl.x + hsl.y + hsl.z) * 1000.f); });
+	bench("from_hsl", [&](uint32_t i)
+	{
+		Color color;
+		color.from_hsl(static_cast<float>(i % 360) / 360.f, static_cast<float>(i % 101) / 100.f, static_cast<float>(i % 97) / 96.f);
+		return static_cast<uint64_t>(color.hex());
+	});
+	bench("red_mean_dist", [&](uint32_t i) { return static_cast<uint64_t>(ImageLoader::red_mean_dist(colors[i % POINTS], colors[(i + 1) % POINTS])); });
+	bench("nearest_material", [&](uint32_t i) { return static_cast<uint64_t>(ImageLoader::nearest_material(colors[i % POINTS])); });
+
+	// a short stroke pushed and applied, which is what a brush costs the game per frame
+	EditQueue edits;
+	for (int size : { 1, 8, 32 })
+	{
+		const CircleBrush brush(size);
+		bench("brush stroke " + std::to_string(size), [&](uint32_t i)
+		{
+			const Point& p = at(i);
+			edits.push(brush.stroke(p.x, p.y, p.x + 4, p.y + 4, i % 2 ? Particle::SAND : Particle::EMPTY));
+			edits.apply_all(grid, pool, i);
+			return uint64_t(0);
+		});
+	}
+
+	if (!options.save.empty())
+	{
+		std::ofstream file(options.save, std::ios::trunc);
+		for (const auto& [name, ns] : results)
+			file << name << '\t' << ns << '\n';
+		if (!file)
+		{
+			std::cerr << "Failed to write microbenchmark results: " << options.save << std::endl;
+			return 1;
+		}
+		std::cout << "saved results to " << options.save << "\n";
+	}
+	if (regressions > 0)
+		std::cout << regressions << " cases more than " << options.tolerance * 100. << "% slower than the baseline\n";
+	return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,22 @@
+﻿#pragma once
+
+#include <string>
+
+struct MicrobenchOptions
+{
+	std::string filter; // only cases whose name contains this
+	std::string baseline; // compares against this results file when it exists
+	std::string save; // writes the results here
+	double tolerance; // slower than baseline by more than this share counts as a regression
+};
+
+// times the grid primitives and the simulation's per cell kernels in isolation, in ns per call. no window and no
+// outside benchmark library, each case runs in batches long enough for the clock and the fastest batch is kept
+class Microbench
+{
+	MicrobenchOptions options;
+public:
+	explicit Microbench(const MicrobenchOptions& options);
+	// 1 when a case regressed against the baseline
+	int run();
+};
@@ -0,0 +1,315 @@
+﻿#include "perf_counters.h"
+
+#include <deque>
+#include <fstream>
+#include <mutex>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+namespace
+{
+	constexpr size_t EVENT_COUNT = PerfCounters::EVENTS;
+	constexpr size_t PHASE_COUNT = PerfCounters::PHASES;
+
+	struct ThreadCounters
+	{
+		std::array<int, EVENT_COUNT> fds; // -1 once the thread detached
+		std::array<bool, EVENT_COUNT> opened{};
+		// hardware events are opened as one group under its first member, so a phase reads them in one go
+		int group = -1;
+		std::vector<PerfEvent> group_events;
+		std::array<bool, EVENT_COUNT> grouped{};
+		// scaled totals at the time the thread detached
+		PerfCounters::Values closed;
+		// only the owning thread adds to these
+		std::array<std::array<std::atomic<int64_t>, EVENT_COUNT>, PHASE_COUNT> phases{};
+	};
+
+	// raw counts, -1 for events the thread has no counter for. enabled and running are the group's times in ns,
+	// running falls behind enabled while the group is multiplexed
+	struct Reading
+	{
+		PerfCounters::Values values;
+		uint64_t enabled = 0;
+		uint64_t running = 0;
+	};
+
+	std::mutex threads_mutex;
+	std::deque<ThreadCounters> threads; // never shrinks, threads keep a pointer to their entry
+	thread_local ThreadCounters* local_counters = nullptr;
+
+#if defined(__linux__)
+	int open_counter(uint32_t type, uint64_t config, int group, bool leader)
+	{
+		perf_event_attr attr{};
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		if (leader)
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// calling thread on any cpu
+		return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+	}
+
+	void open_hardware(ThreadCounters& counters, PerfEvent event, uint32_t type, uint64_t config)
+	{
+		const int fd = open_counter(type, config, counters.group, counters.group < 0);
+		counters.fds[static_cast<size_t>(event)] = fd;
+		if (fd < 0) return;
+		if (counters.group < 0)
+			counters.group = fd;
+		counters.group_events.push_back(event);
+		counters.grouped[static_cast<size_t>(event)] = true;
+	}
+#endif
+
+	// fallback when no per thread counter could be opened
+	int64_t process_page_faults()
+	{
+#if defined(__linux__)
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_minflt + usage.ru_majflt;
+#elif defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS counters{};
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return counters.PageFaultCount;
+		return -1;
+#else
+		return -1;
+#endif
+	}
+
+	std::atomic<bool> multiplexed = false;
+
+	// a hardware count over a stretch its group was enabled for but only counted part of, extrapolated to all of it
+	int64_t scale(int64_t count, uint64_t enabled, uint64_t running)
+	{
+		if (running >= enabled) return count;
+		// never got on the pmu, nothing to extrapolate from
+		if (running == 0) return -1;
+		multiplexed.store(true, std::memory_order_relaxed);
+		return static_cast<int64_t>(static_cast<double>(count) * static_cast<double>(enabled) / static_cast<double>(running));
+	}
+
+	Reading read_thread(const ThreadCounters& counters)
+	{
+		Reading reading;
+		reading.values.fill(-1);
+#if defined(__linux__)
+		if (counters.group >= 0)
+		{
+			// nr, time enabled, time running, then one value per member in the order they were opened
+			std::array<uint64_t, EVENT_COUNT + 3> group{};
+			if (read(counters.group, group.data(), sizeof(group)) > 0)
+			{
+				reading.enabled = group[1];
+				reading.running = group[2];
+				for (size_t i = 0; i < counters.group_events.size() && i < group[0]; i++)
+					reading.values[static_cast<size_t>(counters.group_events[i])] = static_cast<int64_t>(group[i + 3]);
+			}
+		}
+		const size_t faults = static_cast<size_t>(PerfEvent::PAGE_FAULTS);
+		uint64_t value;
+		if (counters.fds[faults] >= 0 && read(counters.fds[faults], &value, sizeof(value)) == sizeof(value))
+			reading.values[faults] = static_cast<int64_t>(value);
+#endif
+		return reading;
+	}
+
+	// what the thread counted over its whole life, the kept totals once it detached
+	PerfCounters::Values thread_totals(const ThreadCounters& counters)
+	{
+		const Reading reading = read_thread(counters);
+		PerfCounters::Values values = counters.closed;
+		for (size_t e = 0; e < EVENT_COUNT; e++)
+		{
+			if (counters.fds[e] >= 0 && reading.values[e] >= 0)
+				values[e] = counters.grouped[e] ? scale(reading.values[e], reading.enabled, reading.running) : reading.values[e];
+		}
+		return values;
+	}
+}
+
+PerfCounters::Phase::Phase(PerfPhase phase) : phase(phase), active(is_counting_phases() && local_counters)
+{
+	if (!active) return;
+	const Reading reading = read_thread(*local_counters);
+	start = reading.values;
+	start_enabled = reading.enabled;
+	start_running = reading.running;
+}
+
+PerfCounters::Phase::~Phase()
+{
+	if (!active || !local_counters) return;
+	const Reading end = read_thread(*local_counters);
+	auto& totals = local_counters->phases[static_cast<size_t>(phase)];
+	for (size_t e = 0; e < EVENT_COUNT; e++)
+	{
+		if (start[e] < 0 || end.values[e] < 0) continue;
+		// the group's share of the phase on the pmu, not of its whole life
+		const int64_t count = local_counters->grouped[e]
+			? scale(end.values[e] - start[e], end.enabled - start_enabled, end.running - start_running)
+			: end.values[e] - start[e];
+		if (count >= 0)
+			totals[e].fetch_add(count, std::memory_order_relaxed);
+	}
+}
+
+void PerfCounters::attach_thread()
+{
+	// closes the counters when the thread exits, pool threads have no hook of their own for that
+	struct Detach
+	{
+		~Detach() { PerfCounters::detach_thread(); }
+	};
+	thread_local const Detach detach_at_exit;
+
+	std::lock_guard lock(threads_mutex);
+	ThreadCounters& counters = threads.emplace_back();
+	counters.fds.fill(-1);
+	counters.closed.fill(-1);
+#if defined(__linux__)
+	counters.fds[static_cast<size_t>(PerfEvent::PAGE_FAULTS)] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1, false);
+	open_hardware(counters, PerfEvent::CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	open_hardware(counters, PerfEvent::INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	open_hardware(counters, PerfEvent::CACHE_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	open_hardware(counters, PerfEvent::BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	open_hardware(counters, PerfEvent::DTLB_MISSES, PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+	for (size_t e = 0; e < EVENT_COUNT; e++)
+		counters.opened[e] = counters.fds[e] >= 0;
+	local_counters = &counters;
+}
+
+bool PerfCounters::was_multiplexed()
+{
+	return multiplexed.load(std::memory_order_relaxed);
+}
+
+void PerfCounters::detach_thread()
+{
+	if (!local_counters) return;
+	std::lock_guard lock(threads_mutex);
+	ThreadCounters& counters = *local_counters;
+	counters.closed = thread_totals(counters);
+#if defined(__linux__)
+	for (int& fd : counters.fds)
+	{
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+#endif
+	counters.group = -1;
+	local_counters = nullptr;
+}
+
+int64_t PerfCounters::read_total(PerfEvent event)
+{
+	const auto e = static_cast<size_t>(event);
+	int64_t total = 0;
+	bool any = false;
+	{
+		std::lock_guard lock(threads_mutex);
+		for (const ThreadCounters& counters : threads)
+		{
+			const int64_t value = thread_totals(counters)[e];
+			if (value >= 0)
+			{
+				total += value;
+				any = true;
+			}
+		}
+	}
+	if (any) return total;
+	if (event == PerfEvent::PAGE_FAULTS) return process_page_faults();
+	return -1;
+}
+
+std::vector<std::array<PerfCounters::Values, PerfCounters::PHASES>> PerfCounters::read_phases()
+{
+	std::lock_guard lock(threads_mutex);
+	std::vector<std::array<Values, PHASES>> result(threads.size());
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		for (size_t p = 0; p < PHASE_COUNT; p++)
+		{
+			for (size_t e = 0; e < EVENT_COUNT; e++)
+			{
+				// events the thread couldn't open stay -1
+				result[t][p][e] = threads[t].opened[e] ? threads[t].phases[p][e].load(std::memory_order_relaxed) : -1;
+			}
+		}
+	}
+	return result;
+}
+
+int64_t PerfCounters::resident_bytes()
+{
+#if defined(__linux__)
+	// second field is the resident page count
+	std::ifstream statm("/proc/self/statm");
+	int64_t size = 0, resident = 0;
+	if (statm >> size >> resident)
+		return resident * sysconf(_SC_PAGESIZE);
+	return -1;
+#elif defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters{};
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return static_cast<int64_t>(counters.WorkingSetSize);
+	return -1;
+#else
+	return -1;
+#endif
+}
+
+const char* PerfCounters::name(PerfEvent event)
+{
+	switch (event)
+	{
+	case PerfEvent::PAGE_FAULTS:
+		return "page faults";
+	case PerfEvent::DTLB_MISSES:
+		return "dTLB misses";
+	case PerfEvent::CYCLES:
+		return "cycles";
+	case PerfEvent::INSTRUCTIONS:
+		return "instructions";
+	case PerfEvent::CACHE_MISSES:
+		return "cache misses";
+	case PerfEvent::BRANCH_MISSES:
+		return "branch misses";
+	default:
+		return "unknown";
+	}
+}
+
+const char* PerfCounters::name(PerfPhase phase)
+{
+	switch (phase)
+	{
+	case PerfPhase::BOTTOM_UP:
+		return "bottom up";
+	case PerfPhase::TOP_DOWN:
+		return "top down";
+	case PerfPhase::RENDER:
+		return "render";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,77 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// low level counters for the benchmark. on linux every thread that calls attach_thread gets its own
+// perf_event_open counters, elsewhere only what the os reports for the whole process is available. when there are
+// more hardware events than pmu registers the kernel takes turns with them, counts are then scaled up by the time
+// the group was enabled over the time it actually counted, and was_multiplexed says so
+enum class PerfEvent
+{
+	PAGE_FAULTS,
+	DTLB_MISSES,
+	CYCLES,
+	INSTRUCTIONS,
+	CACHE_MISSES,
+	BRANCH_MISSES,
+	COUNT
+};
+
+// stretches of work the counters are split by, see PerfCounters::Phase
+enum class PerfPhase
+{
+	BOTTOM_UP, // iterate_bottom_to_top, everything that falls plus the reactions that run along with it
+	TOP_DOWN, // iterate_top_to_bottom, smoke and fire
+	RENDER, // update_texture_via_grid
+	COUNT
+};
+
+class PerfCounters
+{
+public:
+	static constexpr size_t EVENTS = static_cast<size_t>(PerfEvent::COUNT);
+	static constexpr size_t PHASES = static_cast<size_t>(PerfPhase::COUNT);
+	using Values = std::array<int64_t, EVENTS>; // -1 for events the thread can't count
+
+	// what the calling thread's counters move until it goes out of scope is charged to phase. does nothing unless
+	// phase counting is on and the thread is attached, so it can stay around hot loops
+	class Phase
+	{
+		PerfPhase phase;
+		bool active;
+		Values start;
+		uint64_t start_enabled = 0;
+		uint64_t start_running = 0;
+	public:
+		explicit Phase(PerfPhase phase);
+		~Phase();
+		Phase(const Phase&) = delete;
+		Phase& operator=(const Phase&) = delete;
+	};
+
+	// call on every thread that should be counted, e.g. from the thread pool's init task. the thread detaches by itself
+	// when it exits
+	static void attach_thread();
+	// closes the calling thread's counters, what they counted so far stays in read_total and read_phases
+	static void detach_thread();
+	// true once a count had to be scaled because the hardware group was off the pmu part of the time
+	static bool was_multiplexed();
+	// running total over all attached threads (or the process), diff two reads. -1 if the event can't be counted here
+	static int64_t read_total(PerfEvent event);
+	static const char* name(PerfEvent event);
+	static const char* name(PerfPhase phase);
+	// resident set of the whole process in bytes, -1 if the os can't tell
+	static int64_t resident_bytes();
+
+	// phases are only counted while this is on, every Phase costs a couple of syscalls
+	static void set_phase_counting(bool enabled) { counting.store(enabled, std::memory_order_relaxed); }
+	static bool is_counting_phases() { return counting.load(std::memory_order_relaxed); }
+	// per attached thread in attach order, what each phase added up to so far. read between ticks
+	static std::vector<std::array<Values, PHASES>> read_phases();
+
+private:
+	inline static std::atomic<bool> counting = false;
+};
@@ -0,0 +1,272 @@
+﻿#include "perf_overlay.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "ring_profiler.h"
+#include "simulation.h"
+
+namespace
+{
+	constexpr const char* MATERIAL_NAMES[PARTICLE_TYPES] =
+	{
+		"sand", "water", "stone", "wood", "smoke", "fire", "salt", "acid", "gasoline", "virus", "poison", "empty",
+	};
+	constexpr int64_t COUNT_INTERVAL = 250'000'000; // ns between particle counts, they walk every chunk
+	constexpr float SMOOTHING = 0.1f;
+	constexpr int TEXT_SCALE = 2;
+	constexpr int LINE_HEIGHT = 9 * TEXT_SCALE;
+	constexpr int PANEL_PADDING = 6;
+
+	struct Glyph
+	{
+		char c;
+		uint8_t rows[7]; // top to bottom, bit 4 is the leftmost column
+	};
+
+	constexpr Glyph GLYPHS[] =
+	{
+		{ '0', { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E } },
+		{ '1', { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+		{ '2', { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F } },
+		{ '3', { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E } },
+		{ '4', { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 } },
+		{ '5', { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E } },
+		{ '6', { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E } },
+		{ '7', { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+		{ '8', { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E } },
+		{ '9', { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C } },
+		{ 'A', { 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 } },
+		{ 'B', { 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E } },
+		{ 'C', { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E } },
+		{ 'D', { 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C } },
+		{ 'E', { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F } },
+		{ 'F', { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 } },
+		{ 'G', { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F } },
+		{ 'H', { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 } },
+		{ 'I', { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+		{ 'J', { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C } },
+		{ 'K', { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 } },
+		{ 'L', { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F } },
+		{ 'M', { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 } },
+		{ 'N', { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 } },
+		{ 'O', { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E } },
+		{ 'P', { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 } },
+		{ 'Q', { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D } },
+		{ 'R', { 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 } },
+		{ 'S', { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E } },
+		{ 'T', { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 } },
+		{ 'U', { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E } },
+		{ 'V', { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 } },
+		{ 'W', { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A } },
+		{ 'X', { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 } },
+		{ 'Y', { 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04, 0x04 } },
+		{ 'Z', { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F } },
+		{ '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C } },
+		{ ':', { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 } },
+		{ '/', { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 } },
+		{ '-', { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 } },
+		{ '%', { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 } },
+	};
+
+	const Glyph* find_glyph(char c)
+	{
+		if (c >= 'a' && c <= 'z')
+			c = static_cast<char>(c - 'a' + 'A');
+		for (const Glyph& glyph : GLYPHS)
+		{
+			if (glyph.c == c) return &glyph;
+		}
+		return nullptr;
+	}
+
+	uint32_t blend(uint32_t a, uint32_t b)
+	{
+		return ((a & 0xFEFEFE) >> 1) + ((b & 0xFEFEFE) >> 1);
+	}
+
+	// blue when cold, through green, to red at the hottest chunk
+	uint32_t heat_color(float t)
+	{
+		const auto r = static_cast<uint32_t>(std::clamp(2.f * t - 1.f, 0.f, 1.f) * 255.f);
+		const auto g = static_cast<uint32_t>((1.f - std::abs(2.f * t - 1.f)) * 255.f);
+		const auto b = static_cast<uint32_t>(std::clamp(1.f - 2.f * t, 0.f, 1.f) * 255.f);
+		return r << 16 | g << 8 | b;
+	}
+
+	std::string fixed(double value, int precision)
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(precision) << value;
+		return out.str();
+	}
+}
+
+void PerfOverlay::toggle(Simulation& simulation)
+{
+	visible = !visible;
+	simulation.set_cost_tracking(visible);
+	// stale costs from the last time it was open would show up as one hot frame
+	heat.clear();
+	last_count = 0;
+}
+
+void PerfOverlay::end_frame()
+{
+	const int64_t now = RingProfiler::now();
+	if (last_frame != 0)
+		frame_ms += ((now - last_frame) / 1e6 - frame_ms) * SMOOTHING;
+	last_frame = now;
+}
+
+void PerfOverlay::record_ticks(double ms)
+{
+	tick_ms += (ms - tick_ms) * SMOOTHING;
+}
+
+void PerfOverlay::update_heat(Simulation& simulation, const Grid& grid)
+{
+	std::atomic<uint64_t>* costs = simulation.get_chunk_costs();
+	if (!costs) return;
+	heat.resize(grid.get_chunk_count(), 0.f);
+	for (size_t i = 0; i < heat.size(); i++)
+	{
+		const auto cost = static_cast<float>(costs[i].exchange(0, std::memory_order_relaxed));
+		heat[i] += (cost - heat[i]) * SMOOTHING;
+	}
+}
+
+void PerfOverlay::count_particles(BS::thread_pool& pool, const Grid& grid)
+{
+	const size_t chunk_count = grid.get_chunk_count();
+	std::vector<std::array<uint32_t, PARTICLE_TYPES>> per_chunk(chunk_count);
+	const BS::multi_future<void> count_future = pool.submit_loop<size_t>(0, chunk_count,
+		[&](const size_t i)
+		{
+			per_chunk[i].fill(0);
+			const Chunk* chunk = grid.get_chunk(static_cast<int>(i % grid.get_chunks_x()), static_cast<int>(i / grid.get_chunks_x()));
+			if (!chunk) return;
+			for (const Particle& p : chunk->cells)
+				per_chunk[i][std::countr_zero(static_cast<uint32_t>(p.type))]++;
+		});
+	count_future.wait();
+
+	counts.fill(0);
+	for (const auto& chunk : per_chunk)
+	{
+		for (int t = 0; t < PARTICLE_TYPES; t++)
+			counts[t] += chunk[t];
+	}
+}
+
+void PerfOverlay::draw(BS::thread_pool& pool, const CanvasInfo& canvas, Simulation& simulation, const Grid& grid, const Camera& camera)
+{
+	if (!visible) return;
+	update_heat(simulation, grid);
+	const int64_t now = RingProfiler::now();
+	if (now - last_count >= COUNT_INTERVAL)
+	{
+		count_particles(pool, grid);
+		last_count = now;
+	}
+	draw_heatmap(pool, canvas, grid, camera);
+	draw_panel(canvas, grid);
+}
+
+void PerfOverlay::draw_heatmap(BS::thread_pool& pool, const CanvasInfo& canvas, const Grid& grid, const Camera& camera) const
+{
+	if (heat.size() != grid.get_chunk_count()) return;
+	const float hottest = std::max(*std::max_element(heat.begin(), heat.end()), 1.f);
+	const CellRect visible_cells = camera.visible_cells();
+	if (visible_cells.width() <= 0 || visible_cells.height() <= 0) return;
+	const int cx0 = visible_cells.x0 >> CHUNK_SHIFT;
+	const int cx1 = (visible_cells.x1 + CHUNK_MASK) >> CHUNK_SHIFT;
+	const int cy0 = visible_cells.y0 >> CHUNK_SHIFT;
+	const int cy1 = (visible_cells.y1 + CHUNK_MASK) >> CHUNK_SHIFT;
+
+	// chunk rows cover separate pixel rows, so each can be tinted on its own
+	const BS::multi_future<void> tint_future = pool.submit_loop<int>(cy0, cy1,
+		[&](const int cy)
+		{
+			for (int cx = cx0; cx < cx1; cx++)
+			{
+				if (!grid.get_chunk(cx, cy)) continue;
+				const float h = heat[cy * grid.get_chunks_x() + cx];
+				// holds particles but wasn't ticked, e.g. outside the focus between background ticks
+				const uint32_t tint = h < hottest * 0.01f ? 0x606060 : heat_color(h / hottest);
+				const XMFLOAT2 top_left = camera.world_to_screen(static_cast<float>(cx << CHUNK_SHIFT), static_cast<float>(cy << CHUNK_SHIFT));
+				const XMFLOAT2 bottom_right = camera.world_to_screen(static_cast<float>((cx + 1) << CHUNK_SHIFT), static_cast<float>((cy + 1) << CHUNK_SHIFT));
+				fill_rect(canvas, static_cast<int>(std::ceil(top_left.x)), static_cast<int>(std::ceil(top_left.y)),
+					static_cast<int>(std::ceil(bottom_right.x)), static_cast<int>(std::ceil(bottom_right.y)), tint, true);
+			}
+		});
+	tint_future.wait();
+}
+
+void PerfOverlay::draw_panel(const CanvasInfo& canvas, const Grid& grid) const
+{
+	std::vector<std::pair<std::string, uint32_t>> lines;
+	lines.push_back({ "frame " + fixed(frame_ms, 1) + " ms  " + fixed(frame_ms > 0. ? 1000. / frame_ms : 0., 0) + " fps", 0xFFFFFF });
+	lines.push_back({ "ticks " + fixed(tick_ms, 1) + " ms", 0xFFFFFF });
+	lines.push_back({ "chunks " + std::to_string(grid.get_allocated_chunks()) + " / " + std::to_string(grid.get_chunk_count()), 0xFFFFFF });
+	for (int t = 0; t + 1 < PARTICLE_TYPES; t++)
+	{
+		if (counts[t] > 0)
+			lines.push_back({ std::string(MATERIAL_NAMES[t]) + " " + std::to_string(counts[t]), ParticleUtils::colors.at(static_cast<Particle::Type>(1 << t)).hex() });
+	}
+
+	size_t longest = 0;
+	for (const auto& line : lines)
+		longest = std::max(longest, line.first.size());
+	const int width = static_cast<int>(longest) * 6 * TEXT_SCALE + 2 * PANEL_PADDING;
+	const int height = static_cast<int>(lines.size()) * LINE_HEIGHT + 2 * PANEL_PADDING;
+	fill_rect(canvas, 0, 0, width, height, 0x000000, true);
+
+	int y = PANEL_PADDING;
+	for (const auto& [text, color] : lines)
+	{
+		draw_text(canvas, PANEL_PADDING, y, text, color, TEXT_SCALE);
+		y += LINE_HEIGHT;
+	}
+}
+
+void PerfOverlay::draw_text(const CanvasInfo& canvas, int x, int y, const std::string& text, uint32_t color, int scale)
+{
+	for (const char c : text)
+	{
+		if (const Glyph* glyph = find_glyph(c))
+		{
+			for (int row = 0; row < 7; row++)
+			{
+				for (int column = 0; column < 5; column++)
+				{
+					if (glyph->rows[row] & (0x10 >> column))
+						fill_rect(canvas, x + column * scale, y + row * scale, x + (column + 1) * scale, y + (row + 1) * scale, color, false);
+				}
+			}
+		}
+		x += 6 * scale;
+	}
+}
+
+void PerfOverlay::fill_rect(const CanvasInfo& canvas, int x0, int y0, int x1, int y1, uint32_t color, bool blend_color)
+{
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1, canvas.width);
+	y1 = std::min(y1, canvas.height);
+	for (int y = y0; y < y1; y++)
+	{
+		uint32_t* row = canvas.pixelData + y * canvas.width;
+		if (!blend_color)
+		{
+			SDL_Util::fill_span(row + x0, x1 - x0, color);
+			continue;
+		}
+		for (int x = x0; x < x1; x++)
+			row[x] = blend(row[x], color);
+	}
+}
@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+#include "camera.h"
+#include "grid.h"
+#include "sdl_util.h"
+
+class Simulation;
+
+// toggleable stats panel and per chunk heatmap drawn over the world. chunks are tinted from blue to red by how long
+// they took to tick since the last frame, chunks that hold particles but weren't ticked show up grey
+class PerfOverlay
+{
+	bool visible = false;
+	double frame_ms = 0.;
+	double tick_ms = 0.;
+	int64_t last_frame = 0;
+
+	std::vector<float> heat; // smoothed cost per chunk
+	std::array<size_t, PARTICLE_TYPES> counts{};
+	int64_t last_count = 0;
+
+	void update_heat(Simulation& simulation, const Grid& grid);
+	void count_particles(BS::thread_pool& pool, const Grid& grid);
+	void draw_heatmap(BS::thread_pool& pool, const CanvasInfo& canvas, const Grid& grid, const Camera& camera) const;
+	void draw_panel(const CanvasInfo& canvas, const Grid& grid) const;
+	// 5x7 glyphs scaled by scale, lowercase is drawn as uppercase
+	static void draw_text(const CanvasInfo& canvas, int x, int y, const std::string& text, uint32_t color, int scale);
+	static void fill_rect(const CanvasInfo& canvas, int x0, int y0, int x1, int y1, uint32_t color, bool blend);
+public:
+	void toggle(Simulation& simulation);
+	bool is_visible() const { return visible; }
+
+	// once per frame, the frame is the time since the last call
+	void end_frame();
+	// how long the ticks of this frame took together
+	void record_ticks(double ms);
+
+	// after the world is drawn into the locked texture
+	void draw(BS::thread_pool& pool, const CanvasInfo& canvas, Simulation& simulation, const Grid& grid, const Camera& camera);
+};
@@ -0,0 +1,82 @@
+﻿#include "profiling.h"
+
+#include <algorithm>
+#include <deque>
+#include <string>
+
+namespace
+{
+	// tracy and the ring profiler keep the name pointer, so every series needs a name that lives as long as the program
+	constexpr const char* MATERIAL_PLOTS[PARTICLE_TYPES] =
+	{
+		"sand ms", "water ms", "stone ms", "wood ms", "smoke ms", "fire ms",
+		"salt ms", "acid ms", "gasoline ms", "virus ms", "poison ms", "empty ms",
+	};
+	// only ever grows, a name handed out once must stay put
+	std::deque<std::string> idle_plots;
+}
+
+std::array<Profiling::Counters, Profiling::MAX_WORKERS + 1> Profiling::counters;
+size_t Profiling::workers = 0;
+Profiling::Counters Profiling::last;
+uint64_t Profiling::parallel = 0;
+uint64_t Profiling::tick_start = 0;
+std::chrono::steady_clock::time_point Profiling::tick_start_time;
+std::thread::id Profiling::tick_thread;
+
+void Profiling::begin_tick(size_t threads)
+{
+	assert(threads <= MAX_WORKERS);
+	workers = std::min(threads, MAX_WORKERS);
+	while (idle_plots.size() < workers)
+		idle_plots.push_back("worker " + std::to_string(idle_plots.size()) + " idle ms");
+	tick_thread = std::this_thread::get_id();
+	parallel = 0;
+	tick_start = timestamp();
+	tick_start_time = std::chrono::steady_clock::now();
+}
+
+void Profiling::end_tick(const Grid& grid)
+{
+	// timestamps are in whatever unit the counter ticks in, the tick itself tells how long one is
+	const double elapsed = static_cast<double>(timestamp() - tick_start);
+	const double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tick_start_time).count();
+	const double to_ms = elapsed > 0 ? elapsed_ms / elapsed : 0.;
+
+	Counters total;
+	for (const Counters& c : counters)
+	{
+		total.swaps += c.swaps;
+		total.sets += c.sets;
+		total.reactions += c.reactions;
+		for (int i = 0; i < PARTICLE_TYPES; i++)
+		{
+			total.material_cells[i] += c.material_cells[i];
+			total.material_time[i] += c.material_time[i];
+		}
+	}
+
+	int64_t active = 0;
+	for (int i = 0; i < PARTICLE_TYPES; i++)
+		active += static_cast<int64_t>(total.material_cells[i]);
+	PROFILE_PLOT("active particles", active);
+	PROFILE_PLOT("swaps", static_cast<int64_t>(total.swaps));
+	PROFILE_PLOT("sets", static_cast<int64_t>(total.sets));
+	PROFILE_PLOT("reactions", static_cast<int64_t>(total.reactions));
+	PROFILE_PLOT("allocated chunks", static_cast<int64_t>(grid.get_allocated_chunks()));
+	for (int i = 0; i < PARTICLE_TYPES; i++)
+	{
+		if (total.material_cells[i] > 0)
+			PROFILE_PLOT(MATERIAL_PLOTS[i], total.material_time[i] * to_ms);
+	}
+	// a worker that finished its strips early waits for the slowest one before the next phase starts
+	for (size_t i = 0; i < workers; i++)
+	{
+		const double idle = static_cast<double>(parallel) - static_cast<double>(counters[i].busy);
+		PROFILE_PLOT(idle_plots[i].c_str(), std::max(idle, 0.) * to_ms);
+	}
+
+	last = total;
+	for (Counters& c : counters)
+		c = Counters{};
+}
@@ -0,0 +1,141 @@
+﻿#pragma once
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <BS_thread_pool.hpp>
+#include <Tracy.hpp>
+
+#include "grid.h"
+#include "ring_profiler.h"
+#include "tick_workers.h"
+
+// instrumentation points of the simulation. PROFILING is on whenever tracy is and can be defined on its own, without
+// it every PROFILE_ macro compiles to nothing so release builds pay nothing for them
+#if defined(TRACY_ENABLE) && !defined(PROFILING)
+#define PROFILING
+#endif
+// zones and plots also go to the ring profiler, which is cheap enough to leave on in release unless NO_RING_PROFILER
+#ifndef NO_RING_PROFILER
+#define RING_PROFILER
+#endif
+
+// per tick counters filled in by the simulation and plotted once the tick is over. every pool thread or tick worker
+// writes the slot of its index, the one after them belongs to the thread running the ticks and no other thread may
+// count. the slots are fixed, so pools of any size can count between ticks too
+class Profiling
+{
+public:
+	struct alignas(64) Counters
+	{
+		uint64_t swaps = 0;
+		uint64_t sets = 0;
+		uint64_t reactions = 0; // particles a material turned into something else
+		uint64_t busy = 0; // timestamp ticks spent running strips
+		uint64_t material_cells[PARTICLE_TYPES] = {};
+		uint64_t material_time[PARTICLE_TYPES] = {}; // timestamp ticks spent on particles of each material
+	};
+	static constexpr size_t MAX_WORKERS = 256;
+
+	// charges the time until it goes out of scope to total
+	class Timer
+	{
+		uint64_t& total;
+		uint64_t start;
+	public:
+		explicit Timer(uint64_t& total) : total(total), start(timestamp()) {}
+		~Timer() { total += timestamp() - start; }
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+	};
+
+	// cheap enough to take around every particle, rdtsc where there is one. only differences mean anything,
+	// end_tick converts them to time against the wall clock
+	static uint64_t timestamp()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+
+	static Counters& local()
+	{
+		if (const std::optional<size_t> index = worker_index())
+		{
+			assert(*index < MAX_WORKERS);
+			return counters[*index];
+		}
+		// a thread outside the workers would share the slot with the tick thread, and its counts would race
+		assert(tick_thread == std::thread::id{} || tick_thread == std::this_thread::get_id());
+		return counters[MAX_WORKERS];
+	}
+	static int material_slot(Particle::Type type) { return std::countr_zero(static_cast<uint32_t>(type)); }
+	// main thread only, time the workers are handed strips for, the rest of it is their idle time
+	static uint64_t& parallel_time() { return parallel; }
+
+	// main thread, around every simulation tick
+	static void begin_tick(size_t threads);
+	static void end_tick(const Grid& grid);
+	// counters of every thread summed over the last tick end_tick saw
+	static const Counters& get_last_tick() { return last; }
+
+private:
+	static std::array<Counters, MAX_WORKERS + 1> counters;
+	static size_t workers; // threads of the last begin_tick
+	static Counters last;
+	static uint64_t parallel;
+	static uint64_t tick_start;
+	static std::chrono::steady_clock::time_point tick_start_time;
+	static std::thread::id tick_thread; // caller of begin_tick, none before the first tick
+};
+
+#ifdef RING_PROFILER
+#define PROFILE_RING_ZONE(name) const RingProfiler::Zone profile_ring_zone(name)
+#define PROFILE_RING_VALUE(name, amount) RingProfiler::value(name, static_cast<double>(amount))
+#else
+#define PROFILE_RING_ZONE(name)
+#define PROFILE_RING_VALUE(name, amount)
+#endif
+
+// name has to be a literal, tracy and the ring profiler both keep the pointer
+#define PROFILE_ZONE(name) ZoneScopedN(name); PROFILE_RING_ZONE(name)
+// zone named after the enclosing function
+#define PROFILE_FUNCTION() ZoneScoped; PROFILE_RING_ZONE(__FUNCTION__)
+#define PROFILE_PLOT(name, amount) do { TracyPlot(name, amount); PROFILE_RING_VALUE(name, amount); } while (0)
+
+#ifdef PROFILING
+#define PROFILE_COUNT(counter) (Profiling::local().counter++)
+// time of the rest of the scope goes to the material of a particle, the cell counts as active
+#define PROFILE_MATERIAL(type) \
+	Profiling::Counters& profile_counters = Profiling::local(); \
+	profile_counters.material_cells[Profiling::material_slot(type)]++; \
+	const Profiling::Timer profile_material_timer(profile_counters.material_time[Profiling::material_slot(type)])
+#define PROFILE_BUSY() const Profiling::Timer profile_busy_timer(Profiling::local().busy)
+#define PROFILE_PARALLEL() const Profiling::Timer profile_parallel_timer(Profiling::parallel_time())
+#define PROFILE_BEGIN_TICK(threads) Profiling::begin_tick(threads)
+#define PROFILE_END_TICK(grid) Profiling::end_tick(grid)
+#define PROFILE_ALLOC(pointer, size, pool) TracyAllocN(pointer, size, pool)
+#define PROFILE_FREE(pointer, pool) TracyFreeN(pointer, pool)
+#else
+#define PROFILE_COUNT(counter)
+#define PROFILE_MATERIAL(type)
+#define PROFILE_BUSY()
+#define PROFILE_PARALLEL()
+#define PROFILE_BEGIN_TICK(threads)
+#define PROFILE_END_TICK(grid)
+#define PROFILE_ALLOC(pointer, size, pool)
+#define PROFILE_FREE(pointer, pool)
+#endif
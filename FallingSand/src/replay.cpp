@@ -0,0 +1,403 @@
+﻿#include "replay.h"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include <zstd.h>
+
+#include "profiling.h"
+
+namespace
+{
+	constexpr int COMPRESSION_LEVEL = 1;
+	constexpr size_t DELTA_CELL_BYTES = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t);
+}
+
+bool Replay::read_size(const std::string& path, unsigned int& width, unsigned int& height)
+{
+	std::ifstream file(path, std::ios::binary);
+	Header header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION)
+	{
+		std::cerr << "Not a replay file: " << path << std::endl;
+		return false;
+	}
+	width = header.width;
+	height = header.height;
+	return true;
+}
+
+ReplayRecorder::ReplayRecorder(Grid& grid, BS::thread_pool& pool, uint32_t keyframe_interval) :
+	grid(grid), pool(pool), keyframe_interval(std::max(keyframe_interval, 1u))
+{
+}
+
+ReplayRecorder::~ReplayRecorder()
+{
+	stop();
+}
+
+bool ReplayRecorder::start(const std::string& replay_path, uint64_t tick)
+{
+	stop();
+	path = replay_path;
+	file.open(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		std::cerr << "Failed to open replay file for writing: " << path << std::endl;
+		return false;
+	}
+	Replay::Header header{};
+	std::memcpy(header.magic, Replay::MAGIC, sizeof(Replay::MAGIC));
+	header.version = Replay::VERSION;
+	header.width = grid.get_width();
+	header.height = grid.get_height();
+	header.chunk_size = CHUNK_SIZE;
+	header.keyframe_interval = keyframe_interval;
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	bytes_written = sizeof(header);
+
+	band_count = pool.get_thread_count() * 4;
+	grid.set_change_tracking(true);
+	stopping = false;
+	writer = std::thread(&ReplayRecorder::write_loop, this);
+	recording = true;
+	keyframe(tick);
+	return true;
+}
+
+void ReplayRecorder::push(Record record)
+{
+	{
+		std::lock_guard lock(mutex);
+		queue.push_back(std::move(record));
+	}
+	cv.notify_one();
+}
+
+void ReplayRecorder::keyframe(uint64_t tick)
+{
+	PROFILE_FUNCTION();
+	const int chunks_x = static_cast<int>(grid.get_chunks_x());
+	const size_t count = grid.get_chunk_count();
+	std::vector<std::vector<uint8_t>> payloads(count);
+	std::vector<Snapshot::IndexEntry> index(count);
+	const BS::multi_future<void> encode = pool.submit_loop<size_t>(0, count,
+		[&](const size_t i)
+		{
+			payloads[i] = Snapshot::encode_chunk(grid, static_cast<int>(i % chunks_x), static_cast<int>(i / chunks_x), &index[i].raw_size);
+		});
+	encode.wait();
+
+	uint64_t offset = count * sizeof(Snapshot::IndexEntry);
+	for (size_t i = 0; i < count; i++)
+	{
+		index[i].offset = offset;
+		index[i].compressed_size = static_cast<uint32_t>(payloads[i].size());
+		offset += payloads[i].size();
+	}
+	Record record{ { Replay::KEYFRAME, 0, tick, offset }, {} };
+	record.payload.reserve(offset);
+	record.payload.resize(count * sizeof(Snapshot::IndexEntry));
+	std::memcpy(record.payload.data(), index.data(), record.payload.size());
+	for (const auto& payload : payloads)
+		record.payload.insert(record.payload.end(), payload.begin(), payload.end());
+	push(std::move(record));
+
+	// everything changed so far is part of the keyframe
+	std::atomic<uint64_t>* rows = grid.get_changed_rows();
+	for (size_t i = 0; i < grid.get_changed_row_count(); i++)
+		rows[i].store(0, std::memory_order_relaxed);
+	last_keyframe = tick;
+}
+
+void ReplayRecorder::capture(uint64_t tick)
+{
+	if (!recording) return;
+	PROFILE_FUNCTION();
+	if (tick - last_keyframe >= keyframe_interval)
+	{
+		keyframe(tick);
+		return;
+	}
+
+	// a cell is usually touched several times per tick, its bit is set once and only the final state is read back
+	std::atomic<uint64_t>* rows = grid.get_changed_rows();
+	const unsigned int width = grid.get_width();
+	const unsigned int height = grid.get_height();
+	const unsigned int band_rows = (height + static_cast<unsigned int>(band_count) - 1) / static_cast<unsigned int>(band_count);
+	Record record{ { Replay::DELTA, 0, tick, 0 }, {}, {} };
+	{
+		std::lock_guard lock(mutex);
+		if (!spare_bands.empty())
+		{
+			record.bands = std::move(spare_bands.back());
+			spare_bands.pop_back();
+		}
+	}
+	record.bands.resize(band_count);
+
+	// bands are runs of world rows, walked left to right chunk by chunk, so their cells come out in index order.
+	// every band keeps its own buffer, which saves counting the bits in a pass of its own before gathering
+	const BS::multi_future<void> gather = pool.submit_loop<size_t>(0, band_count,
+		[&](const size_t b)
+		{
+			std::vector<DeltaCell>& out = record.bands[b];
+			out.clear();
+			const unsigned int end = std::min(height, static_cast<unsigned int>(b + 1) * band_rows);
+			for (unsigned int y = static_cast<unsigned int>(b) * band_rows; y < end; y++)
+			{
+				for (unsigned int x0 = 0; x0 < width; x0 += CHUNK_SIZE)
+				{
+					std::atomic<uint64_t>& row = rows[grid.changed_row(static_cast<int>(x0), static_cast<int>(y))];
+					if (!row.load(std::memory_order_relaxed)) continue;
+					const Chunk* chunk = grid.get_chunk(static_cast<int>(x0 >> CHUNK_SHIFT), static_cast<int>(y >> CHUNK_SHIFT));
+					for (uint64_t bits = row.exchange(0, std::memory_order_relaxed); bits; bits &= bits - 1)
+					{
+						const auto dx = static_cast<uint32_t>(std::countr_zero(bits));
+						// the null chunk is all empty
+						const Particle& particle = chunk ? chunk->cells[(y & CHUNK_MASK) * CHUNK_SIZE + dx] : Particle{};
+						out.push_back({ y * width + x0 + dx, particle.color.hex(), static_cast<uint16_t>(particle.type) });
+					}
+				}
+			}
+		});
+	gather.wait();
+	push(std::move(record));
+}
+
+void ReplayRecorder::write_loop()
+{
+	std::vector<uint8_t> packed, compressed;
+	while (true)
+	{
+		Record record;
+		{
+			std::unique_lock lock(mutex);
+			cv.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty()) return;
+			record = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		const uint8_t* data = record.payload.data();
+		if (record.header.kind == Replay::DELTA)
+		{
+			PROFILE_ZONE("compress delta");
+			uint32_t count = 0;
+			for (const auto& band : record.bands)
+				count += static_cast<uint32_t>(band.size());
+			packed.resize(sizeof(count) + count * DELTA_CELL_BYTES);
+			std::memcpy(packed.data(), &count, sizeof(count));
+			auto* indices = reinterpret_cast<uint32_t*>(packed.data() + sizeof(count));
+			auto* colors = indices + count;
+			auto* types = reinterpret_cast<uint16_t*>(colors + count);
+			// sorted indices become small gaps, which compress far better
+			uint32_t n = 0, previous = 0;
+			for (const auto& band : record.bands)
+			{
+				for (const DeltaCell& cell : band)
+				{
+					indices[n] = cell.index - previous;
+					colors[n] = cell.color;
+					types[n] = cell.type;
+					previous = cell.index;
+					n++;
+				}
+			}
+			{
+				std::lock_guard lock(mutex);
+				spare_bands.push_back(std::move(record.bands));
+			}
+			compressed.resize(ZSTD_compressBound(packed.size()));
+			const size_t size = ZSTD_compress(compressed.data(), compressed.size(), packed.data(), packed.size(), COMPRESSION_LEVEL);
+			if (ZSTD_isError(size))
+			{
+				std::cerr << "Failed to compress replay delta: " << ZSTD_getErrorName(size) << std::endl;
+				continue;
+			}
+			record.header.raw_size = static_cast<uint32_t>(packed.size());
+			record.header.size = size;
+			data = compressed.data();
+		}
+		file.write(reinterpret_cast<const char*>(&record.header), sizeof(record.header));
+		file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(record.header.size));
+		bytes_written += sizeof(record.header) + record.header.size;
+	}
+}
+
+void ReplayRecorder::stop()
+{
+	if (!recording) return;
+	recording = false;
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	cv.notify_one();
+	writer.join();
+	grid.set_change_tracking(false);
+	file.close();
+	if (!file)
+		std::cerr << "Failed to write replay file: " << path << std::endl;
+	else
+		std::cout << "Recorded " << path << " (" << bytes_written / 1024 << " KiB)" << std::endl;
+}
+
+ReplayPlayer::ReplayPlayer(Grid& grid) : grid(grid)
+{
+	for (const auto& [type, color] : ParticleUtils::colors)
+		prototypes[std::countr_zero(static_cast<uint32_t>(type))] = Grid::create_particle(type, false);
+}
+
+bool ReplayPlayer::open(const std::string& path)
+{
+	records.clear();
+	next = 0;
+	if (!file.map(path) || file.size() < sizeof(Replay::Header))
+	{
+		std::cerr << "Failed to open replay file: " << path << std::endl;
+		return false;
+	}
+	Replay::Header header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (std::memcmp(header.magic, Replay::MAGIC, sizeof(Replay::MAGIC)) != 0 || header.version != Replay::VERSION)
+	{
+		std::cerr << "Not a replay file: " << path << std::endl;
+		return false;
+	}
+	if (header.width != grid.get_width() || header.height != grid.get_height() || header.chunk_size != CHUNK_SIZE)
+	{
+		std::cerr << "Replay is " << header.width << "x" << header.height << " but the world is "
+			<< grid.get_width() << "x" << grid.get_height() << std::endl;
+		return false;
+	}
+
+	uint64_t at = sizeof(Replay::Header);
+	while (at + sizeof(Replay::RecordHeader) <= file.size())
+	{
+		Replay::RecordHeader record;
+		std::memcpy(&record, file.data() + at, sizeof(record));
+		at += sizeof(record);
+		// a recording cut short keeps everything up to the last whole record
+		if (record.size > file.size() - at) break;
+		records.push_back({ record.kind, record.raw_size, record.tick, at, record.size });
+		at += record.size;
+	}
+	if (records.empty() || records.front().kind != Replay::KEYFRAME)
+	{
+		std::cerr << "Replay does not start with a keyframe: " << path << std::endl;
+		records.clear();
+		return false;
+	}
+	std::cout << "Opened " << path << ", ticks " << get_first_tick() << " to " << get_last_tick() << std::endl;
+	return true;
+}
+
+bool ReplayPlayer::apply(const Record& record, BS::thread_pool& pool)
+{
+	PROFILE_FUNCTION();
+	const uint8_t* payload = file.data() + record.offset;
+	if (record.kind == Replay::KEYFRAME)
+	{
+		const int chunks_x = static_cast<int>(grid.get_chunks_x());
+		const size_t count = grid.get_chunk_count();
+		if (record.size < count * sizeof(Snapshot::IndexEntry)) return false;
+		std::vector<Snapshot::IndexEntry> index(count);
+		std::memcpy(index.data(), payload, count * sizeof(Snapshot::IndexEntry));
+
+		std::atomic<bool> ok = true;
+		const BS::multi_future<void> decode = pool.submit_loop<size_t>(0, count,
+			[&](const size_t i)
+			{
+				const auto& entry = index[i];
+				if (entry.offset + entry.compressed_size > record.size
+					|| !Snapshot::decode_chunk(grid, static_cast<int>(i % chunks_x), static_cast<int>(i / chunks_x), payload + entry.offset, entry.compressed_size, entry.raw_size))
+					ok = false;
+			});
+		decode.wait();
+		return ok;
+	}
+
+	scratch.resize(record.raw_size);
+	const size_t size = ZSTD_decompress(scratch.data(), scratch.size(), payload, record.size);
+	uint32_t count;
+	if (ZSTD_isError(size) || size != record.raw_size || size < sizeof(count)) return false;
+	std::memcpy(&count, scratch.data(), sizeof(count));
+	if (size != sizeof(count) + count * DELTA_CELL_BYTES) return false;
+	auto* indices = reinterpret_cast<uint32_t*>(scratch.data() + sizeof(count));
+	const uint8_t* colors = scratch.data() + sizeof(count) + count * sizeof(uint32_t);
+	const uint8_t* types = colors + count * sizeof(uint32_t);
+
+	// undo the gaps, then cells are distinct and can be written from any thread
+	const uint64_t cells = static_cast<uint64_t>(grid.get_width()) * grid.get_height();
+	for (uint32_t n = 1; n < count; n++)
+		indices[n] += indices[n - 1];
+	if (count > 0 && indices[count - 1] >= cells) return false;
+
+	const unsigned int width = grid.get_width();
+	std::atomic<bool> ok = true;
+	const BS::multi_future<void> write = pool.submit_blocks<uint32_t>(0, count,
+		[&](const uint32_t first, const uint32_t last)
+		{
+			for (uint32_t n = first; n < last; n++)
+			{
+				uint16_t type;
+				uint32_t color;
+				std::memcpy(&type, types + n * sizeof(uint16_t), sizeof(type));
+				std::memcpy(&color, colors + n * sizeof(uint32_t), sizeof(color));
+				if (!std::has_single_bit(type) || type > Particle::EMPTY)
+				{
+					ok = false;
+					return;
+				}
+				Particle particle = prototypes[std::countr_zero(type)];
+				particle.color = color;
+				grid.put(static_cast<int>(indices[n] % width), static_cast<int>(indices[n] / width), particle);
+			}
+		});
+	write.wait();
+	return ok;
+}
+
+bool ReplayPlayer::seek(uint64_t tick, BS::thread_pool& pool)
+{
+	if (records.empty()) return false;
+	// last record at or before tick, and the keyframe it builds on
+	auto after = std::upper_bound(records.begin(), records.end(), tick, [](uint64_t t, const Record& r) { return t < r.tick; });
+	const size_t target = after == records.begin() ? 0 : static_cast<size_t>(after - records.begin()) - 1;
+	size_t keyframe = target;
+	while (records[keyframe].kind != Replay::KEYFRAME) keyframe--;
+
+	// playing forward from where we are is cheaper than restarting unless a keyframe sits in between
+	if (next <= keyframe || next > target + 1)
+	{
+		if (!apply(records[keyframe], pool))
+		{
+			std::cerr << "Corrupt replay keyframe at tick " << records[keyframe].tick << std::endl;
+			return false;
+		}
+		next = keyframe + 1;
+	}
+	while (next <= target)
+	{
+		if (!step(pool)) return false;
+	}
+	return true;
+}
+
+bool ReplayPlayer::step(BS::thread_pool& pool)
+{
+	if (at_end()) return false;
+	const Record& record = records[next++];
+	if (!apply(record, pool))
+	{
+		std::cerr << "Corrupt replay record at tick " << record.tick << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,149 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+#include "grid.h"
+#include "mapped_file.h"
+#include "snapshot.h"
+
+// replay file
+//   header    magic, version, world size, keyframe interval
+//   records   one per tick in order, a keyframe (whole world) or a delta (cells that changed during the tick)
+//   keyframe  snapshot chunk index with offsets relative to the record payload, followed by the chunk payloads
+//   delta     zstd compressed [count] [cell index gaps * count] [color * count] [type * count], cells in index order
+struct Replay
+{
+	static constexpr char MAGIC[4] = { 'F', 'S', 'R', 'P' };
+	static constexpr uint32_t VERSION = 1;
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t chunk_size;
+		uint32_t keyframe_interval;
+	};
+
+	enum RecordKind : uint32_t
+	{
+		KEYFRAME,
+		DELTA,
+	};
+
+	struct RecordHeader
+	{
+		RecordKind kind;
+		uint32_t raw_size; // decompressed delta size, unused for keyframes
+		uint64_t tick;
+		uint64_t size; // payload bytes after this header
+	};
+
+	// world size stored in a replay, so the grid can be created to match
+	static bool read_size(const std::string& path, unsigned int& width, unsigned int& height);
+};
+
+// captures the world once, then the cells every tick touched. the grid flags changed cells as the workers write them,
+// capture() runs between ticks and reads back the final state of flagged cells on the pool in a single pass, packing
+// the delta, compression and disk io happen on a writer thread
+class ReplayRecorder
+{
+	struct DeltaCell
+	{
+		uint32_t index;
+		uint32_t color;
+		uint16_t type;
+	};
+	using Bands = std::vector<std::vector<DeltaCell>>;
+
+	struct Record
+	{
+		Replay::RecordHeader header;
+		std::vector<uint8_t> payload; // finished keyframe, a delta is packed from bands by the writer
+		Bands bands; // delta only, changed cells of each band in index order
+	};
+
+	Grid& grid;
+	BS::thread_pool& pool;
+	uint32_t keyframe_interval;
+	uint64_t last_keyframe = 0;
+	bool recording = false;
+
+	// change flags are read back in bands of blocks, the writer hands the buffers back once it packed them
+	size_t band_count = 0;
+	std::vector<Bands> spare_bands;
+
+	std::ofstream file;
+	std::string path;
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Record> queue;
+	bool stopping = false;
+	uint64_t bytes_written = 0;
+
+	void write_loop();
+	void push(Record record);
+	void keyframe(uint64_t tick);
+public:
+	ReplayRecorder(Grid& grid, BS::thread_pool& pool, uint32_t keyframe_interval = 300);
+	~ReplayRecorder();
+	ReplayRecorder(const ReplayRecorder&) = delete;
+	ReplayRecorder& operator=(const ReplayRecorder&) = delete;
+
+	// writes a keyframe of the current world as tick and starts tracking changes
+	bool start(const std::string& path, uint64_t tick);
+	// call after every simulation tick, edits made between ticks land in the next one
+	void capture(uint64_t tick);
+	// flushes the queue and closes the file
+	void stop();
+	bool is_recording() const { return recording; }
+};
+
+// rebuilds any recorded tick from the keyframe before it plus the deltas after, without running the simulation
+class ReplayPlayer
+{
+	struct Record
+	{
+		Replay::RecordKind kind;
+		uint32_t raw_size;
+		uint64_t tick;
+		uint64_t offset; // payload
+		uint64_t size;
+	};
+
+	Grid& grid;
+	Particle prototypes[12]; // default particle per type, by bit index
+	MappedFile file;
+	std::vector<Record> records;
+	size_t next = 0; // record applied by the next step
+	std::vector<uint8_t> scratch;
+
+	bool apply(const Record& record, BS::thread_pool& pool);
+public:
+	explicit ReplayPlayer(Grid& grid);
+
+	// world size in the file has to match the grid
+	bool open(const std::string& path);
+	// jumps to tick, going back restarts from the closest earlier keyframe
+	bool seek(uint64_t tick, BS::thread_pool& pool);
+	// applies the next tick, false at the end of the recording
+	bool step(BS::thread_pool& pool);
+
+	uint64_t get_tick() const { return next == 0 ? get_first_tick() : records[next - 1].tick; }
+	uint64_t get_first_tick() const { return records.empty() ? 0 : records.front().tick; }
+	uint64_t get_last_tick() const { return records.empty() ? 0 : records.back().tick; }
+	bool at_end() const { return next >= records.size(); }
+};
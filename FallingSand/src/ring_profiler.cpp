@@ -0,0 +1,161 @@
+﻿#include "ring_profiler.h"
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+
+RingProfiler::Ring* RingProfiler::local()
+{
+	// hands the ring back when the thread exits, so a thread pool made again later reuses the same rings
+	struct Owner
+	{
+		Ring* ring = nullptr;
+		bool registered = false;
+		~Owner() { if (ring) ring->owned.store(false, std::memory_order_release); }
+	};
+	thread_local Owner owner;
+	if (owner.registered) return owner.ring;
+	owner.registered = true;
+
+	const size_t count = std::min(ring_count.load(std::memory_order_acquire), MAX_THREADS);
+	for (size_t i = 0; i < count; i++)
+	{
+		Ring* ring = rings[i].load(std::memory_order_acquire);
+		bool owned = false;
+		if (ring && ring->owned.compare_exchange_strong(owned, true, std::memory_order_acq_rel))
+			return owner.ring = ring;
+	}
+	const size_t index = ring_count.fetch_add(1, std::memory_order_acq_rel);
+	if (index >= MAX_THREADS) return nullptr;
+	owner.ring = new Ring{ .thread = index };
+	rings[index].store(owner.ring, std::memory_order_release);
+	return owner.ring;
+}
+
+void RingProfiler::push(Kind kind, const char* name, int64_t start, int64_t data)
+{
+	Ring* ring = local();
+	if (!ring) return;
+	const uint64_t head = ring->head.load(std::memory_order_relaxed);
+	Slot& slot = ring->slots[head % RING_SIZE];
+	slot.name.store(name, std::memory_order_relaxed);
+	slot.start.store(start, std::memory_order_relaxed);
+	slot.data.store(data, std::memory_order_relaxed);
+	slot.kind.store(kind, std::memory_order_relaxed);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void RingProfiler::zone(const char* name, int64_t start, int64_t end)
+{
+	push(ZONE, name, start, end);
+}
+
+void RingProfiler::value(const char* name, double value)
+{
+	push(VALUE, name, now(), std::bit_cast<int64_t>(value));
+}
+
+std::vector<RingProfiler::Event> RingProfiler::collect()
+{
+	const int64_t since = now() - window.load(std::memory_order_relaxed);
+	std::vector<Event> events;
+	const size_t count = std::min(ring_count.load(std::memory_order_acquire), MAX_THREADS);
+	for (size_t i = 0; i < count; i++)
+	{
+		const Ring* ring = rings[i].load(std::memory_order_acquire);
+		if (!ring) continue;
+		const uint64_t head = ring->head.load(std::memory_order_acquire);
+		const uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+		const size_t old_size = events.size();
+		for (uint64_t e = first; e < head; e++)
+		{
+			const Slot& slot = ring->slots[e % RING_SIZE];
+			events.push_back({ slot.name.load(std::memory_order_relaxed), slot.start.load(std::memory_order_relaxed),
+				slot.data.load(std::memory_order_relaxed), slot.kind.load(std::memory_order_relaxed), ring->thread });
+		}
+		// the owner kept writing while we copied, the slots it lapped hold newer events than their position says. the
+		// fence keeps the copies above ahead of this load, and the slot of event lapped may be half written right now
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const uint64_t lapped = ring->head.load(std::memory_order_relaxed);
+		const uint64_t valid_from = lapped + 1 > RING_SIZE ? lapped + 1 - RING_SIZE : 0;
+		const size_t drop = static_cast<size_t>(std::min(head - first, valid_from > first ? valid_from - first : 0));
+		events.erase(events.begin() + old_size, events.begin() + old_size + drop);
+	}
+	std::erase_if(events, [since](const Event& event) { return event.start < since; });
+	return events;
+}
+
+RingProfiler::Summary RingProfiler::summarize(const char* name)
+{
+	std::vector<double> durations;
+	for (const Event& event : collect())
+	{
+		// names are literals, but the same literal can live at different addresses in different translation units
+		if (event.kind == ZONE && (event.name == name || std::string_view(event.name) == name))
+			durations.push_back((event.data - event.start) / 1e6);
+	}
+	Summary summary;
+	summary.count = durations.size();
+	if (durations.empty()) return summary;
+	std::sort(durations.begin(), durations.end());
+	auto percentile = [&](double p) { return durations[std::min(static_cast<size_t>(p * durations.size()), durations.size() - 1)]; };
+	summary.p50 = percentile(0.5);
+	summary.p99 = percentile(0.99);
+	summary.max = durations.back();
+	return summary;
+}
+
+bool RingProfiler::dump(const std::string& path)
+{
+	const std::vector<Event> events = collect();
+	std::ofstream file(path, std::ios::trunc);
+	if (!file)
+	{
+		std::cerr << "Failed to open trace for writing: " << path << std::endl;
+		return false;
+	}
+
+	// chrome's trace event format, times in microseconds
+	file << "{\"traceEvents\":[\n";
+	bool first = true;
+	for (const Event& event : events)
+	{
+		if (!first) file << ",\n";
+		first = false;
+		file << "{\"name\":\"" << event.name << "\",\"pid\":0,\"tid\":" << event.thread << ",\"ts\":" << event.start / 1e3;
+		if (event.kind == ZONE)
+			file << ",\"ph\":\"X\",\"dur\":" << (event.data - event.start) / 1e3 << '}';
+		else
+			file << ",\"ph\":\"C\",\"args\":{\"value\":" << std::bit_cast<double>(event.data) << "}}";
+	}
+	file << "\n]}\n";
+	file.close();
+	if (!file)
+	{
+		std::cerr << "Failed to write trace: " << path << std::endl;
+		return false;
+	}
+	std::cout << "Wrote " << events.size() << " profiler events to " << path << std::endl;
+	return true;
+}
+
+void FrameWatch::end_frame()
+{
+	const int64_t now = RingProfiler::now();
+	const double frame_ms = last_frame != 0 ? (now - last_frame) / 1e6 : 0.;
+	last_frame = now;
+	RingProfiler::value("frame ms", frame_ms);
+	if (threshold_ms <= 0 || frame_ms <= threshold_ms) return;
+	// a slow stretch would dump every frame, one file per few seconds is plenty
+	if (last_dump != 0 && now - last_dump < 5'000'000'000) return;
+	std::cout << "Frame took " << frame_ms << " ms" << std::endl;
+	dump();
+}
+
+void FrameWatch::dump()
+{
+	last_dump = RingProfiler::now();
+	RingProfiler::dump(prefix + std::to_string(++dumps) + ".json");
+}
@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// always on profiler for builds without tracy. every thread that records gets a fixed ring of its last events, so
+// memory stays bounded however long the game runs. zones and values come from the same PROFILE_ macros tracy's do
+class RingProfiler
+{
+public:
+	static constexpr size_t MAX_THREADS = 64;
+	static constexpr size_t RING_SIZE = 1 << 14; // events per thread, a few tens of seconds of zones at 60 fps
+
+	struct Summary
+	{
+		size_t count = 0;
+		double p50 = 0.; // ms
+		double p99 = 0.;
+		double max = 0.;
+	};
+
+	// records the time until it goes out of scope as a zone named name, which has to outlive the program
+	class Zone
+	{
+		const char* name;
+		int64_t start;
+	public:
+		explicit Zone(const char* name) : name(name), start(now()) {}
+		~Zone() { zone(name, start, now()); }
+		Zone(const Zone&) = delete;
+		Zone& operator=(const Zone&) = delete;
+	};
+
+	// ns on a monotonic clock
+	static int64_t now() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+	static void zone(const char* name, int64_t start, int64_t end);
+	static void value(const char* name, double value);
+
+	// only events from the last window seconds are summarized and dumped
+	static void set_window(double seconds) { window = static_cast<int64_t>(seconds * 1e9); }
+	// durations of the zones named name in the window, over every thread
+	static Summary summarize(const char* name);
+	// writes the window as a chrome trace (chrome://tracing, perfetto), safe while other threads keep recording
+	static bool dump(const std::string& path);
+
+private:
+	enum Kind : uint8_t
+	{
+		ZONE,
+		VALUE,
+	};
+
+	// fields are relaxed atomics so a dump can read a slot the owner is overwriting, it throws such slots away
+	struct Slot
+	{
+		std::atomic<const char*> name;
+		std::atomic<int64_t> start;
+		std::atomic<int64_t> data; // end of a zone, bits of a value's double
+		std::atomic<Kind> kind;
+	};
+
+	struct Ring
+	{
+		std::atomic<uint64_t> head = 0; // events ever written, only the owning thread moves it
+		std::atomic<bool> owned = true; // a thread records into it, rings of exited threads are reused
+		size_t thread;
+		std::unique_ptr<Slot[]> slots = std::make_unique<Slot[]>(RING_SIZE);
+	};
+
+	struct Event
+	{
+		const char* name;
+		int64_t start;
+		int64_t data;
+		Kind kind;
+		size_t thread;
+	};
+
+	inline static std::atomic<Ring*> rings[MAX_THREADS] = {};
+	inline static std::atomic<size_t> ring_count = 0;
+	inline static std::atomic<int64_t> window = 10'000'000'000;
+
+	// nullptr once MAX_THREADS threads have recorded, later threads just aren't profiled
+	static Ring* local();
+	static void push(Kind kind, const char* name, int64_t start, int64_t data);
+	static std::vector<Event> collect();
+};
+
+// watches frame times in the game, dumps the window whenever a frame goes over the threshold
+class FrameWatch
+{
+	std::string prefix;
+	double threshold_ms;
+	int64_t last_frame = 0;
+	int64_t last_dump = 0;
+	int dumps = 0;
+public:
+	// 0 never dumps on its own
+	FrameWatch(const std::string& prefix, double threshold_ms) : prefix(prefix), threshold_ms(threshold_ms) {}
+	// once per frame, the frame is the time since the last call
+	void end_frame();
+	// dumps right away, e.g. from a key
+	void dump();
+};
@@ -0,0 +1,198 @@
+﻿#include "scenes.h"
+
+#include <algorithm>
+#include <random>
+
+namespace
+{
+	// edit helpers, coordinates are fractions of the world so scenes look the same at every resolution
+	class Builder
+	{
+		EditQueue& edits;
+		int width, height;
+	public:
+		std::mt19937_64 rng;
+
+		Builder(EditQueue& edits, int width, int height, uint64_t seed) : edits(edits), width(width), height(height), rng(seed) {}
+
+		int x(float fraction) const { return static_cast<int>(fraction * width); }
+		int y(float fraction) const { return static_cast<int>(fraction * height); }
+		// sizes follow the shorter side
+		int size(float fraction) const { return std::max(1, static_cast<int>(fraction * std::min(width, height))); }
+		// by hand rather than with a std distribution, those aren't the same on every standard library
+		float uniform(float min, float max) { return min + (max - min) * static_cast<float>(rng() >> 40) / (1 << 24); }
+
+		void rect(Particle::Type material, float x0, float y0, float x1, float y1, float density = 1.f)
+		{
+			edits.push({ .kind = Edit::RECT, .material = material, .x = x(x0), .y = y(y0), .width = x(x1) - x(x0), .height = y(y1) - y(y0), .density = density });
+		}
+
+		void line(Particle::Type material, float x0, float y0, float x1, float y1, float radius, float density = 1.f)
+		{
+			edits.push({ .kind = Edit::CAPSULE, .material = material, .x = x(x0), .y = y(y0), .end_x = x(x1), .end_y = y(y1), .radius = size(radius), .density = density });
+		}
+
+		void circle(Particle::Type material, float cx, float cy, float radius, float density = 1.f)
+		{
+			line(material, cx, cy, cx, cy, radius, density);
+		}
+	};
+
+	// a tall sand pile in the air over a stone slope, it collapses and slides for the whole run
+	void avalanche(Builder& b)
+	{
+		b.line(Particle::STONE, 0.f, 0.45f, 1.f, 0.95f, 0.01f);
+		b.rect(Particle::STONE, 0.f, 0.97f, 1.f, 1.f);
+		for (int i = 0; i < 6; i++)
+		{
+			const float x = b.uniform(0.f, 0.6f);
+			const float w = b.uniform(0.08f, 0.2f);
+			b.rect(Particle::SAND, x, b.uniform(0.02f, 0.1f), x + w, b.uniform(0.35f, 0.4f));
+		}
+	}
+
+	// a block of water falling into a stone basin with a few boulders in it
+	void lake(Builder& b)
+	{
+		b.line(Particle::STONE, 0.05f, 0.4f, 0.2f, 0.95f, 0.01f);
+		b.line(Particle::STONE, 0.2f, 0.95f, 0.8f, 0.95f, 0.01f);
+		b.line(Particle::STONE, 0.8f, 0.95f, 0.95f, 0.4f, 0.01f);
+		for (int i = 0; i < 5; i++)
+			b.circle(Particle::STONE, b.uniform(0.25f, 0.75f), b.uniform(0.8f, 0.92f), b.uniform(0.02f, 0.05f));
+		b.rect(Particle::WATER, 0.25f, 0.02f, 0.75f, 0.35f);
+	}
+
+	// rows of trees on the ground with a few fires and gasoline puddles at their feet
+	void forest_fire(Builder& b)
+	{
+		b.rect(Particle::STONE, 0.f, 0.9f, 1.f, 1.f);
+		for (float x = 0.03f; x < 0.97f; x += b.uniform(0.03f, 0.06f))
+		{
+			const float top = b.uniform(0.45f, 0.7f);
+			b.line(Particle::WOOD, x, 0.9f, x, top, 0.006f);
+			b.circle(Particle::WOOD, x, top, b.uniform(0.04f, 0.08f), 0.7f);
+		}
+		for (int i = 0; i < 4; i++)
+		{
+			const float x = b.uniform(0.05f, 0.95f);
+			b.rect(Particle::GASOLINE, x - 0.03f, 0.87f, x + 0.03f, 0.9f);
+			b.circle(Particle::FIRE, x, 0.86f, 0.015f);
+		}
+	}
+
+	// sand and water settled in layers with clumps of virus dropped through them and the air above
+	void virus_outbreak(Builder& b)
+	{
+		b.rect(Particle::STONE, 0.f, 0.95f, 1.f, 1.f);
+		b.rect(Particle::SAND, 0.f, 0.6f, 1.f, 0.95f);
+		b.rect(Particle::WATER, 0.f, 0.45f, 1.f, 0.6f);
+		for (int i = 0; i < 12; i++)
+			b.circle(Particle::VIRUS, b.uniform(0.f, 1.f), b.uniform(0.1f, 0.9f), 0.03f, 0.6f);
+	}
+
+	// acid poured over a bed of salt and sand on stone. stone itself doesn't corrode, so the bed is what gets eaten
+	void acid_stone(Builder& b)
+	{
+		b.rect(Particle::STONE, 0.f, 0.85f, 1.f, 1.f);
+		b.rect(Particle::SALT, 0.f, 0.6f, 1.f, 0.85f);
+		b.rect(Particle::SAND, 0.f, 0.5f, 1.f, 0.6f);
+		for (int i = 0; i < 8; i++)
+		{
+			const float x = b.uniform(0.f, 0.9f);
+			b.rect(Particle::ACID, x, b.uniform(0.3f, 0.4f), x + b.uniform(0.05f, 0.1f), 0.5f);
+		}
+	}
+
+	// packed sand resting on stone with a little water on top, almost nothing moves
+	void idle(Builder& b)
+	{
+		b.rect(Particle::STONE, 0.f, 0.8f, 1.f, 1.f);
+		b.rect(Particle::SAND, 0.f, 0.6f, 1.f, 0.8f);
+		b.rect(Particle::WATER, 0.f, 0.58f, 1.f, 0.6f);
+		b.circle(Particle::SAND, b.uniform(0.f, 1.f), 0.3f, 0.005f);
+	}
+
+	struct Scene
+	{
+		std::string name;
+		void (*build)(Builder&);
+	};
+
+	const std::vector<Scene>& scenes()
+	{
+		static const std::vector<Scene> list = {
+			{ "avalanche", avalanche },
+			{ "lake", lake },
+			{ "forest_fire", forest_fire },
+			{ "virus_outbreak", virus_outbreak },
+			{ "acid_stone", acid_stone },
+			{ "idle", idle },
+		};
+		return list;
+	}
+}
+
+const std::vector<std::string>& Scenes::names()
+{
+	static const std::vector<std::string> list = []
+	{
+		std::vector<std::string> names;
+		for (const Scene& scene : scenes())
+			names.push_back(scene.name);
+		return names;
+	}();
+	return list;
+}
+
+const std::vector<SceneResolution>& Scenes::resolutions()
+{
+	static const std::vector<SceneResolution> list = {
+		{ "720p", 1280, 720 },
+		{ "1080p", 1920, 1080 },
+		{ "1440p", 2560, 1440 },
+		{ "4k", 3840, 2160 },
+		{ "8k", 7680, 4320 },
+	};
+	return list;
+}
+
+bool Scenes::parse_resolution(const std::string& text, SceneResolution& resolution)
+{
+	for (const SceneResolution& preset : resolutions())
+	{
+		if (preset.name == text)
+		{
+			resolution = preset;
+			return true;
+		}
+	}
+	const size_t split = text.find('x');
+	if (split == std::string::npos) return false;
+	try
+	{
+		size_t end = 0;
+		resolution.width = std::stoi(text.substr(0, split), &end);
+		if (end != split) return false;
+		const std::string height = text.substr(split + 1);
+		resolution.height = std::stoi(height, &end);
+		if (end != height.size()) return false;
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+	resolution.name = text;
+	return resolution.width > 0 && resolution.height > 0;
+}
+
+bool Scenes::build(const std::string& name, int width, int height, uint64_t seed, EditQueue& edits)
+{
+	for (const Scene& scene : scenes())
+	{
+		if (scene.name != name) continue;
+		Builder builder(edits, width, height, seed);
+		scene.build(builder);
+		return true;
+	}
+	return false;
+}
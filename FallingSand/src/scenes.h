@@ -0,0 +1,28 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "edit_queue.h"
+
+struct SceneResolution
+{
+	std::string name;
+	int width = 0;
+	int height = 0;
+};
+
+// procedurally built worlds to benchmark against. everything is scaled to the world size and placed with a generator
+// seeded from the seed, and the edits go through the queue, so a name, size and seed always give the same world
+class Scenes
+{
+public:
+	static const std::vector<std::string>& names();
+	static const std::vector<SceneResolution>& resolutions();
+	// a preset name like 4k or WIDTHxHEIGHT
+	static bool parse_resolution(const std::string& text, SceneResolution& resolution);
+
+	// queues the scene's edits, false for an unknown name
+	static bool build(const std::string& name, int width, int height, uint64_t seed, EditQueue& edits);
+};
@@ -1,5 +1,15 @@
 ﻿#include "sdl_util.h"
 
+#include "perf_counters.h"
+#include "profiling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#endif
+
 void SDL_Util::put_pixel(const CanvasInfo& info, int x, int y, uint32_t color)
 {
 	if (x < 0 || x >= info.width || y < 0 || y >= info.height)
@@ -40,30 +50,121 @@ void SDL_Util::draw_circle(const CanvasInfo& info, int c_x, int c_y, int radius,
 	}
 }
 
-void SDL_Util::update_texture_via_grid(BS::thread_pool& pool, uint32_t* pixel_data, Grid& grid, int width, int height, int pitch, float alpha)
+void SDL_Util::fill_span(uint32_t* dst, int count, uint32_t color)
 {
-	ZoneScoped;
-	const float one_minus = 1.f - alpha;
-	const BS::multi_future<void> loop_future = pool.submit_loop<unsigned int>(0, height * width,
-		[&](const unsigned int i)
-		{
-			auto x = i % grid.get_width();
-			auto y = i / grid.get_width();
-			auto particle = grid.get(x, y);
+	int i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+	const __m128i wide = _mm_set1_epi32(static_cast<int>(color));
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), wide);
+#endif
+	for (; i < count; i++)
+		dst[i] = color;
+}
 
-			unsigned int x_r = x;
-			unsigned int y_r = y;
+void SDL_Util::update_texture_via_grid(BS::thread_pool& pool, uint32_t* pixel_data, Grid& grid, int pitch, const Camera& camera, float alpha)
+{
+	PROFILE_ZONE("render");
+	const int stride = pitch / 4;
+	const int screen_width = camera.get_screen_width();
+	const int screen_height = camera.get_screen_height();
+	const float zoom = camera.get_zoom();
+	const auto visible = camera.visible_cells();
 
-#ifdef INTERPOLATE
-			if (particle->type != Particle::EMPTY)
+	// first pixel column covered by world column wx
+	auto column_start = [&](int wx)
+	{
+		return std::clamp(static_cast<int>(std::ceil(camera.world_to_screen(static_cast<float>(wx), 0.f).x)), 0, screen_width);
+	};
+
+	// world column under every pixel, only needed when several cells share a pixel
+	std::vector<int> columns;
+	if (zoom < 1.f)
+	{
+		columns.resize(screen_width);
+		for (int sx = 0; sx < screen_width; sx++)
+			columns[sx] = camera.screen_to_world(sx, 0).x;
+	}
+
+	auto world_row = [&](int sy)
+	{
+		return camera.screen_to_world(0, sy).y;
+	};
+
+	auto draw_row = [&](const int sy)
+		{
+			// every run of pixel rows showing the same world row is expanded once by its first row, then copied down
+			const int wy = world_row(sy);
+			if (sy > 0 && world_row(sy - 1) == wy) return;
+
+			uint32_t* row = pixel_data + sy * stride;
+			if (wy < visible.y0 || wy >= visible.y1 || visible.width() <= 0)
 			{
-				x_r = x * alpha + particle->prev_pos.x * one_minus;
-				y_r = y * alpha + particle->prev_pos.y * one_minus;
+				fill_span(row, screen_width, 0);
 			}
-#endif
+			else if (zoom < 1.f)
+			{
+				for (int sx = 0; sx < screen_width; sx++)
+				{
+					const int wx = columns[sx];
+					row[sx] = wx >= visible.x0 && wx < visible.x1 ? grid.get(wx, wy)->color.hex() : 0;
+				}
+			}
+			else
+			{
+				const int left = column_start(visible.x0);
+				const int right = column_start(visible.x1);
+				fill_span(row, left, 0);
+				int sx = left;
+				for (int wx = visible.x0; wx < visible.x1; wx++)
+				{
+					const int next = column_start(wx + 1);
+					fill_span(row + sx, next - sx, grid.get(wx, wy)->color.hex());
+					sx = next;
+				}
+				fill_span(row + right, screen_width - right, 0);
+			}
+
+			for (int copy = sy + 1; copy < screen_height && world_row(copy) == wy; copy++)
+				std::memcpy(pixel_data + copy * stride, row, screen_width * sizeof(uint32_t));
+		};
 
-			pixel_data[y_r * (pitch / 4) + x_r] = particle->color.hex();
-			
+	// blocks rather than a loop so the counters are read once per block, not per row
+	const BS::multi_future<void> loop_future = pool.submit_blocks<int>(0, screen_height,
+		[&](const int first, const int last)
+		{
+			const PerfCounters::Phase counted(PerfPhase::RENDER);
+			for (int sy = first; sy < last; sy++)
+				draw_row(sy);
 		});
 	loop_future.wait();
+
+#ifdef INTERPOLATE
+	// only particles that moved last tick are redrawn in between their old and new cell
+	auto fill_cell = [&](float x, float y, uint32_t color)
+	{
+		const auto top_left = camera.world_to_screen(x, y);
+		const int sx0 = std::clamp(static_cast<int>(top_left.x), 0, screen_width);
+		const int sy0 = std::clamp(static_cast<int>(top_left.y), 0, screen_height);
+		const int sx1 = std::clamp(static_cast<int>(top_left.x + std::max(zoom, 1.f)), 0, screen_width);
+		const int sy1 = std::clamp(static_cast<int>(top_left.y + std::max(zoom, 1.f)), 0, screen_height);
+		for (int sy = sy0; sy < sy1; sy++)
+			fill_span(pixel_data + sy * stride + sx0, sx1 - sx0, color);
+	};
+	const float one_minus = 1.f - alpha;
+	const auto& motions = grid.get_motions();
+	const BS::multi_future<void> motion_future = pool.submit_loop<size_t>(0, motions.size(),
+		[&](const size_t i)
+		{
+			for (const auto& [from, to] : motions[i])
+			{
+				const auto moved = grid.get(to.x, to.y)->color.hex();
+				const auto displaced = grid.get(from.x, from.y)->color.hex();
+				fill_cell(static_cast<float>(to.x), static_cast<float>(to.y), displaced);
+				fill_cell(std::floor(to.x * one_minus + from.x * alpha), std::floor(to.y * one_minus + from.y * alpha), displaced);
+				fill_cell(std::floor(to.x * alpha + from.x * one_minus), std::floor(to.y * alpha + from.y * one_minus), moved);
+			}
+		});
+	motion_future.wait();
+#endif
 }
@@ -2,6 +2,7 @@
 
 #include <BS_thread_pool.hpp>
 
+#include "camera.h"
 #include "grid.h"
 #include <Tracy.hpp>
 
@@ -17,6 +18,8 @@ class SDL_Util
 public:
 	static void put_pixel(const CanvasInfo& info, int x, int y, uint32_t color);
 	static void draw_circle(const CanvasInfo& info, int c_x, int c_y, int radius, uint32_t color);
-	// called after you lock the texture
-	static void update_texture_via_grid(BS::thread_pool& pool, uint32_t* pixel_data, Grid& grid, int width, int height, int pitch, float alpha);
+	// writes count copies of color starting at dst, 4 pixels per store
+	static void fill_span(uint32_t* dst, int count, uint32_t color);
+	// called after you lock the texture. only the cells visible through the camera are read, pixels outside the world are cleared
+	static void update_texture_via_grid(BS::thread_pool& pool, uint32_t* pixel_data, Grid& grid, int pitch, const Camera& camera, float alpha);
 };
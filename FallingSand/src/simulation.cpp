@@ -1,12 +1,101 @@
 ﻿#include "simulation.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
-#include <Tracy.hpp>
 
-Simulation::Simulation(Grid* grid) : grid(grid), gravity(4.0f)
+#include "perf_counters.h"
+#include "profiling.h"
+#include "tick_workers.h"
+
+Simulation::Simulation(Grid* grid, uint64_t seed) : grid(grid), gravity(4.0f), seed(seed)
 {
 	// TODO: make gravity changeable at runtime
 	assert(grid);
+	focus = { 0, 0, static_cast<int>(grid->get_width()), static_cast<int>(grid->get_height()) };
+}
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	double ms_since(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	// idle thread ms at the barrier after a phase that took phase_ms and ran every other strip from first, and its
+	// slowest strip over the mean. only threads the phase had a strip for can wait on it, at odd thread counts one
+	// has none and idles the whole phase by design
+	void barrier_stats(const std::vector<double>& strip_ms, size_t first, unsigned int threads, double phase_ms, double& wait_ms, double& imbalance)
+	{
+		double total = 0, slowest = 0;
+		size_t count = 0;
+		for (size_t i = first; i < strip_ms.size(); i += 2, count++)
+		{
+			total += strip_ms[i];
+			slowest = std::max(slowest, strip_ms[i]);
+		}
+		wait_ms = std::max(0., phase_ms * std::min<size_t>(threads, count) - total);
+		imbalance = total > 0 ? slowest * count / total : 1.;
+	}
+
+	// a particle turned into something else, for the tracy plot and the tick stats
+	void count_reaction()
+	{
+		PROFILE_COUNT(reactions);
+		if (StripCounts* counts = local_strip_counts())
+			counts->reactions++;
+	}
+
+	// charges the time spent in each chunk to it, switching chunks as a strip walks across them
+	class CostMeter
+	{
+		std::atomic<uint64_t>* costs;
+		unsigned int chunks_x;
+		int chunk = -1;
+		uint64_t mark = 0;
+	public:
+		CostMeter(std::atomic<uint64_t>* costs, unsigned int chunks_x) : costs(costs), chunks_x(chunks_x) {}
+		~CostMeter() { flush(); }
+
+		void enter(int x, int y)
+		{
+			const int c = (y >> CHUNK_SHIFT) * chunks_x + (x >> CHUNK_SHIFT);
+			if (c == chunk) return;
+			flush();
+			chunk = c;
+		}
+
+		void flush()
+		{
+			const uint64_t now = Profiling::timestamp();
+			if (chunk >= 0)
+				costs[chunk].fetch_add(now - mark, std::memory_order_relaxed);
+			mark = now;
+		}
+	};
+}
+
+void Simulation::set_cost_tracking(bool enabled)
+{
+	track_costs = enabled;
+	if (enabled && !chunk_costs)
+		chunk_costs = std::make_unique<std::atomic<uint64_t>[]>(grid->get_chunk_count());
+}
+
+CellRect Simulation::active_region() const
+{
+	const int width = static_cast<int>(grid->get_width());
+	const int height = static_cast<int>(grid->get_height());
+	if (background_interval > 0 && tick % background_interval == 0)
+		return { 0, 0, width, height };
+	return {
+		std::max(focus.x0 - focus_margin, 0),
+		std::max(focus.y0 - focus_margin, 0),
+		std::min(focus.x1 + focus_margin, width),
+		std::min(focus.y1 + focus_margin, height)
+	};
 }
 
 XMINT2 Simulation::raycast(int x, int y, int vx, int vy)
@@ -47,9 +136,79 @@ XMINT2 Simulation::raycast(int x, int y, int vx, int vy)
 	}
 }
 
+int Simulation::plan_strips(const CellRect& region, int count)
+{
+	if (region.width() <= 0)
+	{
+		strip_bounds.assign(count + 1, region.x0);
+		return 1;
+	}
+	const int cx0 = region.x0 >> CHUNK_SHIFT;
+	const int cx1 = ((region.x1 - 1) >> CHUNK_SHIFT) + 1;
+	const int cy0 = region.y0 >> CHUNK_SHIFT;
+	const int cy1 = ((region.y1 - 1) >> CHUNK_SHIFT) + 1;
+
+	// cost of one cell column in each chunk column
+	column_costs.assign(cx1 - cx0, 0.);
+	double total = 0;
+	for (int cx = cx0; cx < cx1; cx++)
+	{
+		double cost = 0;
+		for (int cy = cy0; cy < cy1; cy++)
+		{
+			const Chunk* chunk = grid->get_chunk(cx, cy);
+			cost += chunk ? CHUNK_SIZE * CHUNK_SIZE + PARTICLE_COST * chunk->occupied.load(std::memory_order_relaxed) : CHUNK_SIZE;
+		}
+		column_costs[cx - cx0] = cost / CHUNK_SIZE;
+		total += column_costs[cx - cx0] * (std::min(region.x1, (cx + 1) << CHUNK_SHIFT) - std::max(region.x0, cx << CHUNK_SHIFT));
+	}
+
+	// boundary k goes where the running cost reaches k / count of the total, cells within a chunk column cost the same
+	strip_bounds.assign(count + 1, region.x1);
+	strip_bounds[0] = region.x0;
+	int k = 1;
+	double sum = 0;
+	for (int cx = cx0; cx < cx1 && k < count; cx++)
+	{
+		const int x0 = std::max(region.x0, cx << CHUNK_SHIFT);
+		const int x1 = std::min(region.x1, (cx + 1) << CHUNK_SHIFT);
+		const double per_cell = column_costs[cx - cx0];
+		for (; k < count && sum + per_cell * (x1 - x0) >= total * k / count; k++)
+			strip_bounds[k] = x0 + static_cast<int>((total * k / count - sum) / per_cell);
+		sum += per_cell * (x1 - x0);
+	}
+
+	// strips of one parity only stay apart while the strips between them have some width
+	const int min_width = std::max(1, std::min(MIN_STRIP_WIDTH, region.width() / count));
+	for (k = 1; k < count; k++)
+		strip_bounds[k] = std::max(strip_bounds[k], strip_bounds[k - 1] + min_width);
+	for (k = count - 1; k > 0; k--)
+		strip_bounds[k] = std::min(strip_bounds[k], strip_bounds[k + 1] - min_width);
+	// a region narrower than count strips can't give each of them a cell, the ones left over stay empty at its edge
+	// instead of reaching outside it
+	for (k = 1; k < count; k++)
+		strip_bounds[k] = std::clamp(strip_bounds[k], region.x0, region.x1);
+	return min_width;
+}
+
+void Simulation::apply_edits(BS::thread_pool& pool)
+{
+	PROFILE_ZONE("apply edits");
+	edits.apply_all(*grid, pool, mix_seed(~seed, tick));
+}
+
 void Simulation::update(float delta, BS::thread_pool& pool)
 {
-	ZoneScoped;
+	PROFILE_ZONE("simulation update");
+	PROFILE_BEGIN_TICK(pool.get_thread_count());
+	const auto update_start = Clock::now();
+	stats.busy_ms.assign(pool.get_thread_count(), 0.);
+	apply_edits(pool);
+	stats.edits_ms = ms_since(update_start);
+	const CellRect region = active_region();
+	tick++;
+	seed_thread_rand(mix_seed(seed, tick));
+
 	// pick directions for each row
 	std::vector<bool> directions(grid->get_height());
 	for (int i = 0; i < grid->get_height(); i++)
@@ -57,36 +216,35 @@ void Simulation::update(float delta, BS::thread_pool& pool)
 		directions[i] = thread_rand() < 0.5f;
 	}
 
-	const int num_columns = pool.get_thread_count();
-	const int pixels_per_group = ceil(grid->get_width() / num_columns);
+	const int num_columns = strip_count(pool.get_thread_count());
+	stats.strip_ms.assign(num_columns, 0.);
+	strip_counts.assign(num_columns, StripCounts{});
 
-#ifdef INTERPOLATE
-	auto set_prev = [&]
-	{
-		ZoneScoped;
-		const BS::multi_future<void> loop_future = pool.submit_loop<unsigned int>(0, grid->get_height() * grid->get_width(),
-			[this](const unsigned int i)
-			{
-				auto x = static_cast<int>(i % grid->get_width());
-				auto y = static_cast<int>(i / grid->get_width());
-				auto particle = grid->get(x, y);
-				particle->prev_pos = { x, y };
-			});
-		loop_future.wait();
-	};
-	set_prev();
-#endif
+	// only records anything when motion tracking is on
+	grid->clear_motions(pool.get_thread_count());
 
-	auto iterate_bottom_to_top = [this, delta, directions](int start, int end)
+	auto iterate_bottom_to_top = [this, delta, directions, region](int start, int end)
 		{
-			if (start >= static_cast<int>(grid->get_width())) return;
-			auto xr = std::min(end, static_cast<int>(grid->get_width()));
-			for (int y = grid->get_height() - 1; y >= 0; --y)
+			if (start >= region.x1) return;
+			const PerfCounters::Phase counted(PerfPhase::BOTTOM_UP);
+			auto xr = std::min(end, region.x1);
+			CostMeter meter(chunk_costs.get(), grid->get_chunks_x());
+			for (int y = region.y1 - 1; y >= region.y0; --y)
 			{
 				for (int xi = start; xi < xr; xi++)
 				{
 					int x = directions[y] ? xi : xr - xi + start - 1;
+					if (track_costs)
+						meter.enter(x, y);
+					if (grid->in_empty_chunk(x, y))
+					{
+						// jump to the last cell of the chunk in the direction of travel
+						xi += directions[y] ? CHUNK_MASK - (x & CHUNK_MASK) : x & CHUNK_MASK;
+						continue;
+					}
 					auto particle = grid->get(x, y);
+					if (particle->type == Particle::EMPTY) continue;
+					PROFILE_MATERIAL(particle->type);
 
 					if (!ParticleUtils::reversed_simulation(particle->type))
 					{
@@ -141,16 +299,28 @@ void Simulation::update(float delta, BS::thread_pool& pool)
 			}
 		};
 
-	auto iterate_top_to_bottom = [this, delta, directions](int start, int end)
+	auto iterate_top_to_bottom = [this, delta, directions, region](int start, int end)
 		{
-			if (start >= static_cast<int>(grid->get_width())) return;
-			auto xr = std::min(end, static_cast<int>(grid->get_width()));
-			for (int y = 0; y < grid->get_height(); ++y)
+			if (start >= region.x1) return;
+			const PerfCounters::Phase counted(PerfPhase::TOP_DOWN);
+			auto xr = std::min(end, region.x1);
+			CostMeter meter(chunk_costs.get(), grid->get_chunks_x());
+			for (int y = region.y0; y < region.y1; ++y)
 			{
 				for (int xi = start; xi < xr; xi++)
 				{
 					int x = directions[y] ? xi : xr - xi + start - 1;
+					if (track_costs)
+						meter.enter(x, y);
+					if (grid->in_empty_chunk(x, y))
+					{
+						// jump to the last cell of the chunk in the direction of travel
+						xi += directions[y] ? CHUNK_MASK - (x & CHUNK_MASK) : x & CHUNK_MASK;
+						continue;
+					}
 					auto particle = grid->get(x, y);
+					if (particle->type == Particle::EMPTY) continue;
+					PROFILE_MATERIAL(particle->type);
 
 					if (ParticleUtils::reversed_simulation(particle->type))
 					{
@@ -174,36 +344,98 @@ void Simulation::update(float delta, BS::thread_pool& pool)
 			}
 		};
 
-	BS::multi_future<void> futures;
-
 	assert(num_columns % 2 == 0);
-	const int random_offset = thread_rand() * pixels_per_group * 0.5;
+	assert(!workers || workers->get_thread_count() == pool.get_thread_count());
+	const int min_width = plan_strips(region, num_columns);
+	// moves the inner boundaries a little every tick so strip edges don't leave seams in the world
+	const int random_offset = thread_rand() * min_width * 0.5;
 
-	for (int i = 0; i < num_columns; i += 2)
-	{
-		int start = i * pixels_per_group + random_offset * (i > 0);
-		int end = (i + 1) * pixels_per_group + random_offset;
-		futures.push_back(pool.submit_task([=]
+	auto strip = [&](int i, size_t worker)
+		{
+			PROFILE_ZONE("strip");
+			PROFILE_BUSY();
+			const int start = strip_bounds[i] + random_offset * (i > 0);
+			const int end = strip_bounds[i + 1] + random_offset * (i + 1 < num_columns);
+			assert(worker < stats.busy_ms.size());
+			const auto strip_start = Clock::now();
+			// seeded per strip, not per thread, so it doesn't matter which worker picks the strip up
+			seed_thread_rand(mix_seed(seed, tick, i + 1));
+			local_strip_counts() = &strip_counts[i];
+			iterate_bottom_to_top(start, end);
+			iterate_top_to_bottom(start, end);
+			local_strip_counts() = nullptr;
+			stats.strip_ms[i] = ms_since(strip_start);
+			stats.busy_ms[worker] += stats.strip_ms[i];
+		};
+
+	// every strip of one parity at once, returns with the slowest. time the phase spent outside its slowest strip
+	// handing strips out and waiting on them goes to schedule_us
+	stats.schedule_us = 0.;
+	auto run_phase = [&](int first)
+		{
+			PROFILE_PARALLEL();
+			const auto phase_start = Clock::now();
+			if (workers)
+			{
+				workers->run(num_columns / 2, [&](int task, unsigned int worker) { strip(first + task * 2, worker); });
+			}
+			else
 			{
-				iterate_bottom_to_top(start, end);
-				iterate_top_to_bottom(start, end);
+				BS::multi_future<void> futures;
+				for (int i = first; i < num_columns; i += 2)
+				{
+					// strips are tasks, each lands on whichever worker is free
+					futures.push_back(pool.submit_task([&strip, i]
+						{
+							const std::optional<size_t> worker = worker_index();
+							assert(worker);
+							strip(i, *worker);
+						}));
+				}
+				futures.wait();
 			}
-		));
+			double slowest = 0;
+			for (int i = first; i < num_columns; i += 2)
+				slowest = std::max(slowest, stats.strip_ms[i]);
+			stats.schedule_us += std::max(0., ms_since(phase_start) - slowest) * 1000.;
+		};
+
+	// strips of one parity never reach into each other, so each phase runs them all at once and ends with its slowest
+	const auto even_start = Clock::now();
+	{
+		PROFILE_ZONE("even strips");
+		run_phase(0);
 	}
-	futures.wait();
+	stats.even_ms = ms_since(update_start) - stats.edits_ms;
+	barrier_stats(stats.strip_ms, 0, pool.get_thread_count(), ms_since(even_start), stats.even_wait_ms, stats.even_imbalance);
 
-	for (int i = 1; i < num_columns; i += 2)
+	const auto odd_start = Clock::now();
 	{
-		int start = i * pixels_per_group + random_offset;
-		int end = (i + 1) * pixels_per_group + random_offset;
-		futures.push_back(pool.submit_task([=]
-			{
-				iterate_bottom_to_top(start, end);
-				iterate_top_to_bottom(start, end);
-			}
-		));
+		PROFILE_ZONE("odd strips");
+		run_phase(1);
+	}
+	stats.odd_ms = ms_since(odd_start);
+	barrier_stats(stats.strip_ms, 1, pool.get_thread_count(), stats.odd_ms, stats.odd_wait_ms, stats.odd_imbalance);
+
+	const auto release_start = Clock::now();
+	{
+		PROFILE_ZONE("release chunks");
+		grid->release_empty_chunks();
+	}
+	stats.release_ms = ms_since(release_start);
+	PROFILE_END_TICK(*grid);
+
+	stats.tick = tick;
+	stats.total_ms = ms_since(update_start);
+	stats.active_cells = static_cast<int64_t>(grid->count_particles());
+	// every strip counted into its own slot, so the phases never shared a counter
+	stats.swaps = stats.sets = stats.reactions = 0;
+	for (const StripCounts& counts : strip_counts)
+	{
+		stats.swaps += static_cast<int64_t>(counts.swaps);
+		stats.sets += static_cast<int64_t>(counts.sets);
+		stats.reactions += static_cast<int64_t>(counts.reactions);
 	}
-	futures.wait();
 
 	//iterate_bottom_to_top(0, grid->get_width());
 	//iterate_top_to_bottom(0, grid->get_width());
@@ -346,6 +578,7 @@ void Simulation::wood(Particle* p, int x, int y)
 {
 	if (burns(p, x, y))
 	{
+		count_reaction();
 		grid->set(x, y, Particle::FIRE);
 		// TODO: customize burn time based on particle type
 		grid->get(x, y)->life_time = 1.0f + thread_rand();
@@ -364,11 +597,13 @@ void Simulation::fire(Particle* p, int x, int y)
 	if (extinguishes(p, x, y))
 	{
 		// Liquid puts out fire
+		count_reaction();
 		grid->set(x, y, Particle::SMOKE);
 	}
 	else if (p->life_time < 0.1f + 0.1f * thread_rand())
 	{
 		// Become smoke
+		count_reaction();
 		grid->set(x, y, Particle::SMOKE);
 		grid->get(x, y)->burning = true;
 	}
@@ -377,7 +612,10 @@ void Simulation::fire(Particle* p, int x, int y)
 void Simulation::salt(Particle* p, int x, int y)
 {
 	if (dissolves(p, x, y))
+	{
+		count_reaction();
 		p->dying = true;
+	}
 	solid(p, x, y);
 }
 
@@ -395,6 +633,7 @@ void Simulation::acid(Particle* p, int x, int y)
 			auto np = grid->get(nx, ny);
 			if (np && thread_rand() < np->corrodibility)
 			{
+				count_reaction();
 				grid->set(nx, ny, Particle::SMOKE);
 				break;
 			}
@@ -402,10 +641,16 @@ void Simulation::acid(Particle* p, int x, int y)
 	}
 
 	if (dissolves(p, x, y))
+	{
+		count_reaction();
 		p->dying = true;
+	}
 
 	if (p->life_time < 0.01f)
+	{
+		count_reaction();
 		grid->set(x, y, Particle::SMOKE);
+	}
 
 	liquid(p, x, y);
 }
@@ -414,6 +659,7 @@ void Simulation::gasoline(Particle* p, int x, int y)
 {
 	if (burns(p, x, y))
 	{
+		count_reaction();
 		grid->set(x, y, Particle::FIRE);
 		// TODO: customize burn time based on particle type
 		grid->get(x, y)->life_time = 1.0f + thread_rand();
@@ -425,6 +671,7 @@ void Simulation::virus(Particle* p, int x, int y)
 {
 	if (burns(p, x, y))
 	{
+		count_reaction();
 		grid->set(x, y, Particle::FIRE);
 		// TODO: customize burn time based on particle type
 		grid->get(x, y)->life_time = 1.0f + thread_rand();
@@ -458,7 +705,10 @@ void Simulation::virus(Particle* p, int x, int y)
 			int ny = y + dy[dir];
 			// TODO: decide whether virus should overwrite solids / liquids
 			if (grid->is_air(nx, ny))
+			{
+				count_reaction();
 				grid->set(nx, ny, Particle::VIRUS);
+			}
 		}
 	}
 }
@@ -488,7 +738,10 @@ void Simulation::poison(Particle* p, int x, int y)
 			int nx = x + dx[i];
 			int ny = y + dy[i];
 			if (thread_rand() < prob && grid->is_liquid(nx, ny) && ~(grid->get_type(nx, ny) & Particle::POISON))
+			{
+				count_reaction();
 				grid->set(nx, ny, Particle::POISON);
+			}
 		}
 	}
 	
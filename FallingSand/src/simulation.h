@@ -1,17 +1,106 @@
 ﻿#pragma once
+#include "camera.h"
+#include "edit_queue.h"
 #include "grid.h"
+#include "tick_workers.h"
 #include <BS_thread_pool.hpp>
 
+// where the last update spent its time, always measured, it only takes a few clock reads per strip
+struct TickStats
+{
+	uint64_t tick = 0;
+	double total_ms = 0.;
+	double edits_ms = 0.;
+	double even_ms = 0.; // includes picking the row directions
+	double odd_ms = 0.;
+	double release_ms = 0.;
+	std::vector<double> busy_ms; // per pool thread, time it spent running strips
+	std::vector<double> strip_ms; // per strip left to right, the even phase runs the even indices
+	// at the barrier ending each phase: thread ms the pool sat idle waiting for the slowest strip, not counting a
+	// thread left without a strip, and the slowest strip over the mean, 1 when the strips took equally long
+	double even_wait_ms = 0.;
+	double odd_wait_ms = 0.;
+	double even_imbalance = 1.;
+	double odd_imbalance = 1.;
+	// time both phases spent handing strips out and waiting on them, beyond their slowest strip
+	double schedule_us = 0.;
+	int64_t active_cells = 0; // particles in the world after the tick
+	// what the strips did to cells, summed over their StripCounts
+	int64_t swaps = 0;
+	int64_t sets = 0;
+	int64_t reactions = 0;
+};
+
 class Simulation
 {
 	Grid* grid;
 	float gravity;
+	uint64_t tick = 0;
+	// every draw in a tick comes from generators reseeded off (seed, tick, task), so the world after a tick only
+	// depends on the world before it, the seed and the thread count
+	uint64_t seed;
+
+	// edits from the ui and importers, only ever touch the grid between ticks
+	EditQueue edits;
+
+	// cells around the focus are ticked every step, the whole world only every background_interval steps
+	CellRect focus;
+	int focus_margin = 64;
+	int background_interval = 4;
+	CellRect active_region() const;
+
+	// time spent in each chunk while ticking, only measured when someone is looking at it
+	bool track_costs = false;
+	std::unique_ptr<std::atomic<uint64_t>[]> chunk_costs;
+
+	TickStats stats;
+
+	// strip i covers [strip_bounds[i], strip_bounds[i + 1]) before the per tick offset. the boundaries split the
+	// estimated cost of the region evenly, estimated from the chunks' particle counts rather than measured times, so
+	// where they fall only depends on the world and the tick stays deterministic
+	static constexpr int MIN_STRIP_WIDTH = CHUNK_SIZE;
+	static constexpr int PARTICLE_COST = 8; // a particle against visiting a cell
+	std::vector<int> strip_bounds;
+	std::vector<double> column_costs;
+	std::vector<StripCounts> strip_counts; // per strip, summed into the stats after the tick
+	// fills strip_bounds for count strips, returns the narrowest width a strip was allowed. that is a chunk unless the
+	// region is narrower than count chunks, and strips of a region narrower than count cells can be empty
+	int plan_strips(const CellRect& region, int count);
+
+	// strips run on these instead of as pool tasks when set
+	TickWorkers* workers = nullptr;
 public:
-	Simulation(Grid* grid);
+	// fixed step the game and the headless runs advance by
+	static constexpr float FIXED_DELTA = 1.f / 30.f;
+
+	Simulation(Grid* grid, uint64_t seed = std::random_device{}());
+
+	void set_focus(const CellRect& region) { focus = region; }
+	// 0 never ticks the whole world, used when only the focus is resident
+	void set_background_interval(int interval) { background_interval = interval; }
+	// nullptr goes back to the pool. they need as many threads as the pool passed to update
+	void set_workers(TickWorkers* tick_workers) { workers = tick_workers; }
+	uint64_t get_tick() const { return tick; }
+	uint64_t get_seed() const { return seed; }
+	const TickStats& get_stats() const { return stats; }
+
+	// any thread may push, the edits land at the start of the next update
+	EditQueue& get_edits() { return edits; }
+	// applies queued edits now, only between ticks. update calls this itself
+	void apply_edits(BS::thread_pool& pool);
+
+	// adds the time every chunk takes to tick to its entry, indexed cy * chunks_x + cx, in Profiling::timestamp
+	// units. never reset by the simulation, whoever reads a cost swaps it with 0
+	void set_cost_tracking(bool enabled);
+	std::atomic<uint64_t>* get_chunk_costs() { return chunk_costs.get(); }
 
 	// returns closest position of particle in velocity (vx, vy) from (x, y)
 	XMINT2 raycast(int x, int y, int vx, int vy);
 
+	// strips a tick is split into on a pool of threads. strips of one parity never touch, so the count is even, odd
+	// thread counts get one more strip than workers and a worker idles in each phase
+	static int strip_count(unsigned int threads) { return static_cast<int>(threads + threads % 2); }
+
 	// Only particles with gravity can be simulated bottom to top. Would not work with smoke for example
 	void update(float delta, BS::thread_pool& pool);
 	void solid(Particle* particle, int x, int y);
@@ -0,0 +1,269 @@
+﻿#include "snapshot.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <zstd.h>
+
+#include "profiling.h"
+
+namespace
+{
+	constexpr int CELLS = CHUNK_SIZE * CHUNK_SIZE;
+	constexpr int COMPRESSION_LEVEL = 1;
+	// encoding of a chunk where no two neighbouring cells match, one run per cell in both planes
+	constexpr uint32_t MAX_RAW_SIZE = 2 * sizeof(uint32_t) + CELLS * (sizeof(uint16_t) + sizeof(uint16_t)) + CELLS * (sizeof(uint16_t) + sizeof(uint32_t));
+
+	template<typename T>
+	void write(std::vector<uint8_t>& out, T value)
+	{
+		const auto at = out.size();
+		out.resize(at + sizeof(T));
+		std::memcpy(out.data() + at, &value, sizeof(T));
+	}
+
+	template<typename T>
+	bool read(const uint8_t*& in, const uint8_t* end, T& value)
+	{
+		if (end - in < static_cast<ptrdiff_t>(sizeof(T))) return false;
+		std::memcpy(&value, in, sizeof(T));
+		in += sizeof(T);
+		return true;
+	}
+
+	// [run count] then [length, value] pairs. runs never exceed a chunk so 16 bit lengths are enough
+	template<typename T, typename Get>
+	void encode_plane(std::vector<uint8_t>& out, Get get)
+	{
+		const auto count_at = out.size();
+		write<uint32_t>(out, 0);
+		uint32_t runs = 0;
+		int i = 0;
+		while (i < CELLS)
+		{
+			const T value = get(i);
+			int length = 1;
+			while (i + length < CELLS && get(i + length) == value) length++;
+			write<uint16_t>(out, static_cast<uint16_t>(length));
+			write<T>(out, value);
+			runs++;
+			i += length;
+		}
+		std::memcpy(out.data() + count_at, &runs, sizeof(runs));
+	}
+
+	template<typename T, typename Set>
+	bool decode_plane(const uint8_t*& in, const uint8_t* end, Set set)
+	{
+		uint32_t runs;
+		if (!read(in, end, runs)) return false;
+		int i = 0;
+		for (uint32_t r = 0; r < runs; r++)
+		{
+			uint16_t length;
+			T value;
+			if (!read(in, end, length) || !read(in, end, value) || i + length > CELLS) return false;
+			for (int j = 0; j < length; j++)
+				set(i++, value);
+		}
+		return i == CELLS;
+	}
+}
+
+std::vector<uint8_t> Snapshot::encode_cells(const Particle* cells, uint32_t* raw_size)
+{
+	std::vector<uint8_t> raw;
+	raw.reserve(CELLS);
+	encode_plane<uint16_t>(raw, [cells](int i) { return static_cast<uint16_t>(cells[i].type); });
+	encode_plane<uint32_t>(raw, [cells](int i) { return cells[i].color.hex(); });
+
+	std::vector<uint8_t> compressed(ZSTD_compressBound(raw.size()));
+	const size_t size = ZSTD_compress(compressed.data(), compressed.size(), raw.data(), raw.size(), COMPRESSION_LEVEL);
+	if (ZSTD_isError(size))
+	{
+		*raw_size = 0;
+		return {};
+	}
+	compressed.resize(size);
+	*raw_size = static_cast<uint32_t>(raw.size());
+	return compressed;
+}
+
+bool Snapshot::decode_cells(const uint8_t* data, size_t size, uint32_t raw_size, Particle* cells)
+{
+	// raw_size comes from the file, nothing valid decodes to more than one full chunk
+	if (raw_size > MAX_RAW_SIZE) return false;
+	std::vector<uint8_t> raw(raw_size);
+	const size_t decompressed = ZSTD_decompress(raw.data(), raw.size(), data, size);
+	if (ZSTD_isError(decompressed) || decompressed != raw_size) return false;
+
+	const uint8_t* in = raw.data();
+	const uint8_t* end = raw.data() + raw.size();
+	const bool types_ok = decode_plane<uint16_t>(in, end, [cells](int i, uint16_t type)
+		{
+			const auto t = static_cast<Particle::Type>(type);
+			cells[i] = Grid::create_particle(ParticleUtils::colors.contains(t) ? t : Particle::EMPTY, false);
+		});
+	return types_ok && decode_plane<uint32_t>(in, end, [cells](int i, uint32_t color) { cells[i].color = color; });
+}
+
+std::vector<uint8_t> Snapshot::encode_chunk(const Grid& grid, int cx, int cy, uint32_t* raw_size)
+{
+	const Chunk* chunk = grid.get_chunk(cx, cy);
+	uint32_t ignored;
+	if (!raw_size) raw_size = &ignored;
+	*raw_size = 0;
+	if (!chunk) return {};
+	return encode_cells(chunk->cells, raw_size);
+}
+
+bool Snapshot::decode_chunk(Grid& grid, int cx, int cy, const uint8_t* data, size_t size, uint32_t raw_size)
+{
+	if (size == 0)
+	{
+		grid.clear_chunk(cx, cy);
+		return true;
+	}
+	auto cells = std::make_unique<Particle[]>(CELLS);
+	if (!decode_cells(data, size, raw_size, cells.get())) return false;
+	grid.write_chunk(cx, cy, cells.get());
+	return true;
+}
+
+bool Snapshot::save(const Grid& grid, const std::string& path, BS::thread_pool& pool)
+{
+	PROFILE_FUNCTION();
+	const auto start = std::chrono::steady_clock::now();
+	const int chunks_x = static_cast<int>(grid.get_chunks_x());
+	const size_t count = grid.get_chunk_count();
+
+	std::vector<std::vector<uint8_t>> payloads(count);
+	std::vector<IndexEntry> index(count);
+	const BS::multi_future<void> encode = pool.submit_loop<size_t>(0, count,
+		[&](const size_t i)
+		{
+			payloads[i] = encode_chunk(grid, static_cast<int>(i % chunks_x), static_cast<int>(i / chunks_x), &index[i].raw_size);
+		});
+	encode.wait();
+
+	uint64_t offset = sizeof(Header) + count * sizeof(IndexEntry);
+	for (size_t i = 0; i < count; i++)
+	{
+		index[i].offset = payloads[i].empty() ? 0 : offset;
+		index[i].compressed_size = static_cast<uint32_t>(payloads[i].size());
+		offset += payloads[i].size();
+	}
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		std::cerr << "Failed to open world file for writing: " << path << std::endl;
+		return false;
+	}
+	Header header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.width = grid.get_width();
+	header.height = grid.get_height();
+	header.chunk_size = CHUNK_SIZE;
+	header.chunks_x = grid.get_chunks_x();
+	header.chunks_y = grid.get_chunks_y();
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+	for (const auto& payload : payloads)
+		file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+	if (!file)
+	{
+		std::cerr << "Failed to write world file: " << path << std::endl;
+		return false;
+	}
+
+	std::cout << "Saved " << path << " (" << offset / 1024 << " KiB) in "
+		<< std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+	return true;
+}
+
+bool Snapshot::load(Grid& grid, const std::string& path, BS::thread_pool& pool)
+{
+	PROFILE_FUNCTION();
+	const auto start = std::chrono::steady_clock::now();
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+	{
+		std::cerr << "Failed to open world file: " << path << std::endl;
+		return false;
+	}
+	std::vector<uint8_t> bytes(static_cast<size_t>(file.tellg()));
+	file.seekg(0);
+	file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+
+	Header header;
+	if (bytes.size() < sizeof(Header))
+	{
+		std::cerr << "World file is truncated: " << path << std::endl;
+		return false;
+	}
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.chunk_size != CHUNK_SIZE)
+	{
+		std::cerr << "Not a supported world file: " << path << std::endl;
+		return false;
+	}
+	if (header.width != grid.get_width() || header.height != grid.get_height())
+	{
+		std::cerr << "World file is " << header.width << "x" << header.height << " but the grid is "
+			<< grid.get_width() << "x" << grid.get_height() << std::endl;
+		return false;
+	}
+
+	const size_t count = grid.get_chunk_count();
+	if (bytes.size() < sizeof(Header) + count * sizeof(IndexEntry))
+	{
+		std::cerr << "World file is truncated: " << path << std::endl;
+		return false;
+	}
+	std::vector<IndexEntry> index(count);
+	std::memcpy(index.data(), bytes.data() + sizeof(Header), count * sizeof(IndexEntry));
+
+	// every chunk is decoded before the first one is written, a corrupt file leaves the world as it was
+	const int chunks_x = static_cast<int>(grid.get_chunks_x());
+	std::vector<std::unique_ptr<Particle[]>> decoded(count);
+	std::atomic<bool> ok = true;
+	const BS::multi_future<void> decode = pool.submit_loop<size_t>(0, count,
+		[&](const size_t i)
+		{
+			const auto& entry = index[i];
+			if (entry.compressed_size == 0) return;
+			if (entry.offset + entry.compressed_size > bytes.size())
+			{
+				ok = false;
+				return;
+			}
+			decoded[i] = std::make_unique<Particle[]>(CELLS);
+			if (!decode_cells(bytes.data() + entry.offset, entry.compressed_size, entry.raw_size, decoded[i].get()))
+				ok = false;
+		});
+	decode.wait();
+
+	if (!ok)
+	{
+		std::cerr << "World file is corrupt: " << path << std::endl;
+		return false;
+	}
+	const BS::multi_future<void> write = pool.submit_loop<size_t>(0, count,
+		[&](const size_t i)
+		{
+			const int cx = static_cast<int>(i % chunks_x);
+			const int cy = static_cast<int>(i / chunks_x);
+			if (decoded[i])
+				grid.write_chunk(cx, cy, decoded[i].get());
+			else
+				grid.clear_chunk(cx, cy);
+		});
+	write.wait();
+	std::cout << "Loaded " << path << " in "
+		<< std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+	return true;
+}
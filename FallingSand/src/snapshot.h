@@ -0,0 +1,52 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+#include "grid.h"
+
+// versioned binary world file
+//   header       magic, version, world size, chunk size and chunk counts
+//   chunk index  one entry per chunk in row major order, size 0 means the chunk is empty
+//   payloads     per chunk, zstd compressed run length encoding of the type plane followed by the color plane
+class Snapshot
+{
+public:
+	static constexpr char MAGIC[4] = { 'F', 'S', 'W', 'D' };
+	static constexpr uint32_t VERSION = 1;
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t chunk_size;
+		uint32_t chunks_x;
+		uint32_t chunks_y;
+		uint32_t reserved;
+	};
+
+	struct IndexEntry
+	{
+		uint64_t offset; // from the start of the file
+		uint32_t compressed_size;
+		uint32_t raw_size;
+	};
+
+	static bool save(const Grid& grid, const std::string& path, BS::thread_pool& pool);
+	// world size in the file has to match the grid, the grid is only touched once the whole file decoded
+	static bool load(Grid& grid, const std::string& path, BS::thread_pool& pool);
+
+	// compressed payload for one chunk, empty if the chunk is empty
+	static std::vector<uint8_t> encode_chunk(const Grid& grid, int cx, int cy, uint32_t* raw_size = nullptr);
+	// replaces the whole chunk, an empty payload clears it
+	static bool decode_chunk(Grid& grid, int cx, int cy, const uint8_t* data, size_t size, uint32_t raw_size);
+
+	// same encoding on a detached copy of a chunk's CHUNK_SIZE * CHUNK_SIZE cells
+	static std::vector<uint8_t> encode_cells(const Particle* cells, uint32_t* raw_size);
+	static bool decode_cells(const uint8_t* data, size_t size, uint32_t raw_size, Particle* cells);
+};
@@ -0,0 +1,261 @@
+﻿#include "stamp_library.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <zstd.h>
+
+#include "profiling.h"
+
+namespace
+{
+	constexpr int COMPRESSION_LEVEL = 3;
+	// largest uncompressed library load accepts, far above any set of stamps a session collects
+	constexpr uint64_t MAX_RAW_SIZE = uint64_t(256) << 20;
+
+	template<typename T>
+	void write(std::vector<uint8_t>& out, T value)
+	{
+		const auto at = out.size();
+		out.resize(at + sizeof(T));
+		std::memcpy(out.data() + at, &value, sizeof(T));
+	}
+
+	template<typename T>
+	bool read(const uint8_t*& in, const uint8_t* end, T& value)
+	{
+		if (end - in < static_cast<ptrdiff_t>(sizeof(T))) return false;
+		std::memcpy(&value, in, sizeof(T));
+		in += sizeof(T);
+		return true;
+	}
+}
+
+Stamp Stamp::encode(const Particle::Type* types, int width, int height)
+{
+	Stamp stamp;
+	stamp.width = width;
+	stamp.height = height;
+	stamp.rows.reserve(static_cast<size_t>(height) + 1);
+	for (int y = 0; y < height; y++)
+	{
+		stamp.rows.push_back(static_cast<uint32_t>(stamp.runs.size()));
+		const Particle::Type* row = types + static_cast<size_t>(y) * width;
+		for (int x = 0; x < width;)
+		{
+			int length = 1;
+			while (x + length < width && length < UINT16_MAX && row[x + length] == row[x]) length++;
+			stamp.runs.push_back({ static_cast<uint16_t>(length), row[x] });
+			x += length;
+		}
+	}
+	stamp.rows.push_back(static_cast<uint32_t>(stamp.runs.size()));
+	return stamp;
+}
+
+bool StampLibrary::capture(const std::string& name, const Grid& grid, const CellRect& rect)
+{
+	const CellRect clip = { std::max(rect.x0, 0), std::max(rect.y0, 0),
+		std::min(rect.x1, static_cast<int>(grid.get_width())), std::min(rect.y1, static_cast<int>(grid.get_height())) };
+	if (clip.x0 >= clip.x1 || clip.y0 >= clip.y1)
+	{
+		std::cerr << "Nothing to capture for stamp " << name << std::endl;
+		return false;
+	}
+
+	const int width = clip.x1 - clip.x0;
+	const int height = clip.y1 - clip.y0;
+	std::vector<Particle::Type> types(static_cast<size_t>(width) * height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			types[static_cast<size_t>(y) * width + x] = grid.get(clip.x0 + x, clip.y0 + y)->type;
+	stamps[name] = std::make_shared<const Stamp>(Stamp::encode(types.data(), width, height));
+	return true;
+}
+
+bool StampLibrary::import(const std::string& name, const std::string& path, ImageLoader& loader)
+{
+	int width = 0, height = 0;
+	std::vector<Particle::Type> types;
+	if (!loader.quantize(path, width, height, types))
+		return false;
+	if (width > UINT16_MAX || height > UINT16_MAX)
+	{
+		std::cerr << "Image is too large for a stamp: " << path << std::endl;
+		return false;
+	}
+	stamps[name] = std::make_shared<const Stamp>(Stamp::encode(types.data(), width, height));
+	return true;
+}
+
+bool StampLibrary::place(const std::string& name, int x, int y, EditQueue& edits) const
+{
+	auto stamp = get(name);
+	if (!stamp)
+	{
+		std::cerr << "No stamp named " << name << std::endl;
+		return false;
+	}
+	edits.push({ .kind = Edit::PREFAB, .x = x, .y = y, .width = stamp->width, .height = stamp->height, .prefab = std::move(stamp) });
+	return true;
+}
+
+std::shared_ptr<const Stamp> StampLibrary::get(const std::string& name) const
+{
+	const auto it = stamps.find(name);
+	return it == stamps.end() ? nullptr : it->second;
+}
+
+std::vector<std::string> StampLibrary::get_names() const
+{
+	std::vector<std::string> names;
+	for (const auto& [name, stamp] : stamps)
+		names.push_back(name);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+bool StampLibrary::save(const std::string& path) const
+{
+	PROFILE_FUNCTION();
+	// [name length, name, width, height, run count, row run counts, runs] per stamp, compressed as a whole
+	std::vector<uint8_t> raw;
+	for (const auto& name : get_names())
+	{
+		const Stamp& stamp = *stamps.at(name);
+		write<uint32_t>(raw, static_cast<uint32_t>(name.size()));
+		raw.insert(raw.end(), name.begin(), name.end());
+		write<uint32_t>(raw, static_cast<uint32_t>(stamp.width));
+		write<uint32_t>(raw, static_cast<uint32_t>(stamp.height));
+		write<uint32_t>(raw, static_cast<uint32_t>(stamp.runs.size()));
+		for (int y = 0; y < stamp.height; y++)
+			write<uint32_t>(raw, stamp.rows[y + 1] - stamp.rows[y]);
+		for (const Stamp::Run& run : stamp.runs)
+		{
+			write<uint16_t>(raw, run.length);
+			write<uint16_t>(raw, static_cast<uint16_t>(run.type));
+		}
+	}
+
+	std::vector<uint8_t> compressed(ZSTD_compressBound(raw.size()));
+	const size_t size = ZSTD_compress(compressed.data(), compressed.size(), raw.data(), raw.size(), COMPRESSION_LEVEL);
+	if (ZSTD_isError(size))
+	{
+		std::cerr << "Failed to compress stamps: " << ZSTD_getErrorName(size) << std::endl;
+		return false;
+	}
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	const uint32_t count = static_cast<uint32_t>(stamps.size());
+	const uint64_t raw_size = raw.size();
+	file.write(MAGIC, sizeof(MAGIC));
+	file.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+	file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+	file.write(reinterpret_cast<const char*>(&raw_size), sizeof(raw_size));
+	file.write(reinterpret_cast<const char*>(compressed.data()), static_cast<std::streamsize>(size));
+	if (!file)
+	{
+		std::cerr << "Failed to write stamps: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool StampLibrary::load(const std::string& path)
+{
+	PROFILE_FUNCTION();
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+	{
+		std::cerr << "Failed to open stamps: " << path << std::endl;
+		return false;
+	}
+	const auto file_size = static_cast<size_t>(file.tellg());
+	file.seekg(0);
+
+	char magic[4];
+	uint32_t version = 0, count = 0;
+	uint64_t raw_size = 0;
+	file.read(magic, sizeof(magic));
+	file.read(reinterpret_cast<char*>(&version), sizeof(version));
+	file.read(reinterpret_cast<char*>(&count), sizeof(count));
+	file.read(reinterpret_cast<char*>(&raw_size), sizeof(raw_size));
+	if (!file || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION)
+	{
+		std::cerr << "Not a stamp library: " << path << std::endl;
+		return false;
+	}
+
+	std::vector<uint8_t> compressed(file_size - static_cast<size_t>(file.tellg()));
+	file.read(reinterpret_cast<char*>(compressed.data()), static_cast<std::streamsize>(compressed.size()));
+	// the size comes from the file, check it against the frame before allocating that much
+	if (!file || raw_size > MAX_RAW_SIZE || ZSTD_getFrameContentSize(compressed.data(), compressed.size()) != raw_size)
+	{
+		std::cerr << "Stamp library is corrupt: " << path << std::endl;
+		return false;
+	}
+	std::vector<uint8_t> raw(raw_size);
+	const size_t decompressed = ZSTD_decompress(raw.data(), raw.size(), compressed.data(), compressed.size());
+	if (!file || ZSTD_isError(decompressed) || decompressed != raw_size)
+	{
+		std::cerr << "Stamp library is corrupt: " << path << std::endl;
+		return false;
+	}
+
+	// a file corrupt partway through adds none of its stamps
+	tsl::robin_map<std::string, std::shared_ptr<const Stamp>> loaded;
+	const uint8_t* in = raw.data();
+	const uint8_t* end = raw.data() + raw.size();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t name_size, width, height, run_count;
+		bool ok = read(in, end, name_size) && static_cast<size_t>(end - in) >= name_size;
+		std::string name;
+		if (ok)
+		{
+			name.assign(reinterpret_cast<const char*>(in), name_size);
+			in += name_size;
+		}
+		ok = ok && read(in, end, width) && read(in, end, height) && read(in, end, run_count);
+
+		auto stamp = std::make_shared<Stamp>();
+		stamp->width = static_cast<int>(width);
+		stamp->height = static_cast<int>(height);
+		stamp->rows.push_back(0);
+		for (uint32_t y = 0; ok && y < height; y++)
+		{
+			uint32_t runs;
+			// a row past run_count would also wrap the running total
+			ok = read(in, end, runs) && runs <= run_count - stamp->rows.back();
+			stamp->rows.push_back(stamp->rows.back() + runs);
+		}
+		// each run takes 4 bytes, more than are left and run_count can't be trusted with an allocation
+		ok = ok && stamp->rows.back() == run_count && run_count <= static_cast<size_t>(end - in) / 4;
+		stamp->runs.reserve(ok ? run_count : 0);
+		for (uint32_t r = 0; ok && r < run_count; r++)
+		{
+			uint16_t length, type;
+			ok = read(in, end, length) && read(in, end, type) && ParticleUtils::colors.contains(static_cast<Particle::Type>(type));
+			stamp->runs.push_back({ length, static_cast<Particle::Type>(type) });
+		}
+		// every row has to add up to the width
+		for (uint32_t y = 0; ok && y < height; y++)
+		{
+			uint32_t cells = 0;
+			for (uint32_t r = stamp->rows[y]; r < stamp->rows[y + 1]; r++)
+				cells += stamp->runs[r].length;
+			ok = cells == width;
+		}
+		if (!ok)
+		{
+			std::cerr << "Stamp library is corrupt: " << path << std::endl;
+			return false;
+		}
+		loaded[name] = std::move(stamp);
+	}
+	for (const auto& [name, stamp] : loaded)
+		stamps[name] = stamp;
+	return true;
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <tsl/robin_map.h>
+
+#include "camera.h"
+#include "edit_queue.h"
+#include "grid.h"
+#include "image_loader.h"
+
+// pre quantized rectangle of materials, run length encoded per row so placing it is a few span fills per row
+struct Stamp
+{
+	struct Run
+	{
+		uint16_t length;
+		Particle::Type type;
+	};
+
+	int width = 0;
+	int height = 0;
+	std::vector<Run> runs;
+	std::vector<uint32_t> rows; // index of the first run of each row, plus one past the last
+
+	static Stamp encode(const Particle::Type* types, int width, int height);
+	// bytes the encoded stamp takes in memory
+	size_t get_bytes() const { return runs.size() * sizeof(Run) + rows.size() * sizeof(uint32_t); }
+};
+
+// named stamps captured from the world or imported from images once, placed as edits at any position.
+// empty cells of a stamp are transparent, placing it never erases what is around the shape.
+// the library file is the per row run counts and runs of each stamp, zstd compressed
+class StampLibrary
+{
+	tsl::robin_map<std::string, std::shared_ptr<const Stamp>> stamps;
+public:
+	static constexpr char MAGIC[4] = { 'F', 'S', 'S', 'L' };
+	static constexpr uint32_t VERSION = 1;
+
+	// copies the materials in rect, clipped to the world. between ticks only
+	bool capture(const std::string& name, const Grid& grid, const CellRect& rect);
+	// quantizes the image at its own size
+	bool import(const std::string& name, const std::string& path, ImageLoader& loader);
+	// pushes an edit stamping name with its top left corner at (x, y)
+	bool place(const std::string& name, int x, int y, EditQueue& edits) const;
+
+	std::shared_ptr<const Stamp> get(const std::string& name) const;
+	// sorted
+	std::vector<std::string> get_names() const;
+
+	bool save(const std::string& path) const;
+	// adds every stamp in the file, replacing ones with the same name. a corrupt file adds none
+	bool load(const std::string& path);
+};
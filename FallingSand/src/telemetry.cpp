@@ -0,0 +1,164 @@
+﻿#include "telemetry.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <sstream>
+
+Telemetry::~Telemetry()
+{
+	close();
+}
+
+bool Telemetry::open(const std::string& path)
+{
+	close();
+	file.open(path, std::ios::trunc);
+	if (!file)
+	{
+		std::cerr << "Failed to open telemetry for writing: " << path << std::endl;
+		return false;
+	}
+	this->path = path;
+	csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+	header_written = false;
+	uploaded = 0;
+	last_phases.clear();
+	stopping = false;
+	writer = std::thread(&Telemetry::write_loop, this);
+	return true;
+}
+
+std::string Telemetry::column(PerfPhase phase, PerfEvent event)
+{
+	std::string name = std::string(PerfCounters::name(phase)) + "_" + PerfCounters::name(event);
+	for (char& c : name)
+		c = c == ' ' ? '_' : static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+	return name;
+}
+
+Telemetry::PhaseValues Telemetry::phase_deltas()
+{
+	PhaseValues deltas;
+	for (auto& values : deltas)
+		values.fill(-1);
+	if (!PerfCounters::is_counting_phases()) return deltas;
+
+	const auto phases = PerfCounters::read_phases();
+	last_phases.resize(phases.size());
+	for (size_t t = 0; t < phases.size(); t++)
+	{
+		for (size_t p = 0; p < PerfCounters::PHASES; p++)
+		{
+			for (size_t e = 0; e < PerfCounters::EVENTS; e++)
+			{
+				const int64_t value = phases[t][p][e];
+				if (value < 0) continue;
+				deltas[p][e] = std::max<int64_t>(deltas[p][e], 0) + value - last_phases[t][p][e];
+			}
+		}
+	}
+	last_phases = phases;
+	return deltas;
+}
+
+std::string Telemetry::format(const TickStats& stats, int64_t rss, const PhaseValues& phases) const
+{
+	std::ostringstream out;
+	if (csv)
+	{
+		out << stats.tick << ',' << stats.total_ms << ',' << stats.edits_ms << ',' << stats.even_ms << ',' << stats.odd_ms << ','
+			<< stats.release_ms << ',' << stats.even_wait_ms << ',' << stats.odd_wait_ms << ',' << stats.even_imbalance << ','
+			<< stats.odd_imbalance << ',' << stats.schedule_us << ',' << stats.active_cells << ',' << stats.swaps << ',' << stats.sets << ',' << stats.reactions << ','
+			<< uploaded << ',' << rss;
+		for (const auto& values : phases)
+		{
+			for (const int64_t value : values)
+				out << ',' << value;
+		}
+		for (const double busy : stats.busy_ms)
+			out << ',' << busy;
+	}
+	else
+	{
+		out << "{\"tick\":" << stats.tick << ",\"total_ms\":" << stats.total_ms << ",\"edits_ms\":" << stats.edits_ms
+			<< ",\"even_ms\":" << stats.even_ms << ",\"odd_ms\":" << stats.odd_ms << ",\"release_ms\":" << stats.release_ms
+			<< ",\"even_wait_ms\":" << stats.even_wait_ms << ",\"odd_wait_ms\":" << stats.odd_wait_ms
+			<< ",\"even_imbalance\":" << stats.even_imbalance << ",\"odd_imbalance\":" << stats.odd_imbalance << ",\"schedule_us\":" << stats.schedule_us
+			<< ",\"active_cells\":" << stats.active_cells << ",\"swaps\":" << stats.swaps << ",\"sets\":" << stats.sets
+			<< ",\"reactions\":" << stats.reactions << ",\"uploaded_bytes\":" << uploaded << ",\"rss_bytes\":" << rss;
+		for (size_t p = 0; p < PerfCounters::PHASES; p++)
+		{
+			for (size_t e = 0; e < PerfCounters::EVENTS; e++)
+				out << ",\"" << column(static_cast<PerfPhase>(p), static_cast<PerfEvent>(e)) << "\":" << phases[p][e];
+		}
+		out << ",\"busy_ms\":[";
+		for (size_t i = 0; i < stats.busy_ms.size(); i++)
+			out << (i > 0 ? "," : "") << stats.busy_ms[i];
+		out << "]}";
+	}
+	out << '\n';
+	return out.str();
+}
+
+void Telemetry::record(const TickStats& stats)
+{
+	if (!is_open()) return;
+	std::string line;
+	// the busy columns depend on the thread count, which isn't known before the first tick
+	if (csv && !header_written)
+	{
+		line = "tick,total_ms,edits_ms,even_ms,odd_ms,release_ms,even_wait_ms,odd_wait_ms,even_imbalance,odd_imbalance,schedule_us,active_cells,swaps,sets,reactions,uploaded_bytes,rss_bytes";
+		for (size_t p = 0; p < PerfCounters::PHASES; p++)
+		{
+			for (size_t e = 0; e < PerfCounters::EVENTS; e++)
+				line += "," + column(static_cast<PerfPhase>(p), static_cast<PerfEvent>(e));
+		}
+		for (size_t i = 0; i < stats.busy_ms.size(); i++)
+			line += ",busy_ms_" + std::to_string(i);
+		line += '\n';
+	}
+	header_written = true;
+	line += format(stats, PerfCounters::resident_bytes(), phase_deltas());
+	uploaded = 0;
+	{
+		std::lock_guard lock(mutex);
+		lines.push_back(std::move(line));
+	}
+	cv.notify_one();
+}
+
+void Telemetry::write_loop()
+{
+	std::deque<std::string> batch;
+	while (true)
+	{
+		{
+			std::unique_lock lock(mutex);
+			cv.wait(lock, [this] { return stopping || !lines.empty(); });
+			// drain everything before stopping so no record is lost
+			if (lines.empty()) return;
+			batch.swap(lines);
+		}
+		for (const std::string& line : batch)
+			file << line;
+		file.flush();
+		batch.clear();
+	}
+}
+
+void Telemetry::close()
+{
+	if (!writer.joinable()) return;
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	cv.notify_one();
+	writer.join();
+	file.close();
+	if (!file)
+		std::cerr << "Failed to write telemetry: " << path << std::endl;
+	else
+		std::cout << "Wrote telemetry to " << path << std::endl;
+}
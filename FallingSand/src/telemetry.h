@@ -0,0 +1,54 @@
+﻿#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+#include "simulation.h"
+
+// one record per tick for offline analysis, json lines or csv when the path ends in .csv. records are formatted
+// on the calling thread and written by a background thread, so a slow disk never holds up a tick.
+// the game and the benchmark write the same columns. hardware counters per phase are -1 unless phase counting is on
+class Telemetry
+{
+	std::ofstream file;
+	std::string path;
+	bool csv = false;
+	bool header_written = false;
+	uint64_t uploaded = 0; // bytes since the last record
+	using PhaseValues = std::array<PerfCounters::Values, PerfCounters::PHASES>;
+	std::vector<PhaseValues> last_phases; // per thread totals at the last record
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::string> lines;
+	bool stopping = false;
+
+	void write_loop();
+	// what every phase's counters moved by over all threads since the last record, -1 when not counted
+	PhaseValues phase_deltas();
+	std::string format(const TickStats& stats, int64_t rss, const PhaseValues& phases) const;
+	static std::string column(PerfPhase phase, PerfEvent event);
+public:
+	Telemetry() = default;
+	~Telemetry();
+	Telemetry(const Telemetry&) = delete;
+	Telemetry& operator=(const Telemetry&) = delete;
+
+	bool open(const std::string& path);
+	bool is_open() const { return writer.joinable(); }
+	// texture bytes sent to the gpu, counted towards the next record
+	void add_upload(uint64_t bytes) { uploaded += bytes; }
+	// after every tick, on the thread that runs them
+	void record(const TickStats& stats);
+	// writes whatever is still queued and closes the file
+	void close();
+};
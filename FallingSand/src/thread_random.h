@@ -0,0 +1,32 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <random>
+
+// one generator per thread, seeded from the os until seed_thread_rand is called on that thread
+inline std::mt19937& thread_generator()
+{
+	static thread_local std::mt19937 generator(std::random_device{}());
+	return generator;
+}
+
+// Threadsafe random generator, converted by hand rather than with a std distribution so every standard library draws the same floats
+inline float thread_rand()
+{
+	return static_cast<float>(thread_generator()() >> 8) / (1 << 24);
+}
+
+// splitmix64 finalizer over the inputs, neighbouring ticks and tasks get unrelated seeds
+inline uint64_t mix_seed(uint64_t seed, uint64_t a, uint64_t b = 0)
+{
+	uint64_t z = seed ^ (a * 0x9E3779B97F4A7C15ull) ^ (b * 0xC2B2AE3D27D4EB4Full);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// makes every following thread_rand on this thread a function of seed
+inline void seed_thread_rand(uint64_t seed)
+{
+	thread_generator().seed(static_cast<uint32_t>(seed ^ (seed >> 32)));
+}
@@ -0,0 +1,140 @@
+﻿#include "tick_workers.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	thread_local std::optional<size_t> this_index;
+
+	// tells the core a spin loop is running, so the other hyperthread gets the pipeline
+	void spin_pause()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	void pin_thread(std::thread& thread, unsigned int index)
+	{
+		const unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+#ifdef _WIN32
+		SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (index % cores % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(index % cores, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+	}
+}
+
+TickWorkers::TickWorkers(unsigned int count, bool pin, const std::function<void()>& init)
+{
+	if (count > std::thread::hardware_concurrency())
+		spin_limit = 0;
+	count = std::max(count, 1u);
+	threads.reserve(count - 1);
+	for (unsigned int i = 0; i + 1 < count; i++)
+	{
+		threads.emplace_back([this, i, init] { worker_loop(i, init); });
+		if (pin)
+			pin_thread(threads.back(), i);
+	}
+}
+
+TickWorkers::~TickWorkers()
+{
+	// workers only read stopping after seeing a new generation
+	stopping = true;
+	generation.fetch_add(1);
+	generation.notify_all();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+std::optional<size_t> TickWorkers::get_index()
+{
+	return this_index;
+}
+
+void TickWorkers::worker_loop(unsigned int index, const std::function<void()>& init)
+{
+	this_index = index;
+	if (init) init();
+
+	uint32_t seen = 0;
+	while (true)
+	{
+		uint32_t current;
+		for (int spins = 0; (current = generation.load(std::memory_order_acquire)) == seen; spins++)
+		{
+			if (spins < spin_limit)
+			{
+				spin_pause();
+				continue;
+			}
+			// counted before checking again, so run either sees the sleeper or the sleeper sees the new generation
+			parked.fetch_add(1);
+			generation.wait(seen);
+			parked.fetch_sub(1);
+		}
+		seen = current;
+		if (stopping) return;
+
+		for (int i = next_task.fetch_add(1, std::memory_order_relaxed); i < task_count; i = next_task.fetch_add(1, std::memory_order_relaxed))
+			(*task)(i, index);
+
+		if (running.fetch_sub(1, std::memory_order_acq_rel) == 1 && caller_parked.load())
+			running.notify_one();
+	}
+}
+
+void TickWorkers::run(int count, const Task& phase)
+{
+	if (count <= 0) return;
+	task = &phase;
+	task_count = count;
+	next_task.store(0, std::memory_order_relaxed);
+	running.store(static_cast<unsigned int>(threads.size()), std::memory_order_relaxed);
+	generation.fetch_add(1);
+	if (parked.load() > 0)
+		generation.notify_all();
+
+	// the caller takes the last slot while it helps out, so anything indexed by worker sees it as one of them
+	const unsigned int index = get_thread_count() - 1;
+	const std::optional<size_t> outer_index = this_index;
+	this_index = index;
+	for (int i = next_task.fetch_add(1, std::memory_order_relaxed); i < task_count; i = next_task.fetch_add(1, std::memory_order_relaxed))
+		phase(i, index);
+	this_index = outer_index;
+
+	for (int spins = 0; ; spins++)
+	{
+		const unsigned int left = running.load(std::memory_order_acquire);
+		if (left == 0) break;
+		if (spins < spin_limit)
+		{
+			spin_pause();
+			continue;
+		}
+		caller_parked.store(true);
+		// the last worker may have counted out before seeing the flag, check again before sleeping
+		if (running.load() != 0)
+			running.wait(left);
+		caller_parked.store(false);
+	}
+	task = nullptr;
+}
@@ -0,0 +1,62 @@
+﻿#pragma once
+
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <BS_thread_pool.hpp>
+
+// threads that stay up for the whole session and run the phases of a tick, instead of the phases being submitted to
+// the pool as tasks and waited on through futures. a phase starts by bumping a generation number and ends when the
+// last worker counts itself out. the thread that calls run takes strips too, so count threads take part with only
+// count - 1 of them spawned. both sides spin for a while before parking, so back to back phases hand over without
+// going through the os
+class TickWorkers
+{
+	using Task = std::function<void(int task, unsigned int worker)>;
+
+	std::vector<std::thread> threads;
+
+	// the running phase, only written while every worker waits for the next generation
+	const Task* task = nullptr;
+	int task_count = 0;
+	alignas(64) std::atomic<int> next_task = 0;
+	alignas(64) std::atomic<uint32_t> generation = 0;
+	std::atomic<unsigned int> parked = 0; // workers asleep on generation, it is only notified when there are some
+	alignas(64) std::atomic<unsigned int> running = 0; // spawned workers still in the phase
+	std::atomic<bool> caller_parked = false;
+	bool stopping = false;
+	// 0 when there are more threads taking part than cores, spinning would only keep the others off theirs
+	int spin_limit = SPIN_LIMIT;
+
+	void worker_loop(unsigned int index, const std::function<void()>& init);
+public:
+	// pauses spent spinning before a thread parks, a few tens of microseconds
+	static constexpr int SPIN_LIMIT = 1 << 12;
+
+	// count threads take part in every phase, the caller and count - 1 spawned workers. pin puts worker i on core i,
+	// the caller is left where it is. init runs first thing on every spawned worker, like the pool's, the caller is
+	// expected to be set up already
+	TickWorkers(unsigned int count, bool pin, const std::function<void()>& init = {});
+	~TickWorkers();
+	TickWorkers(const TickWorkers&) = delete;
+	TickWorkers& operator=(const TickWorkers&) = delete;
+
+	// threads taking part, the caller included
+	unsigned int get_thread_count() const { return static_cast<unsigned int>(threads.size()) + 1; }
+	// runs task(i, worker) for every i in [0, count), the workers and the caller take them in order, and returns once
+	// all are done. the caller runs its share as worker get_thread_count() - 1. one caller at a time
+	void run(int count, const Task& task);
+
+	// index of the calling worker, or of the caller while it is inside run, nullopt on other threads
+	static std::optional<size_t> get_index();
+};
+
+// index of the calling thread among the pool's threads or the tick workers, a tick only ever runs on one of them
+inline std::optional<size_t> worker_index()
+{
+	const std::optional<size_t> index = TickWorkers::get_index();
+	return index ? index : BS::this_thread::get_index();
+}
@@ -0,0 +1,342 @@
+﻿#include "world_stream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#include "profiling.h"
+
+namespace
+{
+	constexpr int CELLS = CHUNK_SIZE * CHUNK_SIZE;
+}
+
+WorldStreamer::WorldStreamer(Grid& grid, size_t budget) : grid(grid), budget(budget)
+{
+	const size_t count = grid.get_chunk_count();
+	states.assign(count, State::COLD);
+	last_used.assign(count, 0);
+	hashes.assign(count, 0);
+	on_disk.assign(count, 0);
+}
+
+WorldStreamer::~WorldStreamer()
+{
+	close();
+}
+
+uint64_t WorldStreamer::hash_cells(const Particle* cells)
+{
+	// 0 means all empty, which is also what a null chunk hashes to
+	uint64_t hash = 0;
+	for (int i = 0; i < CELLS; i++)
+	{
+		if (cells[i].type == Particle::EMPTY) continue;
+		hash = (hash ^ (static_cast<uint64_t>(i) << 48 | static_cast<uint64_t>(cells[i].type) << 32 | cells[i].color.hex())) * 0x100000001B3ull;
+		hash += hash == 0;
+	}
+	return hash;
+}
+
+bool WorldStreamer::open(const std::string& world_path)
+{
+	close();
+	path = world_path;
+	const size_t count = grid.get_chunk_count();
+	index.assign(count, {});
+
+	if (!std::filesystem::exists(path))
+	{
+		// blank world, every chunk empty
+		Snapshot::Header header{};
+		std::memcpy(header.magic, Snapshot::MAGIC, sizeof(Snapshot::MAGIC));
+		header.version = Snapshot::VERSION;
+		header.width = grid.get_width();
+		header.height = grid.get_height();
+		header.chunk_size = CHUNK_SIZE;
+		header.chunks_x = grid.get_chunks_x();
+		header.chunks_y = grid.get_chunks_y();
+		std::ofstream create(path, std::ios::binary);
+		create.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		create.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(Snapshot::IndexEntry));
+		if (!create)
+		{
+			std::cerr << "Failed to create world file: " << path << std::endl;
+			return false;
+		}
+	}
+
+	if (!mapped.map(path) || mapped.size() < sizeof(Snapshot::Header) + count * sizeof(Snapshot::IndexEntry))
+	{
+		std::cerr << "Failed to map world file: " << path << std::endl;
+		return false;
+	}
+	Snapshot::Header header;
+	std::memcpy(&header, mapped.data(), sizeof(header));
+	if (std::memcmp(header.magic, Snapshot::MAGIC, sizeof(Snapshot::MAGIC)) != 0 || header.version != Snapshot::VERSION
+		|| header.chunk_size != CHUNK_SIZE || header.width != grid.get_width() || header.height != grid.get_height())
+	{
+		std::cerr << "World file does not match the grid: " << path << std::endl;
+		mapped.unmap();
+		return false;
+	}
+	std::memcpy(index.data(), mapped.data() + sizeof(Snapshot::Header), count * sizeof(Snapshot::IndexEntry));
+	for (size_t i = 0; i < count; i++)
+		on_disk[i] = index[i].compressed_size > 0;
+	file_end = mapped.size();
+
+	file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+	if (!file)
+	{
+		std::cerr << "Failed to open world file for writing: " << path << std::endl;
+		mapped.unmap();
+		return false;
+	}
+
+	stopping = false;
+	io_thread = std::thread(&WorldStreamer::io_loop, this);
+	return true;
+}
+
+void WorldStreamer::push(Job job)
+{
+	{
+		std::lock_guard lock(mutex);
+		jobs.push_back(std::move(job));
+	}
+	cv.notify_one();
+}
+
+void WorldStreamer::io_loop()
+{
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock lock(mutex);
+			cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+			// drain everything before stopping so evicted chunks reach the disk
+			if (jobs.empty()) return;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		if (job.kind == Job::LOAD)
+		{
+			auto result = load(job.index);
+			std::lock_guard lock(mutex);
+			finished.push_back(std::move(result));
+		}
+		else
+		{
+			store(job.index, job.cells.get());
+		}
+	}
+}
+
+WorldStreamer::Loaded WorldStreamer::load(uint32_t i)
+{
+	PROFILE_FUNCTION();
+	const auto& entry = index[i];
+	if (entry.compressed_size == 0)
+		return { i, nullptr, true };
+
+	// appended since the file was mapped
+	if (entry.offset + entry.compressed_size > mapped.size())
+	{
+		file.flush();
+		mapped.map(path);
+	}
+	if (entry.offset + entry.compressed_size > mapped.size())
+		return { i, nullptr, false };
+
+	auto cells = std::make_unique<Particle[]>(CELLS);
+	const bool ok = Snapshot::decode_cells(mapped.data() + entry.offset, entry.compressed_size, entry.raw_size, cells.get());
+	return { i, std::move(cells), ok };
+}
+
+void WorldStreamer::store(uint32_t i, const Particle* cells)
+{
+	PROFILE_FUNCTION();
+	Snapshot::IndexEntry entry{};
+	if (cells)
+	{
+		const auto payload = Snapshot::encode_cells(cells, &entry.raw_size);
+		if (!payload.empty())
+		{
+			// the old payload's slot if it fits, the file only grows for chunks that got bigger
+			const bool fits = payload.size() <= index[i].compressed_size;
+			entry.offset = fits ? index[i].offset : file_end;
+			entry.compressed_size = static_cast<uint32_t>(payload.size());
+			file.seekp(static_cast<std::streamoff>(entry.offset));
+			file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+			if (fits)
+				file.flush(); // the slot is inside the mapped view, a later load reads it from there
+			else
+				file_end += payload.size();
+		}
+	}
+	index[i] = entry;
+	file.seekp(static_cast<std::streamoff>(sizeof(Snapshot::Header) + i * sizeof(Snapshot::IndexEntry)));
+	file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+	if (!file)
+		std::cerr << "Failed to write chunk " << i << " to " << path << std::endl;
+}
+
+void WorldStreamer::evict(uint32_t i)
+{
+	const int cx = static_cast<int>(i % grid.get_chunks_x());
+	const int cy = static_cast<int>(i / grid.get_chunks_x());
+	const Chunk* chunk = grid.get_chunk(cx, cy);
+	const uint64_t hash = chunk ? hash_cells(chunk->cells) : 0;
+	if (hash != hashes[i])
+	{
+		std::unique_ptr<Particle[]> cells;
+		if (hash != 0)
+		{
+			cells = std::make_unique<Particle[]>(CELLS);
+			std::copy(chunk->cells, chunk->cells + CELLS, cells.get());
+		}
+		on_disk[i] = hash != 0;
+		push({ Job::STORE, i, std::move(cells) });
+	}
+	grid.clear_chunk(cx, cy);
+	states[i] = State::COLD;
+}
+
+void WorldStreamer::update(const CellRect& region)
+{
+	PROFILE_FUNCTION();
+	if (!io_thread.joinable()) return;
+	frame++;
+
+	std::vector<Loaded> done;
+	{
+		std::lock_guard lock(mutex);
+		done.swap(finished);
+	}
+	for (auto& result : done)
+	{
+		if (states[result.index] != State::LOADING) continue;
+		if (!result.ok)
+			std::cerr << "Failed to read chunk " << result.index << " from " << path << std::endl;
+		const int cx = static_cast<int>(result.index % grid.get_chunks_x());
+		const int cy = static_cast<int>(result.index / grid.get_chunks_x());
+		if (result.cells)
+			grid.write_chunk(cx, cy, result.cells.get());
+		hashes[result.index] = result.cells ? hash_cells(result.cells.get()) : 0;
+		states[result.index] = State::RESIDENT;
+		resident.push_back(result.index);
+	}
+
+	// request everything around the region, closest rows first doesn't matter much for a few chunks
+	const int cx0 = std::max((region.x0 >> CHUNK_SHIFT) - margin, 0);
+	const int cy0 = std::max((region.y0 >> CHUNK_SHIFT) - margin, 0);
+	const int cx1 = std::min(((region.x1 + CHUNK_MASK) >> CHUNK_SHIFT) + margin, static_cast<int>(grid.get_chunks_x()));
+	const int cy1 = std::min(((region.y1 + CHUNK_MASK) >> CHUNK_SHIFT) + margin, static_cast<int>(grid.get_chunks_y()));
+	for (int cy = cy0; cy < cy1; cy++)
+	{
+		for (int cx = cx0; cx < cx1; cx++)
+		{
+			const auto i = static_cast<uint32_t>(cy * grid.get_chunks_x() + cx);
+			last_used[i] = frame;
+			if (states[i] != State::COLD) continue;
+			if (!on_disk[i])
+			{
+				// nothing stored, skip the round trip
+				hashes[i] = 0;
+				states[i] = State::RESIDENT;
+				resident.push_back(i);
+				continue;
+			}
+			states[i] = State::LOADING;
+			push({ Job::LOAD, i, nullptr });
+		}
+	}
+
+	if (resident.size() <= budget) return;
+	// coldest first, chunks around the region were just touched and are never picked
+	std::sort(resident.begin(), resident.end(), [this](uint32_t a, uint32_t b) { return last_used[a] > last_used[b]; });
+	while (resident.size() > budget && last_used[resident.back()] != frame)
+	{
+		evict(resident.back());
+		resident.pop_back();
+	}
+}
+
+void WorldStreamer::close()
+{
+	if (!io_thread.joinable()) return;
+	for (uint32_t i : resident)
+		evict(i);
+	resident.clear();
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	cv.notify_one();
+	io_thread.join();
+	finished.clear();
+	std::fill(states.begin(), states.end(), State::COLD);
+	file.close();
+	compact();
+	mapped.unmap();
+}
+
+void WorldStreamer::compact()
+{
+	PROFILE_FUNCTION();
+	const uint64_t payloads_start = sizeof(Snapshot::Header) + index.size() * sizeof(Snapshot::IndexEntry);
+	uint64_t live = 0;
+	for (const auto& entry : index)
+		live += entry.compressed_size;
+	if (!mapped.map(path))
+	{
+		std::cerr << "Failed to map world file: " << path << std::endl;
+		return;
+	}
+	// nothing left behind by stores
+	if (mapped.size() == payloads_start + live) return;
+
+	std::vector<Snapshot::IndexEntry> packed(index.size());
+	uint64_t offset = payloads_start;
+	for (size_t i = 0; i < index.size(); i++)
+	{
+		if (index[i].compressed_size == 0 || index[i].offset + index[i].compressed_size > mapped.size()) continue;
+		packed[i] = { offset, index[i].compressed_size, index[i].raw_size };
+		offset += index[i].compressed_size;
+	}
+
+	// written next to the world and renamed over it, a failed write leaves the old file as it was
+	const std::string compact_path = path + ".compact";
+	{
+		std::ofstream out(compact_path, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(mapped.data()), sizeof(Snapshot::Header));
+		out.write(reinterpret_cast<const char*>(packed.data()), packed.size() * sizeof(Snapshot::IndexEntry));
+		for (size_t i = 0; i < index.size(); i++)
+		{
+			if (packed[i].compressed_size > 0)
+				out.write(reinterpret_cast<const char*>(mapped.data() + index[i].offset), index[i].compressed_size);
+		}
+		if (!out)
+		{
+			std::cerr << "Failed to compact world file: " << path << std::endl;
+			out.close();
+			std::error_code error;
+			std::filesystem::remove(compact_path, error);
+			return;
+		}
+	}
+	mapped.unmap();
+	std::error_code error;
+	std::filesystem::rename(compact_path, path, error);
+	if (error)
+	{
+		std::cerr << "Failed to compact world file: " << path << ", " << error.message() << std::endl;
+		std::filesystem::remove(compact_path, error);
+		return;
+	}
+	index = std::move(packed);
+	file_end = offset;
+}
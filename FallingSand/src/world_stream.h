@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera.h"
+#include "grid.h"
+#include "mapped_file.h"
+#include "snapshot.h"
+
+// keeps only the chunks around a region of interest in the grid, the rest of the world stays in a snapshot file.
+// the file's chunk index sits at a fixed offset, so chunks are paged in from a memory mapped view on demand.
+// cold chunks are evicted least recently used first and written back by a background io thread. a payload goes
+// over the chunk's old one when it fits and is appended otherwise, its index entry is patched in place and close
+// compacts the file again
+class WorldStreamer
+{
+	enum class State : uint8_t
+	{
+		COLD,
+		LOADING,
+		RESIDENT,
+	};
+
+	struct Job
+	{
+		enum Kind { LOAD, STORE } kind;
+		uint32_t index;
+		std::unique_ptr<Particle[]> cells; // STORE only, nullptr stores an empty chunk
+	};
+
+	struct Loaded
+	{
+		uint32_t index;
+		std::unique_ptr<Particle[]> cells; // nullptr for an empty chunk
+		bool ok;
+	};
+
+	Grid& grid;
+	size_t budget; // resident chunks
+	int margin = 2; // chunks kept around the region
+
+	// main thread only
+	std::vector<State> states;
+	std::vector<uint64_t> last_used;
+	std::vector<uint64_t> hashes; // content when paged in, unchanged chunks are not written back
+	std::vector<uint8_t> on_disk; // chunk has a payload in the file
+	std::vector<uint32_t> resident;
+	uint64_t frame = 0;
+
+	// io thread only
+	std::string path;
+	MappedFile mapped;
+	std::fstream file;
+	std::vector<Snapshot::IndexEntry> index;
+	uint64_t file_end = 0;
+
+	std::thread io_thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Job> jobs;
+	std::vector<Loaded> finished;
+	bool stopping = false;
+
+	void io_loop();
+	Loaded load(uint32_t i);
+	void store(uint32_t i, const Particle* cells);
+	void push(Job job);
+	void evict(uint32_t i);
+	// io thread stopped, rewrites the file with only the payloads the index points at
+	void compact();
+	static uint64_t hash_cells(const Particle* cells);
+public:
+	WorldStreamer(Grid& grid, size_t budget);
+	~WorldStreamer();
+	WorldStreamer(const WorldStreamer&) = delete;
+	WorldStreamer& operator=(const WorldStreamer&) = delete;
+
+	// creates an empty world file if none exists, world size in the file has to match the grid
+	bool open(const std::string& path);
+	// main thread between ticks. installs finished loads, requests the chunks around region and evicts the coldest over budget
+	void update(const CellRect& region);
+	// writes every resident chunk back, stops the io thread and compacts the file
+	void close();
+
+	size_t get_resident() const { return resident.size(); }
+};